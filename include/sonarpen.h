@@ -10,6 +10,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
 
 // Audio libraries
 #include <alsa/asoundlib.h>
@@ -41,6 +44,167 @@
  */
 #define MAX_RMS_VALUE 32767
 
+/**
+ * @brief Default frequency of the probe tone in Hz, shared by playback and detection.
+ *
+ * Used unless a carrier sweep found a better one for the sound card.
+ */
+#define PROBE_TONE_FREQUENCY 2000.0f
+
+/**
+ * @brief Frames per capture block when the narrowband detector is active.
+ */
+#define DETECTOR_BLOCK_FRAMES 256
+
+/**
+ * @brief Default lock-in bandwidth in Hz. Lower is quieter, higher reacts faster.
+ */
+#define DETECTOR_BANDWIDTH_HZ 60.0f
+
+/**
+ * @brief Period size requested in low-latency mode, in frames.
+ */
+#define LOW_LATENCY_PERIOD_FRAMES 128
+
+/**
+ * @brief Number of periods per ALSA buffer in low-latency mode.
+ */
+#define LOW_LATENCY_PERIODS 3
+
+// Audio Stream Configuration
+
+/**
+ * @brief Requested ALSA stream parameters.
+ *
+ * Zero values keep whatever the device hands out, which is how the driver
+ * has always opened its streams.
+ */
+typedef struct {
+    const char *device;               /**< ALSA PCM name, e.g. "default" or "hw:1,0". */
+    const char *capture_device;       /**< Capture PCM name when it differs, NULL to use device. */
+    unsigned int rate;                /**< Sample rate in Hz, 0 for the stream default. */
+    snd_pcm_uframes_t period_frames;  /**< Period size, 0 for the device default. */
+    unsigned int periods;             /**< Periods per buffer, 0 for the device default. */
+    int use_mmap;                     /**< Access samples in place through mmap. */
+} AudioConfig;
+
+/**
+ * @brief Parameters a stream actually got from the device.
+ */
+typedef struct {
+    unsigned int rate;                /**< Negotiated sample rate in Hz. */
+    unsigned int channels;            /**< Interleaved channels per frame. */
+    snd_pcm_uframes_t period_frames;  /**< Negotiated period size. */
+    snd_pcm_uframes_t buffer_frames;  /**< Negotiated ring buffer size. */
+    int use_mmap;                     /**< 1 if mmap access was granted. */
+} AudioStreamInfo;
+
+/**
+ * @brief Stream interruptions a stream came back from.
+ *
+ * Written by the thread that owns the stream, read by anyone.
+ */
+typedef struct {
+    atomic_uint xruns;     /**< Overruns or underruns recovered with snd_pcm_recover(). */
+    atomic_uint suspends;  /**< Resumes after a system suspend. */
+} AudioRecovery;
+
+void audio_config_default(AudioConfig *config);
+void audio_config_low_latency(AudioConfig *config);
+int configure_pcm_stream(snd_pcm_t *handle, const AudioConfig *config, unsigned int channels,
+                         unsigned int default_rate, AudioStreamInfo *info);
+void print_stream_info(const char *label, const AudioStreamInfo *info);
+int audio_stream_recover(snd_pcm_t *handle, int err, AudioRecovery *recovery, const char *label);
+unsigned int audio_recovery_total(const AudioRecovery *recovery);
+
+// DSP Kernels
+
+const char *dsp_kernel_name(void);
+uint64_t dsp_sum_squares_s16(const int16_t *samples, size_t count);
+void dsp_deinterleave_s16(const int16_t *src, unsigned int channels, unsigned int channel,
+                          int16_t *dst, size_t frames);
+double dsp_dot_s16(const float *weights, const int16_t *samples, size_t count);
+void dsp_dot4_s16(const float *const weights[4], const int16_t *samples, size_t count, double sums[4]);
+
+// Tone Detection
+
+/**
+ * @brief Fraction bits of the levels on the fixed-point path; 1 << LEVEL_FRAC_BITS is one sample unit.
+ */
+#define LEVEL_FRAC_BITS 8
+
+/**
+ * @brief log2 of the entries in one period of the fixed-point detector's reference table.
+ */
+#define DETECTOR_TABLE_BITS 10
+
+/**
+ * @brief How the pressure level is extracted from a block of mic samples.
+ */
+typedef enum {
+    DETECTOR_RMS,       /**< Broadband RMS of the whole signal. */
+    DETECTOR_GOERTZEL,  /**< Single-bin Goertzel filter evaluated per block. */
+    DETECTOR_LOCKIN,    /**< I/Q lock-in demodulation with a continuous reference. */
+    DETECTOR_LOCKIN_FIXED /**< The lock-in in integer arithmetic, for the fixed-point path. */
+} DetectorType;
+
+/**
+ * @brief Narrowband detector tuned to the probe tone.
+ *
+ * The lock-in detector multiplies the signal with a reference oscillator
+ * running at the probe frequency and low-pass filters the I/Q products with
+ * two cascaded one-pole stages, so
+ * only energy close to the tone contributes. The reference phase carries
+ * over between blocks, which keeps the estimate stable for any block size.
+ *
+ * Both stages are linear, so a whole block folds into four weighted sums of
+ * the samples. For the block length set with tone_detector_set_block() the
+ * weights are tabulated and the sums run on the vector kernels; other
+ * lengths take the per-sample path.
+ *
+ * The fixed-point variant runs the same cascade on int32 I/Q in Q15 with a
+ * table reference driven by a phase accumulator like the tone engine's. Its
+ * stage coefficient is rounded to a power of two, so each stage is a shift
+ * and the bandwidth lands within a factor of sqrt(2) of the requested one.
+ */
+typedef struct {
+    DetectorType type;         /**< Detection method. */
+    float frequency;           /**< Probe tone frequency in Hz. */
+    unsigned int sample_rate;  /**< Capture sample rate in Hz. */
+    double ref_cos;            /**< Reference oscillator, in-phase component. */
+    double ref_sin;            /**< Reference oscillator, quadrature component. */
+    double rot_cos;            /**< Per-sample rotation of the reference. */
+    double rot_sin;
+    double lp_alpha;           /**< Coefficient of each one-pole low-pass stage. */
+    double i_stage;            /**< In-phase product after the first stage. */
+    double q_stage;            /**< Quadrature product after the first stage. */
+    double i_lp;               /**< Filtered in-phase product. */
+    double q_lp;               /**< Filtered quadrature product. */
+    double goertzel_coeff;     /**< 2*cos(w) for the Goertzel recursion. */
+    unsigned int mix_frames;   /**< Block length of the weight tables, 0 for none. */
+    double block_cos;          /**< Rotation of the reference over mix_frames samples. */
+    double block_sin;
+    double block_decay;        /**< (1 - lp_alpha)^mix_frames. */
+    float mix[4][DETECTOR_BLOCK_FRAMES]; /**< Stage 1 cos/sin and stage 2 cos/sin weights per sample. */
+    uint32_t fx_phase;         /**< Fixed point: reference phase, a full turn is 2^32. */
+    uint32_t fx_phase_inc;     /**< Fixed point: phase advance per sample. */
+    int fx_shift;              /**< Fixed point: each stage moves 2^-fx_shift of the way per sample. */
+    int32_t fx_i_stage;        /**< Fixed point: stage outputs in Q15 sample units. */
+    int32_t fx_q_stage;
+    int32_t fx_i_lp;
+    int32_t fx_q_lp;
+    int32_t level_q;           /**< Fixed point: newest level with LEVEL_FRAC_BITS fraction bits. */
+    int16_t fx_table[(1 << DETECTOR_TABLE_BITS) + 1]; /**< Fixed point: one sine period in Q15 plus a guard entry. */
+} ToneDetector;
+
+int tone_detector_init(ToneDetector *detector, DetectorType type, float frequency,
+                       unsigned int sample_rate, float bandwidth_hz);
+void tone_detector_set_phase(ToneDetector *detector, double phase);
+void tone_detector_reset(ToneDetector *detector);
+int tone_detector_set_block(ToneDetector *detector, unsigned int frames);
+float tone_detector_process(ToneDetector *detector, const int16_t *samples, int num_samples);
+int tone_detector_parse(const char *name, DetectorType *type);
+
 // Audio Capture 
 
 /**
@@ -50,29 +214,1081 @@ typedef struct {
     char *buffer;               /**< Buffer to hold audio data. */
     snd_pcm_t *handle;          /**< PCM device handle. */
     snd_pcm_hw_params_t *params;/**< Hardware parameters for PCM device. */
+    AudioStreamInfo info;       /**< Negotiated rate, period and buffer sizes. */
+    unsigned int block_frames;  /**< Frames read per capture_audio() call. */
+    uint64_t frames_read;       /**< Frames consumed since the stream was opened. */
+    ToneDetector *detector;     /**< Narrowband detector, or NULL for broadband RMS. */
+    int start_with_playback;    /**< Linked to playback: never start on its own, playback starts both. */
+    AudioRecovery recovery;     /**< Xruns and suspends the capture side came back from. */
 } AudioCapture;
 
+/**
+ * @brief capture_audio() result when the stream was restarted and no block was read.
+ */
+#define CAPTURE_RECOVERED -2.0f
+
 // Functions for Audio Capture
 
 int init_audio_capture(AudioCapture *audio_capture);
+int init_audio_capture_config(AudioCapture *audio_capture, const AudioConfig *config);
 float capture_audio(AudioCapture *audio_capture);
 void cleanup_audio_capture(AudioCapture *audio_capture);
 float calculate_rms(int16_t *samples, int num_samples);
 
+// Tone Generation
+
+/**
+ * @brief log2 of the number of entries in one period of the tone wavetable.
+ */
+#define TONE_TABLE_BITS 10
+
+/**
+ * @brief Length of the fade in/out applied when the tone starts or stops, in ms.
+ */
+#define TONE_RAMP_MS 5
+
+/**
+ * @brief Wavetable oscillator driven by a 32-bit integer phase accumulator.
+ *
+ * One sine period is computed once at init. Each sample is a table lookup
+ * with linear interpolation and an integer gain, so no trigonometry runs
+ * per sample. Gain changes are ramped to avoid clicks.
+ */
+typedef struct {
+    int16_t table[(1 << TONE_TABLE_BITS) + 1]; /**< One period plus a guard entry. */
+    uint32_t phase;            /**< Phase accumulator, a full turn is 2^32. */
+    uint32_t phase_inc;        /**< Phase advance per sample. */
+    int32_t gain;              /**< Current gain, Q24 (1 << 24 is full scale). */
+    int32_t target_gain;       /**< Gain the ramp is heading to, Q24. */
+    int32_t gain_step;         /**< Gain change per sample while ramping. */
+    unsigned int sample_rate;  /**< Output sample rate in Hz. */
+    float frequency;           /**< Current tone frequency in Hz. */
+} ToneEngine;
+
+void tone_engine_init(ToneEngine *engine, unsigned int sample_rate);
+void tone_engine_set_frequency(ToneEngine *engine, float frequency);
+void tone_engine_set_amplitude(ToneEngine *engine, float amplitude, unsigned int ramp_frames);
+void tone_engine_render(ToneEngine *engine, int16_t *dst, size_t frames, unsigned int stride);
+double tone_engine_phase(const ToneEngine *engine);
+
 // Functions for Sound Generation
 
 int init_audio_playback(void);
+int init_audio_playback_config(const AudioConfig *config);
+void get_playback_info(AudioStreamInfo *info);
 int play_tone(float frequency);
+double get_tone_phase(void);
+double get_tone_phase_at(uint64_t frame);
+uint64_t get_playback_frames_written(void);
+snd_pcm_t *get_playback_handle(void);
+const AudioRecovery *get_playback_recovery(void);
+void set_tone_amplitude(float amplitude, unsigned int ramp_ms);
 void cleanup_audio_playback(void);
 
+// Full-Duplex Audio
+
+/**
+ * @brief Sample rate used for both directions of the duplex engine.
+ */
+#define DUPLEX_SAMPLE_RATE 48000
+
+/**
+ * @brief Capture and playback running at one rate from a shared start.
+ *
+ * Both streams are opened at the same rate and, when the device allows it,
+ * linked with snd_pcm_link() so they start and stop on the same clock edge.
+ * The offset between the two stream positions tells which emitted frame a
+ * captured frame belongs to.
+ */
+typedef struct {
+    AudioCapture *capture;           /**< Capture side, owned by the caller. */
+    snd_pcm_t *playback;             /**< Playback side from SPsound_generator.c. */
+    unsigned int rate;               /**< Common sample rate in Hz. */
+    int linked;                      /**< 1 if snd_pcm_link() succeeded. */
+    snd_pcm_sframes_t offset_frames; /**< Last measured playback minus capture position. */
+} AudioDuplex;
+
+int init_audio_duplex(AudioDuplex *duplex, AudioCapture *capture, const AudioConfig *config);
+int audio_duplex_start(AudioDuplex *duplex, float frequency);
+int audio_duplex_measure_offset(AudioDuplex *duplex);
+void audio_duplex_align_detector(AudioDuplex *duplex, ToneDetector *detector);
+unsigned int audio_duplex_restarts(const AudioDuplex *duplex);
+void cleanup_audio_duplex(AudioDuplex *duplex);
+
+// SonarPen Autodetection
+
+/**
+ * @brief Peak amplitude of the probe burst (about -30 dBFS).
+ */
+#define AUTODETECT_AMPLITUDE 0.03f
+
+/**
+ * @brief Silence before the burst, covering thread start-up jitter.
+ */
+#define AUTODETECT_LEAD_MS 30
+
+/**
+ * @brief Length of the capture window, long enough for the burst plus output latency.
+ */
+#define AUTODETECT_WINDOW_MS 200
+
+/**
+ * @brief Number of distinct burst codes, i.e. playback devices probed at once per card.
+ */
+#define AUTODETECT_MAX_CODES 6
+
+/**
+ * @brief Most PCM streams probed in one run.
+ */
+#define AUTODETECT_MAX_STREAMS 32
+
+/**
+ * @brief Normalized correlation the burst must reach in the capture window.
+ */
+#define AUTODETECT_MIN_CORRELATION 0.6f
+
+/**
+ * @brief Loop gain from output to input the pen must reach (about -26 dB).
+ *
+ * The pen connects the headphone output straight to the mic input, while a
+ * speaker heard by a microphone loses far more.
+ */
+#define AUTODETECT_MIN_GAIN 0.05f
+
+/**
+ * @brief One playback or capture PCM taking part in a probe.
+ */
+typedef struct {
+    int card;                     /**< ALSA card index. */
+    int device;                   /**< PCM device index on the card. */
+    snd_pcm_stream_t stream;      /**< SND_PCM_STREAM_PLAYBACK or SND_PCM_STREAM_CAPTURE. */
+    char name[32];                /**< PCM name, "plughw:card,device". */
+    int code;                     /**< Playback: burst code index, -1 if not probed. */
+    float *burst;                 /**< Playback: burst samples, also the correlation reference. */
+    size_t burst_frames;          /**< Playback: burst length in frames. */
+    int16_t *samples;             /**< Capture: recorded mono window. */
+    size_t frames;                /**< Capture: frames recorded. */
+    int ok;                       /**< 1 if the stream opened and ran. */
+} AutodetectStream;
+
+/**
+ * @brief Playback/capture pair where the burst came back.
+ */
+typedef struct {
+    int card;                     /**< ALSA card index. */
+    int playback_device;          /**< Device that played the burst. */
+    int capture_device;           /**< Device that recorded it. */
+    float correlation;            /**< Normalized correlation, 0..1. */
+    float gain;                   /**< Loop gain from output to input. */
+    int round_trip_frames;        /**< Delay from writing the burst to reading it back. */
+} AutodetectResult;
+
+int autodetect_enumerate(AutodetectStream *streams, int max_streams);
+int autodetect_add_stream(AutodetectStream *streams, int count, int card, int device, snd_pcm_stream_t stream);
+size_t autodetect_make_burst(float *burst, size_t max_frames, int code, unsigned int rate);
+float autodetect_correlate(const float *burst, size_t burst_frames, const int16_t *samples, size_t frames,
+                           float *gain, size_t *lag);
+int autodetect_run(AutodetectStream *streams, int count, unsigned int window_ms, AutodetectResult *result);
+void autodetect_cleanup(AutodetectStream *streams, int count);
+
+// Pressure Mapping
+
+/**
+ * @brief Largest ABS_PRESSURE value reported by the virtual tablet (12 bits).
+ */
+#define PRESSURE_MAX 4095
+
+/**
+ * @brief The pressure curve is tabulated in 2^PRESSURE_LUT_BITS steps.
+ */
+#define PRESSURE_LUT_BITS 10
+
+/**
+ * @brief Share of the pressure range a light touch should produce.
+ */
+#define PRESSURE_LIGHT_TARGET 0.1f
+
+/**
+ * @brief Limits of the fitted gamma, so a bad calibration cannot flatten the curve.
+ */
+#define PRESSURE_GAMMA_MIN 0.25f
+#define PRESSURE_GAMMA_MAX 4.0f
+
+/**
+ * @brief Time each calibration level is recorded for.
+ */
+#define PRESSURE_CALIBRATION_MS 1500
+
+/**
+ * @brief Detector levels recorded by the calibration mode.
+ */
+typedef struct {
+    float noise_floor;  /**< Pen away from the screen. */
+    float hover;        /**< Pen held just above the screen. */
+    float light;        /**< Lightest touch that should draw. */
+    float full;         /**< Firm press, mapped to PRESSURE_MAX. */
+} PressureCalibration;
+
+/**
+ * @brief Transfer curve from detector level to ABS_PRESSURE, precomputed for the hot path.
+ */
+typedef struct {
+    float zero_level;       /**< Level that maps to 0. */
+    float scale;            /**< Table steps per level unit. */
+    float gamma;            /**< Fitted exponent, for reporting. */
+    float onset_level;      /**< Level above which the pen counts as touching down. */
+    float release_level;    /**< Level below which it counts as lifted. */
+    int32_t zero_q;         /**< Fixed point: zero_level with LEVEL_FRAC_BITS fraction bits. */
+    int64_t scale_q;        /**< Fixed point: table steps per fixed-point level unit, Q24. */
+    int32_t onset_q;        /**< Fixed point: onset_level. */
+    int32_t release_q;      /**< Fixed point: release_level. */
+    uint16_t lut[(1 << PRESSURE_LUT_BITS) + 1];  /**< Pressure at each table step. */
+} PressureCurve;
+
+void pressure_calibration_default(PressureCalibration *cal);
+int pressure_curve_build(PressureCurve *curve, const PressureCalibration *cal);
+int pressure_curve_map(const PressureCurve *curve, float level);
+int pressure_curve_map_fixed(const PressureCurve *curve, int32_t level_q);
+int pressure_calibrate(AudioDuplex *duplex, float frequency, PressureCalibration *cal);
+
+// Carrier Selection
+
+/**
+ * @brief Most candidate frequencies one sweep measures.
+ */
+#define CARRIER_MAX_CANDIDATES 16
+
+/**
+ * @brief Time each candidate is measured for, with and without the tone, after settling.
+ */
+#define CARRIER_MEASURE_MS 250
+
+/**
+ * @brief Settling time on top of the queued playback buffer before a measurement starts.
+ */
+#define CARRIER_SETTLE_MS 60
+
+/**
+ * @brief Lowest detector level that counts as the pen answering; below it the path is open.
+ */
+#define CARRIER_MIN_LEVEL 100.0f
+
+/**
+ * @brief Highest usable carrier as a share of the sample rate; anti-alias filters roll off above.
+ */
+#define CARRIER_MAX_RATE_SHARE 0.45f
+
+/**
+ * @brief Carriers from here on are inaudible to most adults.
+ */
+#define CARRIER_INAUDIBLE_HZ 17000.0f
+
+/**
+ * @brief An inaudible carrier is chosen over the best one if its SNR is at most this much lower.
+ */
+#define CARRIER_INAUDIBLE_MARGIN_DB 6.0f
+
+/**
+ * @brief Response of the jack and codec at one candidate carrier.
+ */
+typedef struct {
+    float frequency;  /**< Candidate in Hz. */
+    int usable;       /**< 1 if the candidate fits the rate and the pen answered on it. */
+    float signal;     /**< Detector level with the tone playing. */
+    float noise;      /**< Detector level with the tone silenced. */
+    float snr_db;     /**< 20 log10(signal / noise). */
+} CarrierResult;
+
+/**
+ * @brief Outcome of a carrier sweep.
+ */
+typedef struct {
+    CarrierResult results[CARRIER_MAX_CANDIDATES];  /**< One entry per candidate, in sweep order. */
+    int count;                                      /**< Entries in results. */
+    int best;                                       /**< Index of the chosen carrier, -1 if none is usable. */
+} CarrierSweep;
+
+int carrier_parse_list(const char *list, float *candidates, int max);
+int carrier_sweep(AudioDuplex *duplex, const float *candidates, int count, CarrierSweep *sweep);
+
+// Pressure Filtering
+
+/**
+ * @brief One Euro defaults: cutoff at rest, speed coefficient and derivative cutoff.
+ *
+ * Levels are normalized to the full-press level, so the speed is in full
+ * presses per second.
+ */
+#define ONE_EURO_MIN_CUTOFF_HZ 1.5f
+#define ONE_EURO_BETA 5.0f
+#define ONE_EURO_DERIVATIVE_CUTOFF_HZ 1.0f
+
+/**
+ * @brief Kalman defaults: process noise per second and measurement noise, both normalized.
+ */
+#define KALMAN_PROCESS_NOISE 0.01f
+#define KALMAN_MEASUREMENT_NOISE 4e-4f
+
+/**
+ * @brief How detector levels are smoothed before they become pressure.
+ */
+typedef enum {
+    PRESSURE_FILTER_NONE,      /**< Pass levels through unchanged. */
+    PRESSURE_FILTER_ONE_EURO,  /**< Low-pass whose cutoff rises with the rate of change. */
+    PRESSURE_FILTER_KALMAN     /**< Scalar Kalman filter with a random-walk model. */
+} PressureFilterType;
+
+/**
+ * @brief Adaptive smoothing between the detector and the pressure curve.
+ *
+ * Small capture blocks give fast but noisy levels. The filter removes the
+ * block-to-block jitter at constant pressure while still following quick
+ * presses and lifts.
+ */
+typedef struct {
+    PressureFilterType type;   /**< Filter method. */
+    float full_level;          /**< Level that normalizes the input to 0..1. */
+    int primed;                /**< 0 until the first level was seen. */
+    float min_cutoff;          /**< One Euro: cutoff at rest in Hz. */
+    float beta;                /**< One Euro: cutoff increase per unit of speed. */
+    float d_cutoff;            /**< One Euro: cutoff of the speed estimate in Hz. */
+    float x;                   /**< Filtered normalized level. */
+    float dx;                  /**< One Euro: filtered speed. */
+    float q;                   /**< Kalman: process noise per second. */
+    float r;                   /**< Kalman: measurement noise. */
+    float p;                   /**< Kalman: estimate variance. */
+    int32_t fx_full;           /**< Fixed point: full_level with LEVEL_FRAC_BITS fraction bits. */
+    int32_t fx_alpha_d;        /**< Fixed point, One Euro: speed smoothing per step, Q16. */
+    int32_t fx_c_min;          /**< Fixed point, One Euro: 2 pi min_cutoff dt, Q16. */
+    int32_t fx_c_beta;         /**< Fixed point, One Euro: 2 pi beta dt, Q16. */
+    int32_t fx_steps_per_s;    /**< Fixed point: 1 / dt, Q8. */
+    int64_t fx_q_dt;           /**< Fixed point, Kalman: process noise per step, Q30. */
+    int64_t fx_r;              /**< Fixed point, Kalman: measurement noise, Q30. */
+    int32_t fx_x;              /**< Fixed point: filtered normalized level, Q16. */
+    int64_t fx_dx;             /**< Fixed point, One Euro: filtered speed, Q16 per second. */
+    int64_t fx_p;              /**< Fixed point, Kalman: estimate variance, Q30. */
+} PressureFilter;
+
+int pressure_filter_init(PressureFilter *filter, PressureFilterType type, float full_level);
+void pressure_filter_reset(PressureFilter *filter);
+float pressure_filter_process(PressureFilter *filter, float level, float dt);
+void pressure_filter_set_step(PressureFilter *filter, float dt);
+int32_t pressure_filter_process_fixed(PressureFilter *filter, int32_t level_q);
+int pressure_filter_parse(const char *name, PressureFilterType *type);
+
+// Device Cache
+
+/**
+ * @brief Format version of the cache file; other versions are ignored.
+ */
+#define DEVICE_CACHE_VERSION 1
+
+/**
+ * @brief Capture time of the confirmation probe on top of lead-in and cached round trip (burst plus slack).
+ */
+#define DEVICE_CACHE_PROBE_MARGIN_MS 60
+
+/**
+ * @brief What worked last time, so a warm start can skip scanning.
+ *
+ * Sound cards and input devices are identified by what they are, not by
+ * their index or node, since both change between boots and docks.
+ */
+typedef struct {
+    int has_audio;                    /**< 1 if the audio fields hold a detected pen. */
+    char card_id[32];                 /**< ALSA card ID, e.g. "PCH" or "Headset". */
+    unsigned int usb_vendor;          /**< USB vendor ID of the card, 0 if not USB. */
+    unsigned int usb_product;         /**< USB product ID of the card, 0 if not USB. */
+    int playback_device;              /**< PCM device the pen is connected to. */
+    int capture_device;               /**< PCM device the pen is heard on. */
+    int round_trip_frames;            /**< Burst delay measured by the probe. */
+    float carrier;                    /**< Probe tone frequency chosen for the card, 0 if never swept. */
+    unsigned int rate;                /**< Negotiated sample rate, 0 if unknown. */
+    snd_pcm_uframes_t period_frames;  /**< Negotiated period size. */
+    unsigned int periods;             /**< Negotiated periods per buffer. */
+    int use_mmap;                     /**< 1 if mmap access was granted. */
+    int audio_in_use;                 /**< 1 if this run plays through the cached card; not saved. */
+
+    int has_calibration;              /**< 1 if calibration holds measured levels of the cached card. */
+    PressureCalibration calibration;  /**< Levels from the last calibration. */
+    float calibration_carrier;        /**< Probe tone the levels were measured at. */
+
+    int has_input;                    /**< 1 if the input fields hold a touch device. */
+    unsigned int input_bus;           /**< Bus type from libevdev_get_id_bustype(). */
+    unsigned int input_vendor;        /**< Vendor from libevdev_get_id_vendor(). */
+    unsigned int input_product;       /**< Product from libevdev_get_id_product(). */
+    char input_name[64];              /**< Device name from libevdev_get_name(). */
+} DeviceCache;
+
+int device_cache_path(char *path, size_t len);
+int device_cache_load(DeviceCache *cache);
+int device_cache_save(const DeviceCache *cache);
+int sound_card_identity(int card, char *card_id, size_t len, unsigned int *usb_vendor, unsigned int *usb_product);
+int device_cache_find_card(const DeviceCache *cache);
+void device_cache_set_card(DeviceCache *cache, int card);
+void device_cache_set_stream(DeviceCache *cache, const AudioStreamInfo *info);
+void device_cache_set_input(DeviceCache *cache, struct libevdev *dev);
+
 // Functions for Touchpad Interaction
 
+/**
+ * @brief Bits of TouchFrame::changed.
+ */
+#define TOUCH_FRAME_X (1u << 0)
+#define TOUCH_FRAME_Y (1u << 1)
+
+/**
+ * @brief Accumulated state of one source evdev frame (events up to SYN_REPORT).
+ */
+typedef struct {
+    struct timeval time;   /**< Timestamp of the closing SYN_REPORT. */
+    int x;                 /**< Current position of the forwarded contact. */
+    int y;
+    unsigned int changed;  /**< TOUCH_FRAME_* bits updated in this frame. */
+    int contact;           /**< 1 while the forwarded contact touches the surface. */
+    int resynced;          /**< Frame rebuilt from device state after SYN_DROPPED. */
+} TouchFrame;
+
+// Input Device Discovery
+
+/**
+ * @brief Results of input_hotplug_receive().
+ */
+enum {
+    HOTPLUG_IGNORED = 1,  /**< Event for a device that does not matter. */
+    HOTPLUG_ADDED,        /**< A usable touch device appeared. */
+    HOTPLUG_REMOVED       /**< An event device disappeared. */
+};
+
+/**
+ * @brief udev monitor that reports touch devices coming and going.
+ */
+typedef struct {
+    struct udev *udev;              /**< udev context. */
+    struct udev_monitor *monitor;   /**< Netlink monitor for the input subsystem. */
+    int fd;                         /**< Monitor descriptor for the event loop. */
+    const char *forced_path;        /**< Only bind this node, or NULL for the best device. */
+} InputHotplug;
+
+int input_device_score(struct libevdev *dev, struct udev_device *udev_dev);
+int probe_input_device(const char *path, struct udev_device *udev_dev);
+int discover_touch_device(char *path, size_t len);
+int find_input_device(const DeviceCache *cache, char *path, size_t len);
+int input_hotplug_init(InputHotplug *hotplug, const char *forced_path);
+int input_hotplug_receive(InputHotplug *hotplug, char *path, size_t len);
+void input_hotplug_cleanup(InputHotplug *hotplug);
+
+// Multi-touch Tracking
+
+/**
+ * @brief Maximum number of protocol B slots tracked.
+ */
+#define MT_MAX_SLOTS 16
+
+/**
+ * @brief A contact is the pen if it touched down this close to the acoustic onset.
+ */
+#define PEN_ONSET_WINDOW_NS 120000000ull
+
+/**
+ * @brief Mic level that marks a pen touch-down, and the lower level that ends it.
+ */
+#define PEN_ONSET_LEVEL 512.0f
+#define PEN_RELEASE_LEVEL 256.0f
+
+/**
+ * @brief One protocol B slot.
+ */
+typedef struct {
+    int tracking_id;   /**< -1 when the slot is empty. */
+    int x;             /**< ABS_MT_POSITION_X. */
+    int y;             /**< ABS_MT_POSITION_Y. */
+    uint64_t down_ns;  /**< Touch-down time, CLOCK_MONOTONIC. */
+    int dirty;         /**< Changed since the last forwarded frame. */
+} MtContact;
+
+/**
+ * @brief Slot tracker that decides which contact is the pen.
+ *
+ * Works on the event stream the forwarder already reads. The pen is the
+ * contact whose touch-down lines up with the rise of the acoustic pressure;
+ * palms and other fingers are ignored.
+ */
+typedef struct {
+    int enabled;                     /**< Source supports protocol B. */
+    int num_slots;                   /**< Slots in use, at most MT_MAX_SLOTS. */
+    int current_slot;                /**< Slot addressed by the next MT event. */
+    MtContact slots[MT_MAX_SLOTS];   /**< Contact state per slot. */
+    int pen_slot;                    /**< Slot forwarded as the pen, -1 if none. */
+    int pen_locked;                  /**< pen_slot was matched to an onset. */
+    uint64_t onset_ns;               /**< Last acoustic pressure onset. */
+} MtTracker;
+
+void mt_tracker_init(MtTracker *tracker, struct libevdev *dev);
+void mt_tracker_resync(MtTracker *tracker, struct libevdev *dev, uint64_t now_ns);
+void mt_tracker_handle_event(MtTracker *tracker, const struct input_event *ev);
+void mt_tracker_note_onset(MtTracker *tracker, uint64_t onset_ns);
+int mt_tracker_select_pen(MtTracker *tracker);
+
 int init_touchpad_device(struct libevdev **dev, const char *path);
 void process_touchpad_events(struct libevdev *dev);
+int touch_frame_add_event(TouchFrame *frame, MtTracker *tracker, const struct input_event *ev);
+int read_touch_frame(struct libevdev *dev, TouchFrame *frame, MtTracker *tracker);
 int read_touchpad_events(const char *device_path);
 
+// Coordinate Mapping
+
+/**
+ * @brief Largest ABS_X/ABS_Y value of the virtual tablet; every source is mapped onto 0..COORD_OUTPUT_MAX.
+ */
+#define COORD_OUTPUT_MAX 32767
+
+/**
+ * @brief Fraction bits of the fixed-point transform coefficients.
+ */
+#define COORD_FRACTION_BITS 16
+
+/**
+ * @brief How the touch surface is laid onto the virtual tablet, chosen on the command line.
+ *
+ * Rectangles are x, y, width and height as fractions of the full range.
+ */
+typedef struct {
+    int rotation;     /**< Clockwise rotation in degrees: 0, 90, 180 or 270. */
+    float region[4];  /**< Part of the touch surface that is used. */
+    float area[4];    /**< Part of the virtual tablet the region lands on. */
+} CoordMapping;
+
+/**
+ * @brief Affine transform from source positions to ABS_X/ABS_Y, precomputed for the hot path.
+ *
+ * Coefficients carry COORD_FRACTION_BITS fraction bits:
+ * out_x = (xx * x + xy * y + x0) >> COORD_FRACTION_BITS, likewise for y.
+ */
+typedef struct {
+    int64_t xx, xy, x0;        /**< Row producing ABS_X. */
+    int64_t yx, yy, y0;        /**< Row producing ABS_Y. */
+    int min_x, max_x;          /**< Output area on ABS_X; results are clamped to it. */
+    int min_y, max_y;          /**< Output area on ABS_Y. */
+    int resolution_x;          /**< Output units per mm on ABS_X, 0 if the source does not say. */
+    int resolution_y;          /**< Output units per mm on ABS_Y. */
+} CoordTransform;
+
+void coord_mapping_default(CoordMapping *mapping);
+int coord_mapping_parse_rect(const char *text, float rect[4]);
+int coord_transform_build(CoordTransform *transform, const struct input_absinfo *x,
+                          const struct input_absinfo *y, const CoordMapping *mapping);
+int coord_transform_from_device(CoordTransform *transform, struct libevdev *dev, const CoordMapping *mapping);
+void coord_transform_apply(const CoordTransform *transform, int x, int y, int *out_x, int *out_y);
+
 // Uinput device and event handling
-int setup_uinput_device(void);
+
+/**
+ * @brief USB IDs of the virtual tablet, used to skip it during device discovery.
+ */
+#define UINPUT_VENDOR_ID 0x1209
+#define UINPUT_PRODUCT_ID 0x5678
+
+/**
+ * @brief Maximum number of events in one output report, SYN_REPORT included.
+ */
+#define UINPUT_FRAME_MAX_EVENTS 32
+
+/**
+ * @brief Events of one report, written to uinput with a single write().
+ *
+ * Every event carries the timestamp of the source frame instead of a fresh
+ * gettimeofday() per event. Since the whole report reaches the input core in
+ * one write, the kernel also stamps it as one unit.
+ */
+typedef struct {
+    int fd;                                              /**< uinput file descriptor. */
+    struct timeval time;                                 /**< Timestamp shared by all events. */
+    int count;                                           /**< Events queued so far. */
+    struct input_event events[UINPUT_FRAME_MAX_EVENTS];  /**< Queued events. */
+} UinputFrame;
+
+/**
+ * @brief Position axes the virtual tablet advertises.
+ */
+typedef struct {
+    struct input_absinfo x;  /**< Range and resolution of ABS_X. */
+    struct input_absinfo y;  /**< Range and resolution of ABS_Y. */
+    int direct;              /**< 1 for a screen (INPUT_PROP_DIRECT), 0 for an indirect pad. */
+} TabletAxes;
+
+void tablet_axes_default(TabletAxes *axes);
+int tablet_axes_from_device(struct libevdev *dev, const CoordMapping *mapping, TabletAxes *axes);
+int probe_touch_axes(const char *path, const CoordMapping *mapping, TabletAxes *axes);
+int setup_uinput_device(const TabletAxes *axes);
 void emit(int fd, int type, int code, int value);
+void uinput_frame_begin(UinputFrame *frame, int fd, const struct timeval *time);
+void uinput_frame_add(UinputFrame *frame, int type, int code, int value);
+int uinput_frame_commit(UinputFrame *frame);
+
+// Arena and Allocation Guard
+
+/**
+ * @brief Size of the arena the driver places the audio path's working memory in.
+ */
+#define HOT_PATH_ARENA_SIZE (64 * 1024)
+
+/**
+ * @brief Bump allocator over one mapping made at init.
+ *
+ * Blocks are never freed one by one; the whole arena goes at once. Not
+ * thread-safe: carve everything out before the threads start.
+ */
+typedef struct {
+    unsigned char *base;  /**< Start of the mapping. */
+    size_t size;          /**< Bytes mapped. */
+    size_t used;          /**< Bytes handed out, including alignment padding. */
+} Arena;
+
+int arena_init(Arena *arena, size_t size);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_cleanup(Arena *arena);
+int alloc_guard_enable(void);
+void alloc_guard_enter(void);
+void alloc_guard_leave(void);
+
+// Exported by libsonarpen-allocguard.so (src/SPalloc_guard.c), looked up by alloc_guard_enable()
+void sonarpen_alloc_guard_arm(void);
+void sonarpen_alloc_guard_enter(void);
+void sonarpen_alloc_guard_leave(void);
+
+// Lock-free queues
+
+/**
+ * @brief Bounded single-producer/single-consumer ring buffer.
+ *
+ * One thread may push and one other thread may pop without any lock.
+ * Head and tail live on separate cache lines so the producer and the
+ * consumer do not bounce the same line between cores.
+ */
+typedef struct {
+    _Alignas(64) atomic_size_t head;  /**< Next slot to write, owned by the producer. */
+    _Alignas(64) atomic_size_t tail;  /**< Next slot to read, owned by the consumer. */
+    _Alignas(64) size_t capacity;     /**< Number of slots, always a power of two. */
+    size_t elem_size;                 /**< Size of one element in bytes. */
+    unsigned char *slots;             /**< capacity * elem_size bytes of storage. */
+    int owns_slots;                   /**< 1 if slots came from the heap and are freed with the queue. */
+} SpscQueue;
+
+int spsc_queue_init(SpscQueue *queue, size_t capacity, size_t elem_size, Arena *arena);
+int spsc_queue_push(SpscQueue *queue, const void *elem);
+int spsc_queue_push_overwrite(SpscQueue *queue, const void *elem);
+int spsc_queue_pop(SpscQueue *queue, void *elem);
+size_t spsc_queue_depth(SpscQueue *queue);
+void spsc_queue_cleanup(SpscQueue *queue);
+
+// Event Loop
+
+/**
+ * @brief Maximum number of sources one event loop can watch.
+ */
+#define EVENT_LOOP_MAX_SOURCES 8
+
+/**
+ * @brief Maximum number of poll descriptors per source (ALSA PCMs may use several).
+ */
+#define EVENT_SOURCE_MAX_FDS 4
+
+/**
+ * @brief Called by the event loop with the ready events (EPOLLIN/POLLIN style bits).
+ */
+typedef void (*EventCallback)(void *userdata, uint32_t events);
+
+/**
+ * @brief One watched input: a plain descriptor or all poll descriptors of a PCM.
+ */
+typedef struct {
+    int in_use;                              /**< Slot is taken. */
+    struct pollfd fds[EVENT_SOURCE_MAX_FDS]; /**< Watched descriptors. */
+    int num_fds;                             /**< Number of valid entries in fds. */
+    snd_pcm_t *pcm;                          /**< PCM the descriptors belong to, or NULL. */
+    EventCallback callback;                  /**< Handler for ready events. */
+    void *userdata;                          /**< Passed to the handler. */
+} EventSource;
+
+/**
+ * @brief epoll-based loop that sleeps until a watched source has work.
+ */
+typedef struct {
+    int epoll_fd;                                /**< epoll instance. */
+    int wake_fd;                                 /**< eventfd used by event_loop_wake(). */
+    EventSource sources[EVENT_LOOP_MAX_SOURCES]; /**< Registered sources. */
+} EventLoop;
+
+int event_loop_init(EventLoop *loop);
+int event_loop_add_fd(EventLoop *loop, int fd, uint32_t events, EventCallback callback, void *userdata);
+int event_loop_add_pcm(EventLoop *loop, snd_pcm_t *pcm, EventCallback callback, void *userdata);
+void event_loop_remove_fd(EventLoop *loop, int fd);
+void event_loop_remove_pcm(EventLoop *loop, snd_pcm_t *pcm);
+void event_loop_wake(EventLoop *loop);
+int event_loop_run_once(EventLoop *loop, int timeout_ms);
+void event_loop_cleanup(EventLoop *loop);
+
+// Real-time Scheduling
+
+/**
+ * @brief SCHED_FIFO priority of the audio threads; the input/output thread runs one below.
+ *
+ * Below the usual 80+ of IRQ threads, above JACK/PipeWire clients.
+ */
+#define REALTIME_DEFAULT_PRIORITY 70
+
+/**
+ * @brief Nice level tried when SCHED_FIFO is not permitted.
+ */
+#define REALTIME_FALLBACK_NICE -11
+
+/**
+ * @brief Stack each real-time thread touches at startup.
+ */
+#define REALTIME_STACK_PREFAULT (128 * 1024)
+
+/**
+ * @brief Stack size of the worker threads in real-time mode, so locking them stays cheap.
+ */
+#define REALTIME_THREAD_STACK (512 * 1024)
+
+/**
+ * @brief Opt-in real-time settings of the pipeline threads.
+ */
+typedef struct {
+    int enabled;      /**< Use SCHED_FIFO, pinning and locked memory. */
+    int priority;     /**< SCHED_FIFO priority of the capture and tone threads. */
+    int capture_cpu;  /**< CPU of the capture thread, -1 for any. */
+    int tone_cpu;     /**< CPU of the tone thread, -1 for any. */
+    int io_cpu;       /**< CPU of the input/output thread, -1 for any. */
+} RealtimeConfig;
+
+void realtime_config_default(RealtimeConfig *rt);
+int realtime_parse_cpus(const char *text, RealtimeConfig *rt);
+int realtime_lock_memory(void);
+void realtime_prefault(void *buffer, size_t len);
+int realtime_enter_thread(const char *name, int priority, int cpu);
+
+// Metrics
+
+/**
+ * @brief Shared memory object the driver publishes its metrics in, read by sonarpen-stat.
+ */
+#define METRICS_SHM_NAME "/sonarpen-metrics"
+#define METRICS_MAGIC 0x314d5053u  /* "SPM1" */
+#define METRICS_VERSION 2
+
+/**
+ * @brief Histogram buckets: bucket 0 counts durations below 1 us, bucket i those below 2^i us.
+ */
+#define METRICS_HISTOGRAM_BUCKETS 24
+
+/**
+ * @brief Event counters.
+ */
+typedef enum {
+    METRIC_AUDIO_BLOCKS,        /**< Capture blocks measured. */
+    METRIC_TOUCH_FRAMES,        /**< Source frames read from the touch device. */
+    METRIC_TABLET_REPORTS,      /**< Reports written to the virtual tablet. */
+    METRIC_PRESSURE_DROPS,      /**< Oldest pressure samples dropped because the queue was full. */
+    METRIC_TOUCH_RESYNCS,       /**< SYN_DROPPED recoveries of the touch device. */
+    METRIC_CAPTURE_XRUNS,       /**< Capture overruns recovered. */
+    METRIC_CAPTURE_SUSPENDS,    /**< Capture resumes after a suspend. */
+    METRIC_PLAYBACK_XRUNS,      /**< Playback underruns recovered. */
+    METRIC_PLAYBACK_SUSPENDS,   /**< Playback resumes after a suspend. */
+    METRIC_IDLE_BURSTS,         /**< Tone bursts played while the pen was idle. */
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+/**
+ * @brief Latest values.
+ */
+typedef enum {
+    METRIC_QUEUE_DEPTH,         /**< Pressure samples the output thread found queued. */
+    METRIC_QUEUE_DEPTH_MAX,     /**< Deepest the pressure queue has been. */
+    METRIC_TONE_LEVEL,          /**< Latest detector level, in thousandths. */
+    METRIC_TONE_IDLE,           /**< 1 while the tone runs at the idle duty cycle. */
+    METRIC_GAUGE_COUNT
+} MetricGauge;
+
+/**
+ * @brief Duration histograms.
+ */
+typedef enum {
+    METRIC_CAPTURE_INTERVAL,    /**< Time between successive capture blocks. */
+    METRIC_DETECTOR_TIME,       /**< Time the detector spends on one block. */
+    METRIC_TOUCH_LATENCY,       /**< Touch event timestamp to the report write returning. */
+    METRIC_PRESSURE_LATENCY,    /**< End of a capture block to the report write returning. */
+    METRIC_HISTOGRAM_COUNT
+} MetricHistogram;
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} MetricsHistogram;
+
+/**
+ * @brief Metrics page, shared read-only with sonarpen-stat.
+ *
+ * Every field is a lock-free atomic updated with relaxed operations, so
+ * the audio threads never wait for a reader and readers never stop them.
+ */
+typedef struct {
+    uint32_t magic;             /**< METRICS_MAGIC once the page is initialized. */
+    uint32_t version;           /**< METRICS_VERSION. */
+    int64_t pid;                /**< Driver process. */
+    uint64_t started_ns;        /**< CLOCK_MONOTONIC time the driver started. */
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    _Atomic int64_t gauges[METRIC_GAUGE_COUNT];
+    MetricsHistogram histograms[METRIC_HISTOGRAM_COUNT];
+} SonarpenMetrics;
+
+int metrics_publish(void);
+void metrics_unpublish(void);
+const SonarpenMetrics *metrics_map(void);
+void metrics_unmap(const SonarpenMetrics *metrics);
+void metrics_count(MetricCounter counter, uint64_t n);
+void metrics_set(MetricGauge gauge, int64_t value);
+void metrics_set_max(MetricGauge gauge, int64_t value);
+void metrics_record(MetricHistogram histogram, uint64_t ns);
+void metrics_note_recovery(const AudioRecovery *capture, const AudioRecovery *playback);
+const char *metrics_counter_name(MetricCounter counter);
+const char *metrics_gauge_name(MetricGauge gauge);
+const char *metrics_histogram_name(MetricHistogram histogram);
+
+// Pipeline
+
+/**
+ * @brief Number of pressure samples buffered between capture and output.
+ */
+#define PRESSURE_QUEUE_LEN 64
+
+/**
+ * @brief Time without touch contact or pen pressure before the tone drops to the idle duty cycle.
+ */
+#define IDLE_ENTER_MS 2000
+
+/**
+ * @brief Time from the start of one idle burst to the next.
+ */
+#define IDLE_BURST_PERIOD_MS 250
+
+/**
+ * @brief Length of one idle burst, long enough for the detector to settle on a pressed pen.
+ */
+#define IDLE_BURST_MS 30
+
+/**
+ * @brief One pressure measurement handed from the capture thread to the output thread.
+ */
+typedef struct {
+    float level;            /**< Detector output for one audio block. */
+    int32_t level_q;        /**< The same with LEVEL_FRAC_BITS fraction bits, set instead on the fixed-point path. */
+    uint64_t timestamp_ns;  /**< CLOCK_MONOTONIC time the block finished capturing. */
+} PressureSample;
+
+/**
+ * @brief Pen state reported by the virtual tablet.
+ */
+typedef enum {
+    PEN_OUT,      /**< Out of range: BTN_TOOL_PEN released. */
+    PEN_HOVER,    /**< In range without pressure: BTN_TOOL_PEN held, BTN_TOUCH released. */
+    PEN_CONTACT   /**< Touching with pressure: BTN_TOOL_PEN and BTN_TOUCH held. */
+} PenState;
+
+/**
+ * @brief How the probe tone is being played.
+ *
+ * While nothing touches the screen the streams are stopped and started
+ * again for one short burst per IDLE_BURST_PERIOD_MS, so the audio device
+ * and the pipeline threads sleep most of the time.
+ */
+typedef enum {
+    TONE_CONTINUOUS,  /**< Both streams run and the tone never stops. */
+    TONE_BURST,       /**< The streams run for one idle burst. */
+    TONE_FADING,      /**< The tone ramps out before the streams stop. */
+    TONE_PARKED       /**< The streams are stopped until the next burst. */
+} ToneDuty;
+
+/**
+ * @brief State shared by the capture, tone and input/output threads.
+ *
+ * Capture and tone playback each run on a dedicated thread so that their
+ * blocking ALSA calls never delay touch events. The thread that calls
+ * pipeline_run() becomes the input/output thread: it sleeps in the event
+ * loop and forwards every touch event as soon as it arrives, tagged with the
+ * newest pressure sample. In single-thread mode the same event loop also
+ * services both PCMs.
+ *
+ * With idle_duty set, the input/output thread raises idle once no contact
+ * and no pen pressure was seen for IDLE_ENTER_MS and drops it on the next
+ * touch frame or pen onset. The side that owns the capture stream then
+ * switches tone_duty; in threaded mode it parks the tone thread and feeds
+ * the bursts itself.
+ */
+typedef struct {
+    AudioCapture *capture;       /**< Initialized capture stream. */
+    struct libevdev *touch_dev;  /**< Source touch device, NULL while none is bound. */
+    char touch_path[64];         /**< Device node of touch_dev. */
+    InputHotplug *hotplug;       /**< Rebinds the touch device when set. */
+    int uinput_fd;               /**< Virtual tablet created by setup_uinput_device(). */
+    float tone_frequency;        /**< Probe tone frequency in Hz. */
+    SpscQueue pressure_queue;    /**< Capture thread -> output thread. */
+    atomic_int running;          /**< Cleared to stop every thread. */
+    PressureSample last_pressure;/**< Freshest sample seen by the output thread. */
+    TouchFrame touch_frame;      /**< Source frame being assembled. */
+    MtTracker mt;                /**< Picks the pen among multi-touch contacts. */
+    int pen_sounding;            /**< Mic level is above the onset threshold. */
+    const PressureCurve *pressure_curve; /**< Level to ABS_PRESSURE mapping; must be set before pipeline_run(). */
+    PressureFilter pressure_filter; /**< Smoothing of the captured levels, run by the capture side. */
+    const CoordMapping *coord_mapping; /**< Layout of the touch surface on the tablet; NULL for the whole surface. */
+    CoordTransform transform;    /**< Source to tablet positions for touch_dev, built when it is bound. */
+    PenState pen_state;          /**< State last sent to the virtual tablet. */
+    int keys_unknown;            /**< A report failed, so the next one sends both keys. */
+    int reported_x;              /**< ABS_X last sent, -1 while the pen is out of range or after a failed report. */
+    int reported_y;              /**< ABS_Y last sent, -1 while the pen is out of range or after a failed report. */
+    int reported_pressure;       /**< ABS_PRESSURE last sent, -1 after a failed report. */
+    AudioDuplex *duplex;         /**< Started by pipeline_run() when set. */
+    int aligned;                 /**< Detector reference locked to the duplex offset. */
+    unsigned int restarts_seen;  /**< audio_duplex_restarts() when the detector was last aligned. */
+    uint64_t last_block_ns;      /**< When the previous capture block finished, for the interval metric. */
+    uint64_t forwarded_pressure_ns; /**< Capture time of the newest sample that reached the tablet. */
+    int single_thread;           /**< Service every stage from the event loop. */
+    int fixed_point;             /**< Levels come from a DETECTOR_LOCKIN_FIXED detector and stay integers. */
+    const RealtimeConfig *realtime; /**< Scheduling of the pipeline threads; NULL for normal scheduling. */
+    int idle_duty;               /**< Play the tone in short bursts while nothing touches the screen. */
+    atomic_int idle;             /**< Raised by the input/output thread while the pen is idle. */
+    uint64_t last_activity_ns;   /**< Last touch frame, contact or pen pressure seen by the input/output thread. */
+    ToneDuty tone_duty;          /**< Owned by the capture side. */
+    uint64_t duty_deadline_ns;   /**< End of the current burst, or start of the next one while parked. */
+    uint64_t burst_start_ns;     /**< When the current or last burst started. */
+    uint64_t fade_end_frame;     /**< Playback frame at which the tone has faded out. */
+    int quiet_align;             /**< Realign without reporting the offset, after a burst restarted the streams. */
+    pthread_mutex_t idle_lock;   /**< Guards idle changes the audio threads wait for, and tone_parked. */
+    pthread_cond_t idle_cond;    /**< Signalled when idle drops, the tone thread parks or is released. */
+    atomic_int tone_gate_closed; /**< The capture thread owns the playback; the tone thread must park. */
+    int tone_parked;             /**< The tone thread is waiting at the gate. */
+    int io_error;                /**< Set by an event handler that failed. */
+    EventLoop loop;              /**< Wakes the input/output thread. */
+    pthread_t capture_thread;
+    pthread_t tone_thread;
+} SonarpenPipeline;
+
+uint64_t monotonic_time_ns(void);
+int pipeline_init(SonarpenPipeline *pipeline, AudioCapture *capture, int uinput_fd, float tone_frequency,
+                  Arena *arena);
+int pipeline_bind_touch_device(SonarpenPipeline *pipeline, const char *path);
+void pipeline_unbind_touch_device(SonarpenPipeline *pipeline);
+int pipeline_attach_touch_device(SonarpenPipeline *pipeline, struct libevdev *dev, const char *name);
+void pipeline_replay_level(SonarpenPipeline *pipeline, float volume, float dt, uint64_t time_ns);
+void pipeline_replay_touch_event(SonarpenPipeline *pipeline, const struct input_event *ev);
+void pipeline_replay_finish(SonarpenPipeline *pipeline, uint64_t time_ns);
+int pipeline_run(SonarpenPipeline *pipeline);
+void pipeline_stop(SonarpenPipeline *pipeline);
+void pipeline_cleanup(SonarpenPipeline *pipeline);
+
+// Offline Replay
+
+/**
+ * @brief Offset added to recording times, so no replayed timestamp is 0 (which the tracker reads as unset).
+ */
+#define REPLAY_EPOCH_NS 1000000000ull
+
+/**
+ * @brief Mic recording read from a 16-bit PCM WAV file.
+ */
+typedef struct {
+    FILE *file;
+    unsigned int rate;         /**< Sample rate in Hz. */
+    unsigned int channels;     /**< Interleaved channels; only the first is used. */
+    uint32_t frames_left;      /**< Frames of the data chunk not read yet. */
+    int16_t scratch[BUFFER_SIZE / 2]; /**< Interleaved frames before channel 0 is taken out. */
+} WavReader;
+
+int wav_reader_open(WavReader *wav, const char *path);
+int wav_reader_read(WavReader *wav, int16_t *samples, int frames);
+void wav_reader_close(WavReader *wav);
+
+/**
+ * @brief Touch device recording in the text format of evemu-record.
+ *
+ * The header (N:, I:, P:, B:, A: lines) describes the device and is turned
+ * into a libevdev device without a file descriptor; E: lines are the events.
+ */
+typedef struct {
+    FILE *file;
+    struct libevdev *dev;      /**< Device described by the header; NULL once handed over. */
+    char line[256];            /**< First event line, read while parsing the header. */
+    int pending;               /**< line holds an event that was not returned yet. */
+} EvemuReader;
+
+int evemu_reader_open(EvemuReader *rec, const char *path);
+int evemu_reader_next(EvemuReader *rec, struct input_event *ev);
+void evemu_reader_close(EvemuReader *rec);
+
+/**
+ * @brief Inputs and settings of an offline replay.
+ */
+typedef struct {
+    const char *wav_path;      /**< Mic recording, or NULL to replay touch input without pressure. */
+    const char *events_path;   /**< evemu-record file of the touch device. */
+    const char *output_path;   /**< Receives the virtual tablet events as struct input_event records. */
+    double audio_offset_ms;    /**< Time of the first WAV sample on the event timeline. */
+    float tone_frequency;      /**< Probe tone frequency in Hz. */
+    unsigned int block_frames; /**< Frames per detector block, 1..DETECTOR_BLOCK_FRAMES. */
+    DetectorType detector;     /**< How levels are measured; DETECTOR_LOCKIN_FIXED replays the fixed-point path. */
+    PressureFilterType pressure_filter; /**< Smoothing applied to the mic level. */
+    PressureCalibration calibration;    /**< Levels the pressure curve is built from. */
+    CoordMapping mapping;      /**< Rotation, region and output area of the touch surface. */
+} ReplayConfig;
+
+/**
+ * @brief What a replay processed and how long it took.
+ */
+typedef struct {
+    unsigned long audio_blocks;    /**< Detector blocks fed to the pipeline. */
+    unsigned long touch_events;    /**< Recorded touch events fed to the pipeline. */
+    unsigned long output_events;   /**< Events written to the output file, SYN_REPORTs included. */
+    double recording_ms;           /**< Length of the replayed timeline. */
+    double processing_ms;          /**< Wall time spent replaying it. */
+} ReplayStats;
+
+void replay_config_default(ReplayConfig *config);
+int replay_run(const ReplayConfig *config, ReplayStats *stats);
+int replay_dump(const char *path, FILE *out);
+
+// Driver Configuration
+
+/**
+ * @brief Options of the driver, filled from the command line by main().
+ */
+typedef struct {
+    AudioConfig audio;          /**< Stream parameters for capture and playback. */
+    int single_thread;          /**< Run capture, tone and forwarding from one epoll loop. */
+    int calibrate;              /**< Record pressure levels before starting. */
+    PressureFilterType pressure_filter; /**< Smoothing applied to the mic level. */
+    DetectorType detector;      /**< How the probe tone level is measured. */
+    float carrier;              /**< Probe tone frequency in Hz, 0 for the cached or default one. */
+    int sweep_carriers;         /**< Measure candidate carriers first and use the best one. */
+    float carrier_candidates[CARRIER_MAX_CANDIDATES]; /**< Carriers to sweep; none for the defaults. */
+    int num_carrier_candidates; /**< Entries in carrier_candidates. */
+    const char *input_path;     /**< Touch device node, or NULL to discover it with udev. */
+    CoordMapping mapping;       /**< Rotation, region and output area of the touch surface. */
+    RealtimeConfig realtime;    /**< Opt-in real-time scheduling. */
+    int assert_no_alloc;        /**< Abort if the audio path allocates once the pipeline runs. */
+    int idle_duty;              /**< Play the tone in short bursts while nothing touches the screen. */
+    DeviceCache *cache;         /**< Devices of the last run, updated and saved; NULL for none. */
+} SonarpenConfig;
+
+void sonarpen_config_default(SonarpenConfig *config);
+int sonarpen_config_parse_args(SonarpenConfig *config, int argc, char *argv[]);
+void sonarpen_config_usage(const char *program);
+
+// Entry point
+
+int SPmouse_HID(const SonarpenConfig *config);
 
 #endif // SONARPEN_H
@@ -1,10 +1,20 @@
 #include "sonarpen.h"
 
-// Declaration of SPmouse_HID function (but not its implementation)
-extern int SPmouse_HID();
+int main(int argc, char *argv[]) {
+    SonarpenConfig config;
+    sonarpen_config_default(&config);
+
+    int rc = sonarpen_config_parse_args(&config, argc, argv);
+    if (rc != 0) {
+        return rc < 0 ? 1 : 0;
+    }
+
+    // Touch device and pressure calibration of the last run
+    DeviceCache cache;
+    device_cache_load(&cache);
+    config.cache = &cache;
 
-int main() {
     // Call SPmouse_HID to initialize the system
-    int result = SPmouse_HID();
+    int result = SPmouse_HID(&config);
     return result;
 }
@@ -0,0 +1,182 @@
+#include "sonarpen.h"
+
+/* This page contains the ALSA hardware/software parameter negotiation shared by capture and playback */
+
+/**
+ * @brief Fill a configuration that keeps the device defaults.
+ *
+ * @param config Configuration to fill.
+ */
+void audio_config_default(AudioConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->device = PCM_DEVICE;
+}
+
+/**
+ * @brief Fill a configuration with small periods and mmap access.
+ *
+ * @param config Configuration to fill.
+ */
+void audio_config_low_latency(AudioConfig *config) {
+    audio_config_default(config);
+    config->period_frames = LOW_LATENCY_PERIOD_FRAMES;
+    config->periods = LOW_LATENCY_PERIODS;
+    config->use_mmap = 1;
+}
+
+/**
+ * @brief Negotiate hardware and software parameters for an open PCM.
+ *
+ * Sets S16_LE interleaved samples, the requested rate and, when given, the
+ * period and buffer sizes. If mmap access is refused the stream falls back to
+ * read/write access. The software parameters wake the application once per
+ * period and start capture on the first read, so a small period really
+ * means a small delay.
+ *
+ * @param handle Open PCM handle.
+ * @param config Requested parameters.
+ * @param channels Interleaved channels per frame; a capture stream may get more.
+ * @param default_rate Rate used when config->rate is 0.
+ * @param info Receives the negotiated parameters.
+ * @return int 0 on success, negative ALSA error code on failure.
+ */
+int configure_pcm_stream(snd_pcm_t *handle, const AudioConfig *config, unsigned int channels,
+                         unsigned int default_rate, AudioStreamInfo *info) {
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *sw_params;
+    int err;
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(handle, params);
+
+    // Access type: in-place mmap if wanted and available
+    info->use_mmap = 0;
+    if (config->use_mmap) {
+        if (snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0) {
+            info->use_mmap = 1;
+        } else {
+            fprintf(stderr, "mmap access not supported, using read/write access\n");
+        }
+    }
+    if (!info->use_mmap) {
+        snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    }
+
+    snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+    // Capture may only offer more channels than asked for; the caller then reads the first one
+    if (snd_pcm_hw_params_set_channels(handle, params, channels) < 0 &&
+        snd_pcm_stream(handle) == SND_PCM_STREAM_CAPTURE) {
+        snd_pcm_hw_params_set_channels_near(handle, params, &channels);
+    }
+
+    unsigned int rate = config->rate ? config->rate : default_rate;
+    snd_pcm_hw_params_set_rate_near(handle, params, &rate, 0);
+
+    // Period first, then the buffer as a multiple of it
+    if (config->period_frames > 0) {
+        snd_pcm_uframes_t period = config->period_frames;
+        snd_pcm_hw_params_set_period_size_near(handle, params, &period, 0);
+        if (config->periods > 0) {
+            snd_pcm_uframes_t buffer = period * config->periods;
+            snd_pcm_hw_params_set_buffer_size_near(handle, params, &buffer);
+        }
+    }
+
+    if ((err = snd_pcm_hw_params(handle, params)) < 0) {
+        fprintf(stderr, "Unable to set HW parameters: %s\n", snd_strerror(err));
+        return err;
+    }
+
+    // Read back what the device actually granted
+    snd_pcm_hw_params_get_rate(params, &info->rate, 0);
+    snd_pcm_hw_params_get_period_size(params, &info->period_frames, 0);
+    snd_pcm_hw_params_get_buffer_size(params, &info->buffer_frames);
+    snd_pcm_hw_params_get_channels(params, &info->channels);
+
+    snd_pcm_sw_params_alloca(&sw_params);
+    if ((err = snd_pcm_sw_params_current(handle, sw_params)) < 0) {
+        fprintf(stderr, "Unable to get SW parameters: %s\n", snd_strerror(err));
+        return err;
+    }
+
+    snd_pcm_sw_params_set_avail_min(handle, sw_params, info->period_frames);
+    snd_pcm_sw_params_set_tstamp_mode(handle, sw_params, SND_PCM_TSTAMP_ENABLE);
+    if (config->period_frames > 0) {
+        // Capture starts with the first read; playback once two periods are queued
+        snd_pcm_uframes_t threshold = 1;
+        if (snd_pcm_stream(handle) == SND_PCM_STREAM_PLAYBACK) {
+            threshold = info->period_frames * 2;
+            if (threshold > info->buffer_frames) threshold = info->buffer_frames;
+        }
+        snd_pcm_sw_params_set_start_threshold(handle, sw_params, threshold);
+    }
+
+    if ((err = snd_pcm_sw_params(handle, sw_params)) < 0) {
+        fprintf(stderr, "Unable to set SW parameters: %s\n", snd_strerror(err));
+        return err;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Print the negotiated parameters of a stream.
+ *
+ * @param label Stream name shown in the output.
+ * @param info Negotiated parameters.
+ */
+void print_stream_info(const char *label, const AudioStreamInfo *info) {
+    printf("%s: %u Hz, %u ch, period %lu frames (%.2f ms), buffer %lu frames, %s access\n",
+           label, info->rate, info->channels,
+           (unsigned long)info->period_frames,
+           info->rate ? 1000.0 * info->period_frames / info->rate : 0.0,
+           (unsigned long)info->buffer_frames,
+           info->use_mmap ? "mmap" : "read/write");
+}
+
+/**
+ * @brief Bring a stream back after an xrun or a system suspend.
+ *
+ * The stream is left prepared; it restarts on the next write, with the
+ * linked playback, or by an explicit snd_pcm_start().
+ *
+ * @param handle Stream that failed.
+ * @param err Negative error code from the failed ALSA call.
+ * @param recovery Counters to update.
+ * @param label Stream name for the log.
+ * @return int 0 if the stream can go on, err or the recovery error otherwise.
+ */
+int audio_stream_recover(snd_pcm_t *handle, int err, AudioRecovery *recovery, const char *label) {
+    if (err == -EINTR) {
+        return 0;
+    }
+    if (err != -EPIPE && err != -ESTRPIPE) {
+        return err;
+    }
+
+    int rc = snd_pcm_recover(handle, err, 1);
+    if (rc < 0) {
+        fprintf(stderr, "%s: cannot recover from %s: %s\n", label, snd_strerror(err), snd_strerror(rc));
+        return rc;
+    }
+
+    if (err == -EPIPE) {
+        unsigned int count = atomic_fetch_add(&recovery->xruns, 1) + 1;
+        fprintf(stderr, "%s: recovered from %s (%u so far)\n", label,
+                snd_pcm_stream(handle) == SND_PCM_STREAM_CAPTURE ? "overrun" : "underrun", count);
+    } else {
+        unsigned int count = atomic_fetch_add(&recovery->suspends, 1) + 1;
+        fprintf(stderr, "%s: resumed after suspend (%u so far)\n", label, count);
+    }
+    return 0;
+}
+
+/**
+ * @brief Number of restarts a stream went through.
+ *
+ * @param recovery Counters of the stream.
+ * @return unsigned int Xruns plus suspends.
+ */
+unsigned int audio_recovery_total(const AudioRecovery *recovery) {
+    return atomic_load(&recovery->xruns) + atomic_load(&recovery->suspends);
+}
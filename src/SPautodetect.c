@@ -0,0 +1,416 @@
+#include "sonarpen.h"
+
+/* This page contains the SonarPen autodetection: every card is probed at once with a quiet coded burst */
+
+// Chips per burst code: one period of a 6-bit maximum length sequence
+#define BURST_CHIPS 63
+
+// Galois feedback masks of the primitive polynomials of degree 6, one code each
+static const uint8_t burst_code_taps[AUTODETECT_MAX_CODES] = { 0x21, 0x30, 0x33, 0x36, 0x2D, 0x39 };
+
+// Start gate: the main thread opens it once every probe thread has its PCM ready
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int arrived;
+    int open;
+} ProbeGate;
+
+typedef struct {
+    AutodetectStream *stream;
+    ProbeGate *gate;
+    size_t window_frames;
+    pthread_t thread;
+} ProbeThread;
+
+/**
+ * @brief Add one PCM to a probe list.
+ *
+ * Playback devices get the next free burst code of their card; devices
+ * beyond AUTODETECT_MAX_CODES on one card are listed but not probed.
+ *
+ * @param streams Probe list with room for at least count + 1 entries.
+ * @param count Entries already in the list.
+ * @param card ALSA card index.
+ * @param device PCM device index on the card.
+ * @param stream SND_PCM_STREAM_PLAYBACK or SND_PCM_STREAM_CAPTURE.
+ * @return int New number of entries.
+ */
+int autodetect_add_stream(AutodetectStream *streams, int count, int card, int device, snd_pcm_stream_t stream) {
+    AutodetectStream *entry = &streams[count];
+    memset(entry, 0, sizeof(*entry));
+    entry->card = card;
+    entry->device = device;
+    entry->stream = stream;
+    entry->code = -1;
+    snprintf(entry->name, sizeof(entry->name), "plughw:%d,%d", card, device);
+
+    if (stream == SND_PCM_STREAM_PLAYBACK) {
+        int used = 0;
+        for (int i = 0; i < count; i++) {
+            if (streams[i].card == card && streams[i].stream == SND_PCM_STREAM_PLAYBACK) used++;
+        }
+        if (used < AUTODETECT_MAX_CODES) {
+            entry->code = used;
+        } else {
+            fprintf(stderr, "Card %d: skipping playback device %d, out of burst codes\n", card, device);
+        }
+    }
+
+    return count + 1;
+}
+
+/**
+ * @brief List the PCMs of every card that has both playback and capture.
+ *
+ * The pen loops a headset output back into the mic input of the same jack,
+ * so output-only cards such as HDMI are never opened and stay silent.
+ *
+ * @param streams Receives the probe list.
+ * @param max_streams Capacity of streams.
+ * @return int Number of entries.
+ */
+int autodetect_enumerate(AutodetectStream *streams, int max_streams) {
+    snd_pcm_info_t *pcm_info;
+    snd_pcm_info_alloca(&pcm_info);
+    int count = 0;
+    int card = -1;
+
+    while (snd_card_next(&card) >= 0 && card >= 0) {
+        int playback[AUTODETECT_MAX_STREAMS], capture[AUTODETECT_MAX_STREAMS];
+        int num_playback = 0, num_capture = 0;
+        char card_name[32];
+        snd_ctl_t *ctl;
+
+        snprintf(card_name, sizeof(card_name), "hw:%d", card);
+        if (snd_ctl_open(&ctl, card_name, 0) < 0) continue;
+
+        int device = -1;
+        while (snd_ctl_pcm_next_device(ctl, &device) >= 0 && device >= 0) {
+            snd_pcm_info_set_device(pcm_info, device);
+            snd_pcm_info_set_subdevice(pcm_info, 0);
+
+            snd_pcm_info_set_stream(pcm_info, SND_PCM_STREAM_PLAYBACK);
+            if (snd_ctl_pcm_info(ctl, pcm_info) >= 0 && num_playback < AUTODETECT_MAX_STREAMS) {
+                playback[num_playback++] = device;
+            }
+            snd_pcm_info_set_stream(pcm_info, SND_PCM_STREAM_CAPTURE);
+            if (snd_ctl_pcm_info(ctl, pcm_info) >= 0 && num_capture < AUTODETECT_MAX_STREAMS) {
+                capture[num_capture++] = device;
+            }
+        }
+        snd_ctl_close(ctl);
+
+        if (num_playback == 0 || num_capture == 0) continue;
+
+        for (int i = 0; i < num_playback && count < max_streams; i++) {
+            count = autodetect_add_stream(streams, count, card, playback[i], SND_PCM_STREAM_PLAYBACK);
+        }
+        for (int i = 0; i < num_capture && count < max_streams; i++) {
+            count = autodetect_add_stream(streams, count, card, capture[i], SND_PCM_STREAM_CAPTURE);
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Build the BPSK burst of one code on the probe tone carrier.
+ *
+ * Each chip is one carrier cycle whose sign follows the code. The first
+ * and last chip are faded so the burst does not click.
+ *
+ * @param burst Receives the samples, scaled to AUTODETECT_AMPLITUDE.
+ * @param max_frames Capacity of burst.
+ * @param code Code index below AUTODETECT_MAX_CODES.
+ * @param rate Sample rate in Hz.
+ * @return size_t Burst length in frames, 0 if it does not fit.
+ */
+size_t autodetect_make_burst(float *burst, size_t max_frames, int code, unsigned int rate) {
+    size_t chip_frames = (size_t)(rate / PROBE_TONE_FREQUENCY + 0.5f);
+    size_t frames = chip_frames * BURST_CHIPS;
+    if (code < 0 || code >= AUTODETECT_MAX_CODES || chip_frames == 0 || frames > max_frames) {
+        return 0;
+    }
+
+    uint8_t state = 1;
+    for (size_t chip = 0; chip < BURST_CHIPS; chip++) {
+        float sign = (state & 1) ? 1.0f : -1.0f;
+        state = (state & 1) ? (uint8_t)((state >> 1) ^ burst_code_taps[code]) : (uint8_t)(state >> 1);
+
+        for (size_t i = 0; i < chip_frames; i++) {
+            size_t n = chip * chip_frames + i;
+            float envelope = 1.0f;
+            if (n < chip_frames) {
+                envelope = 0.5f - 0.5f * cosf((float)M_PI * n / chip_frames);
+            } else if (n >= frames - chip_frames) {
+                envelope = 0.5f - 0.5f * cosf((float)M_PI * (frames - 1 - n) / chip_frames);
+            }
+            burst[n] = AUTODETECT_AMPLITUDE * envelope * sign * sinf(2.0f * (float)M_PI * i / chip_frames);
+        }
+    }
+
+    return frames;
+}
+
+/**
+ * @brief Search a captured window for a burst.
+ *
+ * @param burst Reference burst from autodetect_make_burst().
+ * @param burst_frames Length of the burst.
+ * @param samples Captured mono samples.
+ * @param frames Number of captured frames.
+ * @param gain Receives the loop gain at the best lag (output to input amplitude).
+ * @param lag Receives the frame where the burst starts in the window.
+ * @return float Best normalized correlation, 0..1; 0 if the window is too short.
+ */
+float autodetect_correlate(const float *burst, size_t burst_frames, const int16_t *samples, size_t frames,
+                           float *gain, size_t *lag) {
+    double ref_energy = 0.0, window_energy = 0.0, best_dot = 0.0;
+    float best = 0.0f;
+
+    *gain = 0.0f;
+    *lag = 0;
+    if (frames < burst_frames || burst_frames == 0) {
+        return 0.0f;
+    }
+
+    for (size_t i = 0; i < burst_frames; i++) {
+        double x = samples[i] / 32768.0;
+        ref_energy += (double)burst[i] * burst[i];
+        window_energy += x * x;
+    }
+
+    for (size_t start = 0; start + burst_frames <= frames; start++) {
+        if (start > 0) {
+            // Slide the window energy by one frame
+            double out = samples[start - 1] / 32768.0;
+            double in = samples[start + burst_frames - 1] / 32768.0;
+            window_energy += in * in - out * out;
+        }
+
+        double dot = dsp_dot_s16(burst, samples + start, burst_frames) / 32768.0;
+
+        // The mic path may invert, so the sign does not matter
+        if (window_energy > 0.0) {
+            float c = (float)(fabs(dot) / sqrt(ref_energy * window_energy));
+            if (c > best) {
+                best = c;
+                best_dot = fabs(dot);
+                *lag = start;
+            }
+        }
+    }
+
+    *gain = (float)(best_dot / ref_energy);
+    return best;
+}
+
+// Play lead-in silence, the burst on the right channel (where the driver's tone goes) and silence to the window end
+static int play_burst(snd_pcm_t *handle, const AutodetectStream *stream, size_t window_frames) {
+    size_t lead = (size_t)DUPLEX_SAMPLE_RATE * AUTODETECT_LEAD_MS / 1000;
+    int16_t *buffer = calloc(window_frames * 2, sizeof(int16_t));
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < stream->burst_frames && lead + i < window_frames; i++) {
+        buffer[2 * (lead + i) + 1] = (int16_t)lrintf(stream->burst[i] * 32767.0f);
+    }
+
+    size_t done = 0;
+    int result = 0;
+    while (done < window_frames) {
+        snd_pcm_sframes_t n = snd_pcm_writei(handle, buffer + 2 * done, window_frames - done);
+        if (n < 0) {
+            if (snd_pcm_recover(handle, (int)n, 1) < 0) {
+                result = -1;
+                break;
+            }
+            continue;
+        }
+        done += (size_t)n;
+    }
+
+    snd_pcm_drop(handle);
+    free(buffer);
+    return result;
+}
+
+// Record the whole probe window
+static int record_window(snd_pcm_t *handle, AutodetectStream *stream, size_t window_frames) {
+    stream->samples = calloc(window_frames, sizeof(int16_t));
+    if (stream->samples == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    while (stream->frames < window_frames) {
+        snd_pcm_sframes_t n = snd_pcm_readi(handle, stream->samples + stream->frames, window_frames - stream->frames);
+        if (n < 0) {
+            if (snd_pcm_recover(handle, (int)n, 1) < 0) {
+                result = -1;
+                break;
+            }
+            continue;
+        }
+        stream->frames += (size_t)n;
+    }
+
+    snd_pcm_drop(handle);
+    return result;
+}
+
+// Probe thread: open and configure the PCM, wait at the gate, then play or record the window
+static void *probe_thread_main(void *arg) {
+    ProbeThread *probe = (ProbeThread *)arg;
+    AutodetectStream *stream = probe->stream;
+    int playback = stream->stream == SND_PCM_STREAM_PLAYBACK;
+    snd_pcm_t *handle = NULL;
+    int ready = 0;
+
+    // Non-blocking open, so a device held by a sound server fails at once
+    if (snd_pcm_open(&handle, stream->name, stream->stream, SND_PCM_NONBLOCK) == 0) {
+        AudioConfig config = { .device = stream->name, .rate = DUPLEX_SAMPLE_RATE,
+                               .period_frames = 256, .periods = 4 };
+        AudioStreamInfo info;
+
+        snd_pcm_nonblock(handle, 0);
+        ready = configure_pcm_stream(handle, &config, playback ? 2 : 1, DUPLEX_SAMPLE_RATE, &info) == 0 &&
+                info.rate == DUPLEX_SAMPLE_RATE && info.channels == (playback ? 2u : 1u);
+    }
+
+    pthread_mutex_lock(&probe->gate->lock);
+    probe->gate->arrived++;
+    pthread_cond_broadcast(&probe->gate->cond);
+    while (!probe->gate->open) {
+        pthread_cond_wait(&probe->gate->cond, &probe->gate->lock);
+    }
+    pthread_mutex_unlock(&probe->gate->lock);
+
+    if (ready) {
+        int rc = playback ? play_burst(handle, stream, probe->window_frames)
+                          : record_window(handle, stream, probe->window_frames);
+        stream->ok = rc == 0;
+    }
+
+    if (handle) snd_pcm_close(handle);
+    return NULL;
+}
+
+/**
+ * @brief Probe every listed PCM at once and find the pen.
+ *
+ * All streams are opened in parallel; once they are ready every playback
+ * device sends its own burst code while every capture device records.
+ * Each capture window is then correlated with the bursts of its card.
+ *
+ * @param streams Probe list from autodetect_enumerate() or autodetect_add_stream().
+ * @param count Number of entries.
+ * @param window_ms Capture window, 0 for AUTODETECT_WINDOW_MS. A known round trip allows a shorter one.
+ * @param result Receives the best pair when the pen is found.
+ * @return int 1 if the pen was found, 0 if not, -1 on failure.
+ */
+int autodetect_run(AutodetectStream *streams, int count, unsigned int window_ms, AutodetectResult *result) {
+    size_t window_frames = (size_t)DUPLEX_SAMPLE_RATE * (window_ms ? window_ms : AUTODETECT_WINDOW_MS) / 1000;
+    size_t lead = (size_t)DUPLEX_SAMPLE_RATE * AUTODETECT_LEAD_MS / 1000;
+    size_t max_burst = window_frames;
+    ProbeThread threads[AUTODETECT_MAX_STREAMS];
+    ProbeGate gate;
+    int launched = 0;
+    uint64_t start = monotonic_time_ns();
+
+    if (count > AUTODETECT_MAX_STREAMS) {
+        count = AUTODETECT_MAX_STREAMS;
+    }
+
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.cond, NULL);
+    gate.arrived = 0;
+    gate.open = 0;
+
+    for (int i = 0; i < count; i++) {
+        AutodetectStream *stream = &streams[i];
+
+        if (stream->stream == SND_PCM_STREAM_PLAYBACK) {
+            if (stream->code < 0) continue;
+            stream->burst = malloc(max_burst * sizeof(float));
+            if (stream->burst == NULL) continue;
+            stream->burst_frames = autodetect_make_burst(stream->burst, max_burst, stream->code, DUPLEX_SAMPLE_RATE);
+        }
+
+        threads[launched].stream = stream;
+        threads[launched].gate = &gate;
+        threads[launched].window_frames = window_frames;
+        if (pthread_create(&threads[launched].thread, NULL, probe_thread_main, &threads[launched]) != 0) {
+            perror("pthread_create");
+            continue;
+        }
+        launched++;
+    }
+
+    // Start playing only once every capture is ready to record
+    pthread_mutex_lock(&gate.lock);
+    while (gate.arrived < launched) {
+        pthread_cond_wait(&gate.cond, &gate.lock);
+    }
+    gate.open = 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
+
+    for (int i = 0; i < launched; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.lock);
+
+    int found = 0;
+    for (int c = 0; c < count; c++) {
+        const AutodetectStream *capture = &streams[c];
+        if (capture->stream != SND_PCM_STREAM_CAPTURE || !capture->ok) continue;
+
+        for (int p = 0; p < count; p++) {
+            const AutodetectStream *playback = &streams[p];
+            if (playback->stream != SND_PCM_STREAM_PLAYBACK || !playback->ok || playback->card != capture->card) {
+                continue;
+            }
+
+            float gain;
+            size_t lag;
+            float correlation = autodetect_correlate(playback->burst, playback->burst_frames,
+                                                     capture->samples, capture->frames, &gain, &lag);
+            printf("  Card %d: playback %d -> capture %d: correlation %.2f, gain %.3f\n",
+                   capture->card, playback->device, capture->device, correlation, gain);
+
+            if (correlation >= AUTODETECT_MIN_CORRELATION && gain >= AUTODETECT_MIN_GAIN &&
+                (!found || correlation > result->correlation)) {
+                result->card = capture->card;
+                result->playback_device = playback->device;
+                result->capture_device = capture->device;
+                result->correlation = correlation;
+                result->gain = gain;
+                result->round_trip_frames = (int)lag - (int)lead;
+                found = 1;
+            }
+        }
+    }
+
+    printf("Probed %d streams in %.0f ms\n", launched, (monotonic_time_ns() - start) / 1e6);
+    return found;
+}
+
+/**
+ * @brief Free the bursts and recordings of a probe list.
+ *
+ * @param streams Probe list.
+ * @param count Number of entries.
+ */
+void autodetect_cleanup(AutodetectStream *streams, int count) {
+    for (int i = 0; i < count; i++) {
+        free(streams[i].burst);
+        free(streams[i].samples);
+        streams[i].burst = NULL;
+        streams[i].samples = NULL;
+        streams[i].frames = 0;
+    }
+}
@@ -0,0 +1,206 @@
+#include "sonarpen.h"
+#include <getopt.h>
+
+/* This page contains the command line options of the driver */
+
+/**
+ * @brief Fill the configuration the driver used before options existed.
+ *
+ * @param config Configuration to fill.
+ */
+void sonarpen_config_default(SonarpenConfig *config) {
+    memset(config, 0, sizeof(*config));
+    audio_config_default(&config->audio);
+    config->pressure_filter = PRESSURE_FILTER_ONE_EURO;
+    config->detector = DETECTOR_LOCKIN;
+    coord_mapping_default(&config->mapping);
+    realtime_config_default(&config->realtime);
+}
+
+/**
+ * @brief Print the supported options.
+ *
+ * @param program Name of the executable.
+ */
+void sonarpen_config_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -d, --device NAME     ALSA PCM device for capture and playback (default \"%s\")\n", PCM_DEVICE);
+    printf("  -l, --low-latency     %d-frame periods, %d periods per buffer, mmap access\n",
+           LOW_LATENCY_PERIOD_FRAMES, LOW_LATENCY_PERIODS);
+    printf("  -p, --period FRAMES   ALSA period size in frames\n");
+    printf("  -n, --periods N       ALSA periods per buffer\n");
+    printf("  -m, --mmap            Process samples in place with mmap access\n");
+    printf("  -i, --input PATH      Touch device node (default: best device found with udev)\n");
+    printf("  -s, --single-thread   Service audio and touch input from one epoll loop\n");
+    printf("  -c, --calibrate       Record pen pressure levels before starting\n");
+    printf("  -f, --filter NAME     Pressure smoothing: none, euro or kalman (default euro)\n");
+    printf("  -D, --detector NAME   Tone level measurement: rms, goertzel, lockin or lockin-fixed, which keeps\n");
+    printf("                        detection, smoothing and pressure mapping in integers (default lockin)\n");
+    printf("  -F, --carrier HZ      Probe tone frequency (default: last swept for the card, else %.0f)\n",
+           PROBE_TONE_FREQUENCY);
+    printf("  -S, --sweep[=HZ,...]  Measure candidate carriers, up to near-ultrasonic, and use the best\n");
+    printf("  -r, --rotate DEG      Rotate positions clockwise by 0, 90, 180 or 270 degrees\n");
+    printf("  -R, --region X,Y,W,H  Use only this part of the touch surface (fractions, default 0,0,1,1)\n");
+    printf("  -a, --area X,Y,W,H    Map onto this part of the tablet (fractions, default 0,0,1,1)\n");
+    printf("  -t, --realtime[=PRIO] SCHED_FIFO audio threads (default priority %d), locked memory\n",
+           REALTIME_DEFAULT_PRIORITY);
+    printf("  -P, --pin C[,T[,I]]   With --realtime, pin the capture, tone and input/output threads to CPUs\n");
+    printf("  -A, --assert-no-alloc Abort if the audio path allocates memory once it runs; needs\n");
+    printf("                        LD_PRELOAD=./libsonarpen-allocguard.so\n");
+    printf("  -I, --idle            After %d ms without touch, play the tone in %d ms bursts every %d ms\n",
+           IDLE_ENTER_MS, IDLE_BURST_MS, IDLE_BURST_PERIOD_MS);
+    printf("  -h, --help            Show this help\n");
+}
+
+/**
+ * @brief Parse command line options into a configuration.
+ *
+ * Options are applied on top of whatever the configuration already holds,
+ * so --low-latency can be combined with e.g. --period.
+ *
+ * @param config Configuration to update.
+ * @param argc Argument count from main().
+ * @param argv Argument vector from main().
+ * @return int 0 to run, 1 if help was printed, -1 on invalid options.
+ */
+int sonarpen_config_parse_args(SonarpenConfig *config, int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "device",          required_argument, NULL, 'd' },
+        { "low-latency",     no_argument,       NULL, 'l' },
+        { "period",          required_argument, NULL, 'p' },
+        { "periods",         required_argument, NULL, 'n' },
+        { "mmap",            no_argument,       NULL, 'm' },
+        { "input",           required_argument, NULL, 'i' },
+        { "single-thread",   no_argument,       NULL, 's' },
+        { "calibrate",       no_argument,       NULL, 'c' },
+        { "filter",          required_argument, NULL, 'f' },
+        { "detector",        required_argument, NULL, 'D' },
+        { "carrier",         required_argument, NULL, 'F' },
+        { "sweep",           optional_argument, NULL, 'S' },
+        { "rotate",          required_argument, NULL, 'r' },
+        { "region",          required_argument, NULL, 'R' },
+        { "area",            required_argument, NULL, 'a' },
+        { "realtime",        optional_argument, NULL, 't' },
+        { "pin",             required_argument, NULL, 'P' },
+        { "assert-no-alloc", no_argument,       NULL, 'A' },
+        { "idle",            no_argument,       NULL, 'I' },
+        { "help",            no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:lp:n:mi:scf:D:F:S::r:R:a:t::P:AIh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            config->audio.device = optarg;
+            break;
+        case 'l': {
+            const char *device = config->audio.device;
+            audio_config_low_latency(&config->audio);
+            config->audio.device = device;
+            break;
+        }
+        case 'p':
+            config->audio.period_frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            config->audio.periods = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            config->audio.use_mmap = 1;
+            break;
+        case 'i':
+            config->input_path = optarg;
+            break;
+        case 's':
+            config->single_thread = 1;
+            break;
+        case 'c':
+            config->calibrate = 1;
+            break;
+        case 'f':
+            if (pressure_filter_parse(optarg, &config->pressure_filter) < 0) {
+                fprintf(stderr, "Unknown filter: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'D':
+            if (tone_detector_parse(optarg, &config->detector) < 0) {
+                fprintf(stderr, "Unknown detector: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'F':
+            config->carrier = strtof(optarg, NULL);
+            if (config->carrier <= 0.0f) {
+                fprintf(stderr, "Invalid carrier frequency: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'S':
+            config->sweep_carriers = 1;
+            config->num_carrier_candidates = 0;
+            if (optarg && (config->num_carrier_candidates = carrier_parse_list(optarg, config->carrier_candidates,
+                                                                               CARRIER_MAX_CANDIDATES)) < 0) {
+                fprintf(stderr, "Invalid carrier list: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r': {
+            int degrees = atoi(optarg);
+            if (degrees != 0 && degrees != 90 && degrees != 180 && degrees != 270) {
+                fprintf(stderr, "Rotation must be 0, 90, 180 or 270: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            config->mapping.rotation = degrees;
+            break;
+        }
+        case 'R':
+        case 'a':
+            if (coord_mapping_parse_rect(optarg, opt == 'R' ? config->mapping.region : config->mapping.area) < 0) {
+                fprintf(stderr, "Invalid rectangle: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 't':
+            config->realtime.enabled = 1;
+            if (optarg) {
+                int priority = atoi(optarg);
+                if (priority < 2 || priority > 99) {
+                    fprintf(stderr, "Real-time priority must be 2..99: %s\n", optarg);
+                    sonarpen_config_usage(argv[0]);
+                    return -1;
+                }
+                config->realtime.priority = priority;
+            }
+            break;
+        case 'P':
+            if (realtime_parse_cpus(optarg, &config->realtime) < 0) {
+                fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                sonarpen_config_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'A':
+            config->assert_no_alloc = 1;
+            break;
+        case 'I':
+            config->idle_duty = 1;
+            break;
+        case 'h':
+            sonarpen_config_usage(argv[0]);
+            return 1;
+        default:
+            sonarpen_config_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
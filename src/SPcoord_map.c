@@ -0,0 +1,169 @@
+#include "sonarpen.h"
+
+/* This page contains the mapping from touch device positions to virtual tablet positions */
+
+/**
+ * @brief Fill the mapping that uses the whole surface, unrotated, for the whole tablet.
+ *
+ * @param mapping Mapping to fill.
+ */
+void coord_mapping_default(CoordMapping *mapping) {
+    mapping->rotation = 0;
+    mapping->region[0] = mapping->area[0] = 0.0f;
+    mapping->region[1] = mapping->area[1] = 0.0f;
+    mapping->region[2] = mapping->area[2] = 1.0f;
+    mapping->region[3] = mapping->area[3] = 1.0f;
+}
+
+/**
+ * @brief Parse a rectangle given as "X,Y,W,H" in fractions of the full range.
+ *
+ * @param text Rectangle from the command line.
+ * @param rect Receives x, y, width and height; untouched on failure.
+ * @return int 0 on success, -1 if the text is malformed or leaves 0..1.
+ */
+int coord_mapping_parse_rect(const char *text, float rect[4]) {
+    float x, y, w, h;
+    char extra;
+
+    if (sscanf(text, "%f,%f,%f,%f%c", &x, &y, &w, &h, &extra) != 4) {
+        return -1;
+    }
+    if (x < 0.0f || y < 0.0f || w <= 0.0f || h <= 0.0f || x + w > 1.0f || y + h > 1.0f) {
+        return -1;
+    }
+
+    rect[0] = x;
+    rect[1] = y;
+    rect[2] = w;
+    rect[3] = h;
+    return 0;
+}
+
+// Convert a coefficient to COORD_FRACTION_BITS fixed point
+static int64_t to_fixed(double value) {
+    return llround(value * (1 << COORD_FRACTION_BITS));
+}
+
+/**
+ * @brief Precompute the affine transform from source positions to tablet positions.
+ *
+ * The source position is normalized to its absinfo range, cropped to the
+ * region, rotated clockwise about the centre and scaled into the output area
+ * of 0..COORD_OUTPUT_MAX. All of that folds into one matrix, so mapping a
+ * position costs four multiplies.
+ *
+ * @param transform Transform to build.
+ * @param x Source X axis.
+ * @param y Source Y axis.
+ * @param mapping Rotation, region and area.
+ * @return int 0 on success, -1 if an axis has an empty range or the rotation is invalid.
+ */
+int coord_transform_build(CoordTransform *transform, const struct input_absinfo *x,
+                          const struct input_absinfo *y, const CoordMapping *mapping) {
+    // Output p, q in 0..1 as p = pu*u + pv*v + pc, q = qu*u + qv*v + qc for each rotation
+    static const struct {
+        int degrees;
+        double pu, pv, pc, qu, qv, qc;
+    } rotations[] = {
+        {   0,  1,  0, 0,  0,  1, 0 },
+        {  90,  0, -1, 1,  1,  0, 0 },
+        { 180, -1,  0, 1,  0, -1, 1 },
+        { 270,  0,  1, 0, -1,  0, 1 },
+    };
+    int index = -1;
+
+    for (size_t i = 0; i < sizeof(rotations) / sizeof(rotations[0]); i++) {
+        if (rotations[i].degrees == mapping->rotation) index = (int)i;
+    }
+    if (index < 0 || x->maximum <= x->minimum || y->maximum <= y->minimum) {
+        return -1;
+    }
+
+    // Region-relative coordinates: u = ku * raw_x + cu, v = kv * raw_y + cv
+    double span_x = x->maximum - x->minimum;
+    double span_y = y->maximum - y->minimum;
+    double ku = 1.0 / (span_x * mapping->region[2]);
+    double cu = -(x->minimum / span_x + mapping->region[0]) / mapping->region[2];
+    double kv = 1.0 / (span_y * mapping->region[3]);
+    double cv = -(y->minimum / span_y + mapping->region[1]) / mapping->region[3];
+
+    double out_w = COORD_OUTPUT_MAX * mapping->area[2];
+    double out_h = COORD_OUTPUT_MAX * mapping->area[3];
+    double out_x = COORD_OUTPUT_MAX * mapping->area[0];
+    double out_y = COORD_OUTPUT_MAX * mapping->area[1];
+    const double pu = rotations[index].pu, pv = rotations[index].pv, pc = rotations[index].pc;
+    const double qu = rotations[index].qu, qv = rotations[index].qv, qc = rotations[index].qc;
+
+    transform->xx = to_fixed(out_w * pu * ku);
+    transform->xy = to_fixed(out_w * pv * kv);
+    transform->x0 = to_fixed(out_x + out_w * (pu * cu + pv * cv + pc));
+    transform->yx = to_fixed(out_h * qu * ku);
+    transform->yy = to_fixed(out_h * qv * kv);
+    transform->y0 = to_fixed(out_y + out_h * (qu * cu + qv * cv + qc));
+
+    transform->min_x = (int)lround(out_x);
+    transform->max_x = (int)lround(out_x + out_w);
+    transform->min_y = (int)lround(out_y);
+    transform->max_y = (int)lround(out_y + out_h);
+
+    // Units per mm follow the source axis that ends up horizontal or vertical
+    int swapped = mapping->rotation == 90 || mapping->rotation == 270;
+    const struct input_absinfo *src_h = swapped ? y : x;
+    const struct input_absinfo *src_v = swapped ? x : y;
+    double region_h = swapped ? mapping->region[3] : mapping->region[2];
+    double region_v = swapped ? mapping->region[2] : mapping->region[3];
+    transform->resolution_x = (int)lround(out_w * src_h->resolution /
+                                          ((src_h->maximum - src_h->minimum) * region_h));
+    transform->resolution_y = (int)lround(out_h * src_v->resolution /
+                                          ((src_v->maximum - src_v->minimum) * region_v));
+    return 0;
+}
+
+/**
+ * @brief Build the transform for the axes a device reports positions on.
+ *
+ * Multi-touch devices forward the pen slot's ABS_MT_POSITION_X/Y, so their
+ * ranges are used; other devices forward ABS_X/ABS_Y.
+ *
+ * @param transform Transform to build.
+ * @param dev Source touch device.
+ * @param mapping Rotation, region and area.
+ * @return int 0 on success, -1 if the device has no usable position axes.
+ */
+int coord_transform_from_device(CoordTransform *transform, struct libevdev *dev, const CoordMapping *mapping) {
+    int mt = libevdev_has_event_code(dev, EV_ABS, ABS_MT_SLOT) &&
+             libevdev_has_event_code(dev, EV_ABS, ABS_MT_POSITION_X);
+    const struct input_absinfo *x = libevdev_get_abs_info(dev, mt ? ABS_MT_POSITION_X : ABS_X);
+    const struct input_absinfo *y = libevdev_get_abs_info(dev, mt ? ABS_MT_POSITION_Y : ABS_Y);
+
+    if (x == NULL || y == NULL) {
+        return -1;
+    }
+    return coord_transform_build(transform, x, y, mapping);
+}
+
+/**
+ * @brief Map a source position to the virtual tablet.
+ *
+ * Positions outside the region stick to the edge of the output area.
+ *
+ * @param transform Transform from coord_transform_build().
+ * @param x Source X value.
+ * @param y Source Y value.
+ * @param out_x Receives ABS_X.
+ * @param out_y Receives ABS_Y.
+ */
+void coord_transform_apply(const CoordTransform *transform, int x, int y, int *out_x, int *out_y) {
+    const int64_t half = (int64_t)1 << (COORD_FRACTION_BITS - 1);
+    int64_t mx = (transform->xx * x + transform->xy * y + transform->x0 + half) >> COORD_FRACTION_BITS;
+    int64_t my = (transform->yx * x + transform->yy * y + transform->y0 + half) >> COORD_FRACTION_BITS;
+
+    if (mx < transform->min_x) mx = transform->min_x;
+    if (mx > transform->max_x) mx = transform->max_x;
+    if (my < transform->min_y) my = transform->min_y;
+    if (my > transform->max_y) my = transform->max_y;
+
+    *out_x = (int)mx;
+    *out_y = (int)my;
+}
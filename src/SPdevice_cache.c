@@ -0,0 +1,286 @@
+#include "sonarpen.h"
+#include <sys/stat.h>
+
+/* This page contains the on-disk cache of the devices that worked last time */
+
+/**
+ * @brief Location of the cache file, $XDG_CACHE_HOME/sonarpen/devices or ~/.cache/sonarpen/devices.
+ *
+ * @param path Receives the file name.
+ * @param len Size of path.
+ * @return int 0 on success, -1 if neither variable is set.
+ */
+int device_cache_path(char *path, size_t len) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base && base[0]) {
+        snprintf(path, len, "%s/sonarpen/devices", base);
+        return 0;
+    }
+
+    const char *home = getenv("HOME");
+    if (home && home[0]) {
+        snprintf(path, len, "%s/.cache/sonarpen/devices", home);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Read the cache file.
+ *
+ * @param cache Receives the cached devices; cleared if there are none.
+ * @return int 0 if a cache of the current version was read, -1 otherwise.
+ */
+int device_cache_load(DeviceCache *cache) {
+    char path[256], line[256], key[64], value[128];
+    int version = 0;
+
+    memset(cache, 0, sizeof(*cache));
+    if (device_cache_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%63[^=]=%127[^\n]", key, value) != 2) continue;
+
+        if (strcmp(key, "version") == 0) version = atoi(value);
+        else if (strcmp(key, "card_id") == 0) snprintf(cache->card_id, sizeof(cache->card_id), "%s", value);
+        else if (strcmp(key, "usb_vendor") == 0) cache->usb_vendor = (unsigned int)strtoul(value, NULL, 16);
+        else if (strcmp(key, "usb_product") == 0) cache->usb_product = (unsigned int)strtoul(value, NULL, 16);
+        else if (strcmp(key, "playback_device") == 0) cache->playback_device = atoi(value);
+        else if (strcmp(key, "capture_device") == 0) cache->capture_device = atoi(value);
+        else if (strcmp(key, "round_trip_frames") == 0) cache->round_trip_frames = atoi(value);
+        else if (strcmp(key, "carrier") == 0) cache->carrier = strtof(value, NULL);
+        else if (strcmp(key, "rate") == 0) cache->rate = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(key, "period_frames") == 0) cache->period_frames = strtoul(value, NULL, 10);
+        else if (strcmp(key, "periods") == 0) cache->periods = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(key, "use_mmap") == 0) cache->use_mmap = atoi(value);
+        else if (strcmp(key, "cal_noise_floor") == 0) cache->calibration.noise_floor = strtof(value, NULL);
+        else if (strcmp(key, "cal_hover") == 0) cache->calibration.hover = strtof(value, NULL);
+        else if (strcmp(key, "cal_light") == 0) cache->calibration.light = strtof(value, NULL);
+        else if (strcmp(key, "cal_full") == 0) cache->calibration.full = strtof(value, NULL);
+        else if (strcmp(key, "cal_carrier") == 0) cache->calibration_carrier = strtof(value, NULL);
+        else if (strcmp(key, "input_bus") == 0) cache->input_bus = (unsigned int)strtoul(value, NULL, 16);
+        else if (strcmp(key, "input_vendor") == 0) cache->input_vendor = (unsigned int)strtoul(value, NULL, 16);
+        else if (strcmp(key, "input_product") == 0) cache->input_product = (unsigned int)strtoul(value, NULL, 16);
+        else if (strcmp(key, "input_name") == 0) snprintf(cache->input_name, sizeof(cache->input_name), "%s", value);
+    }
+    fclose(file);
+
+    if (version != DEVICE_CACHE_VERSION) {
+        memset(cache, 0, sizeof(*cache));
+        return -1;
+    }
+
+    cache->has_audio = cache->card_id[0] != '\0';
+    cache->has_calibration = cache->has_audio && cache->calibration.full > 0.0f;
+    // Calibrations from before carriers were swept were all made at the default tone
+    if (cache->has_calibration && cache->calibration_carrier <= 0.0f) {
+        cache->calibration_carrier = PROBE_TONE_FREQUENCY;
+    }
+    cache->has_input = cache->input_name[0] != '\0';
+    return 0;
+}
+
+// mkdir -p for the directories of a file name
+static void make_parent_dirs(const char *path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+/**
+ * @brief Write the cache file, replacing the old one atomically.
+ *
+ * @param cache Devices to remember.
+ * @return int 0 on success, -1 on failure.
+ */
+int device_cache_save(const DeviceCache *cache) {
+    char path[256], tmp_path[272];
+
+    if (device_cache_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+    make_parent_dirs(path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror("Failed to write device cache");
+        return -1;
+    }
+
+    fprintf(file, "version=%d\n", DEVICE_CACHE_VERSION);
+    if (cache->has_audio) {
+        fprintf(file, "card_id=%s\n", cache->card_id);
+        fprintf(file, "usb_vendor=%04x\n", cache->usb_vendor);
+        fprintf(file, "usb_product=%04x\n", cache->usb_product);
+        fprintf(file, "playback_device=%d\n", cache->playback_device);
+        fprintf(file, "capture_device=%d\n", cache->capture_device);
+        fprintf(file, "round_trip_frames=%d\n", cache->round_trip_frames);
+        if (cache->carrier > 0.0f) {
+            fprintf(file, "carrier=%.1f\n", cache->carrier);
+        }
+        fprintf(file, "rate=%u\n", cache->rate);
+        fprintf(file, "period_frames=%lu\n", (unsigned long)cache->period_frames);
+        fprintf(file, "periods=%u\n", cache->periods);
+        fprintf(file, "use_mmap=%d\n", cache->use_mmap);
+    }
+    if (cache->has_calibration) {
+        fprintf(file, "cal_noise_floor=%.2f\n", cache->calibration.noise_floor);
+        fprintf(file, "cal_hover=%.2f\n", cache->calibration.hover);
+        fprintf(file, "cal_light=%.2f\n", cache->calibration.light);
+        fprintf(file, "cal_full=%.2f\n", cache->calibration.full);
+        fprintf(file, "cal_carrier=%.1f\n", cache->calibration_carrier);
+    }
+    if (cache->has_input) {
+        fprintf(file, "input_bus=%04x\n", cache->input_bus);
+        fprintf(file, "input_vendor=%04x\n", cache->input_vendor);
+        fprintf(file, "input_product=%04x\n", cache->input_product);
+        fprintf(file, "input_name=%s\n", cache->input_name);
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, path) < 0) {
+        perror("Failed to write device cache");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Describe a sound card independently of its index.
+ *
+ * @param card ALSA card index.
+ * @param card_id Receives the ALSA card ID.
+ * @param len Size of card_id.
+ * @param usb_vendor Receives the USB vendor ID, 0 if the card is not on USB.
+ * @param usb_product Receives the USB product ID, 0 if the card is not on USB.
+ * @return int 0 on success, -1 if the card cannot be opened.
+ */
+int sound_card_identity(int card, char *card_id, size_t len, unsigned int *usb_vendor, unsigned int *usb_product) {
+    snd_ctl_card_info_t *card_info;
+    snd_ctl_card_info_alloca(&card_info);
+    char name[32];
+    snd_ctl_t *ctl;
+
+    *usb_vendor = 0;
+    *usb_product = 0;
+
+    snprintf(name, sizeof(name), "hw:%d", card);
+    if (snd_ctl_open(&ctl, name, 0) < 0) {
+        return -1;
+    }
+    if (snd_ctl_card_info(ctl, card_info) < 0) {
+        snd_ctl_close(ctl);
+        return -1;
+    }
+    snprintf(card_id, len, "%s", snd_ctl_card_info_get_id(card_info));
+    snd_ctl_close(ctl);
+
+    // USB IDs come from the parent USB device of /sys/class/sound/cardN
+    struct udev *udev = udev_new();
+    if (udev) {
+        snprintf(name, sizeof(name), "card%d", card);
+        struct udev_device *dev = udev_device_new_from_subsystem_sysname(udev, "sound", name);
+        if (dev) {
+            struct udev_device *usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+            const char *vendor = usb ? udev_device_get_sysattr_value(usb, "idVendor") : NULL;
+            const char *product = usb ? udev_device_get_sysattr_value(usb, "idProduct") : NULL;
+            if (vendor && product) {
+                *usb_vendor = (unsigned int)strtoul(vendor, NULL, 16);
+                *usb_product = (unsigned int)strtoul(product, NULL, 16);
+            }
+            udev_device_unref(dev);
+        }
+        udev_unref(udev);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the current index of the cached sound card.
+ *
+ * @param cache Cache with audio fields.
+ * @return int Card index, -1 if the card is not present.
+ */
+int device_cache_find_card(const DeviceCache *cache) {
+    int card = -1;
+
+    if (!cache->has_audio) {
+        return -1;
+    }
+
+    while (snd_card_next(&card) >= 0 && card >= 0) {
+        char card_id[32];
+        unsigned int vendor, product;
+        if (sound_card_identity(card, card_id, sizeof(card_id), &vendor, &product) == 0 &&
+            strcmp(card_id, cache->card_id) == 0 &&
+            vendor == cache->usb_vendor && product == cache->usb_product) {
+            return card;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Remember the identity of the card the pen was found on.
+ *
+ * The carrier swept and the levels calibrated on another card are forgotten.
+ *
+ * @param cache Cache to update; the device numbers are set by the caller.
+ * @param card ALSA card index.
+ */
+void device_cache_set_card(DeviceCache *cache, int card) {
+    char old_id[sizeof(cache->card_id)];
+    unsigned int old_vendor = cache->usb_vendor, old_product = cache->usb_product;
+    snprintf(old_id, sizeof(old_id), "%s", cache->card_id);
+
+    cache->has_audio = sound_card_identity(card, cache->card_id, sizeof(cache->card_id),
+                                           &cache->usb_vendor, &cache->usb_product) == 0;
+    if (!cache->has_audio || strcmp(old_id, cache->card_id) != 0 ||
+        old_vendor != cache->usb_vendor || old_product != cache->usb_product) {
+        cache->carrier = 0.0f;
+        cache->has_calibration = 0;
+    }
+}
+
+/**
+ * @brief Remember the stream parameters the card granted.
+ *
+ * @param cache Cache to update.
+ * @param info Negotiated parameters.
+ */
+void device_cache_set_stream(DeviceCache *cache, const AudioStreamInfo *info) {
+    cache->rate = info->rate;
+    cache->period_frames = info->period_frames;
+    cache->periods = info->period_frames ? (unsigned int)(info->buffer_frames / info->period_frames) : 0;
+    cache->use_mmap = info->use_mmap;
+}
+
+/**
+ * @brief Remember the identity of the touch device.
+ *
+ * @param cache Cache to update.
+ * @param dev Bound touch device.
+ */
+void device_cache_set_input(DeviceCache *cache, struct libevdev *dev) {
+    cache->input_bus = (unsigned int)libevdev_get_id_bustype(dev);
+    cache->input_vendor = (unsigned int)libevdev_get_id_vendor(dev);
+    cache->input_product = (unsigned int)libevdev_get_id_product(dev);
+    snprintf(cache->input_name, sizeof(cache->input_name), "%s", libevdev_get_name(dev));
+    cache->has_input = 1;
+}
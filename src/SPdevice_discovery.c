@@ -0,0 +1,304 @@
+#include "sonarpen.h"
+
+/* This page contains the udev based discovery and hotplug handling of the source touch device */
+
+/**
+ * @brief Rate how well an input device fits as the pen's touch surface.
+ *
+ * Touchscreens win over touchpads, multi-touch and finer resolution add
+ * points. Devices without absolute X/Y, and the virtual tablet this driver
+ * creates itself, are rejected.
+ *
+ * @param dev Open device.
+ * @param udev_dev Matching udev device for the ID_INPUT_* properties, or NULL.
+ * @return int Score above 0 for a usable device, -1 otherwise.
+ */
+int input_device_score(struct libevdev *dev, struct udev_device *udev_dev) {
+    if (libevdev_get_id_vendor(dev) == UINPUT_VENDOR_ID && libevdev_get_id_product(dev) == UINPUT_PRODUCT_ID) {
+        return -1;
+    }
+
+    int has_st = libevdev_has_event_code(dev, EV_ABS, ABS_X) && libevdev_has_event_code(dev, EV_ABS, ABS_Y);
+    int has_mt = libevdev_has_event_code(dev, EV_ABS, ABS_MT_POSITION_X) &&
+                 libevdev_has_event_code(dev, EV_ABS, ABS_MT_POSITION_Y);
+    if (!has_st && !has_mt) {
+        return -1;
+    }
+
+    // Real pen digitizers already do what this driver emulates
+    if (libevdev_has_event_code(dev, EV_KEY, BTN_TOOL_PEN)) {
+        return -1;
+    }
+
+    int score = 1;
+    const char *touchscreen = udev_dev ? udev_device_get_property_value(udev_dev, "ID_INPUT_TOUCHSCREEN") : NULL;
+    const char *touchpad = udev_dev ? udev_device_get_property_value(udev_dev, "ID_INPUT_TOUCHPAD") : NULL;
+
+    if (libevdev_has_property(dev, INPUT_PROP_DIRECT) || (touchscreen && strcmp(touchscreen, "1") == 0)) {
+        score += 40;
+    } else if (libevdev_has_property(dev, INPUT_PROP_POINTER) || (touchpad && strcmp(touchpad, "1") == 0)) {
+        score += 20;
+    }
+
+    if (has_mt && libevdev_has_event_code(dev, EV_ABS, ABS_MT_SLOT)) {
+        score += 10;
+    }
+
+    unsigned int axis = has_mt ? ABS_MT_POSITION_X : ABS_X;
+    const struct input_absinfo *info = libevdev_get_abs_info(dev, axis);
+    if (info) {
+        if (info->resolution > 0) {
+            score += 5;
+        }
+        // One point per doubling of the axis range, up to 10
+        int range = info->maximum - info->minimum;
+        for (int bits = 0; range > 1 && bits < 10; bits++) {
+            range >>= 1;
+            score++;
+        }
+    }
+
+    return score;
+}
+
+/**
+ * @brief Open a device node just long enough to score it.
+ *
+ * @param path Event device node, e.g. /dev/input/event7.
+ * @param udev_dev Matching udev device, or NULL.
+ * @return int Score from input_device_score(), -1 if the node cannot be opened.
+ */
+int probe_input_device(const char *path, struct udev_device *udev_dev) {
+    struct libevdev *dev = NULL;
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int score = -1;
+    if (libevdev_new_from_fd(fd, &dev) == 0) {
+        score = input_device_score(dev, udev_dev);
+        libevdev_free(dev);
+    }
+    close(fd);
+    return score;
+}
+
+/**
+ * @brief Read the position axes of a device node without binding it.
+ *
+ * @param path Event device node.
+ * @param mapping Rotation, region and area the device will be mapped with.
+ * @param axes Receives the tablet axes.
+ * @return int 0 on success, -1 if the node cannot be opened or has no position axes.
+ */
+int probe_touch_axes(const char *path, const CoordMapping *mapping, TabletAxes *axes) {
+    struct libevdev *dev = NULL;
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int rc = libevdev_new_from_fd(fd, &dev);
+    if (rc == 0) {
+        rc = tablet_axes_from_device(dev, mapping, axes);
+        libevdev_free(dev);
+    }
+    close(fd);
+    return rc == 0 ? 0 : -1;
+}
+
+// udev device is an evdev node (eventN), not the parent inputN or a legacy mouse/js node
+static int is_event_node(struct udev_device *udev_dev) {
+    const char *sysname = udev_device_get_sysname(udev_dev);
+    return sysname && strncmp(sysname, "event", 5) == 0 && udev_device_get_devnode(udev_dev);
+}
+
+/**
+ * @brief Find the best touch surface among all input devices.
+ *
+ * @param path Receives the device node of the winner.
+ * @param len Size of path.
+ * @return int Score of the winner, -1 if nothing usable was found.
+ */
+int discover_touch_device(char *path, size_t len) {
+    struct udev *udev = udev_new();
+    if (udev == NULL) {
+        fprintf(stderr, "Failed to create udev context\n");
+        return -1;
+    }
+
+    struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "input");
+    udev_enumerate_scan_devices(enumerate);
+
+    int best = -1;
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        struct udev_device *udev_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+        if (udev_dev == NULL) {
+            continue;
+        }
+
+        if (is_event_node(udev_dev)) {
+            const char *devnode = udev_device_get_devnode(udev_dev);
+            int score = probe_input_device(devnode, udev_dev);
+            if (score > 0) {
+                printf("  Candidate %s (score %d)\n", devnode, score);
+            }
+            if (score > best) {
+                best = score;
+                snprintf(path, len, "%s", devnode);
+            }
+        }
+        udev_device_unref(udev_dev);
+    }
+
+    udev_enumerate_unref(enumerate);
+    udev_unref(udev);
+    return best > 0 ? best : -1;
+}
+
+// Hex sysfs attribute of an input device, e.g. id/vendor
+static unsigned int sysattr_hex(struct udev_device *dev, const char *name) {
+    const char *value = udev_device_get_sysattr_value(dev, name);
+    return value ? (unsigned int)strtoul(value, NULL, 16) : 0;
+}
+
+/**
+ * @brief Find the cached touch device by its identity, without opening every node.
+ *
+ * @param cache Cache with input fields.
+ * @param path Receives the device node.
+ * @param len Size of path.
+ * @return int 0 if found, -1 otherwise.
+ */
+int find_input_device(const DeviceCache *cache, char *path, size_t len) {
+    if (!cache->has_input) {
+        return -1;
+    }
+
+    struct udev *udev = udev_new();
+    if (udev == NULL) {
+        return -1;
+    }
+
+    struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "input");
+    udev_enumerate_scan_devices(enumerate);
+
+    int found = -1;
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        struct udev_device *udev_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+        if (udev_dev == NULL) {
+            continue;
+        }
+
+        // The IDs and name live on the parent inputN device
+        struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(udev_dev, "input", NULL);
+        if (found < 0 && is_event_node(udev_dev) && parent) {
+            const char *name = udev_device_get_sysattr_value(parent, "name");
+            if (name && strcmp(name, cache->input_name) == 0 &&
+                sysattr_hex(parent, "id/bustype") == cache->input_bus &&
+                sysattr_hex(parent, "id/vendor") == cache->input_vendor &&
+                sysattr_hex(parent, "id/product") == cache->input_product) {
+                snprintf(path, len, "%s", udev_device_get_devnode(udev_dev));
+                found = 0;
+            }
+        }
+        udev_device_unref(udev_dev);
+    }
+
+    udev_enumerate_unref(enumerate);
+    udev_unref(udev);
+    return found;
+}
+
+/**
+ * @brief Start listening for input devices being added or removed.
+ *
+ * @param hotplug State to initialize.
+ * @param forced_path Only this node is accepted on add, or NULL for any usable device.
+ * @return int 0 on success, -1 on failure.
+ */
+int input_hotplug_init(InputHotplug *hotplug, const char *forced_path) {
+    memset(hotplug, 0, sizeof(*hotplug));
+    hotplug->fd = -1;
+    hotplug->forced_path = forced_path;
+
+    hotplug->udev = udev_new();
+    if (hotplug->udev == NULL) {
+        fprintf(stderr, "Failed to create udev context\n");
+        return -1;
+    }
+
+    hotplug->monitor = udev_monitor_new_from_netlink(hotplug->udev, "udev");
+    if (hotplug->monitor == NULL ||
+        udev_monitor_filter_add_match_subsystem_devtype(hotplug->monitor, "input", NULL) < 0 ||
+        udev_monitor_enable_receiving(hotplug->monitor) < 0) {
+        fprintf(stderr, "Failed to set up udev monitor\n");
+        input_hotplug_cleanup(hotplug);
+        return -1;
+    }
+
+    hotplug->fd = udev_monitor_get_fd(hotplug->monitor);
+    return 0;
+}
+
+/**
+ * @brief Take the next pending hotplug event.
+ *
+ * Only evdev nodes are reported; additions are reported only for usable
+ * devices (or the forced node).
+ *
+ * @param hotplug Initialized monitor.
+ * @param path Receives the device node.
+ * @param len Size of path.
+ * @return int HOTPLUG_ADDED or HOTPLUG_REMOVED, HOTPLUG_IGNORED for other events, 0 if none is pending.
+ */
+int input_hotplug_receive(InputHotplug *hotplug, char *path, size_t len) {
+    struct udev_device *udev_dev = udev_monitor_receive_device(hotplug->monitor);
+    if (udev_dev == NULL) {
+        return 0;
+    }
+
+    int result = HOTPLUG_IGNORED;
+    const char *action = udev_device_get_action(udev_dev);
+
+    if (action && is_event_node(udev_dev)) {
+        const char *devnode = udev_device_get_devnode(udev_dev);
+
+        if (strcmp(action, "remove") == 0) {
+            snprintf(path, len, "%s", devnode);
+            result = HOTPLUG_REMOVED;
+        } else if (strcmp(action, "add") == 0) {
+            int wanted = hotplug->forced_path ? strcmp(devnode, hotplug->forced_path) == 0
+                                              : probe_input_device(devnode, udev_dev) > 0;
+            if (wanted) {
+                snprintf(path, len, "%s", devnode);
+                result = HOTPLUG_ADDED;
+            }
+        }
+    }
+
+    udev_device_unref(udev_dev);
+    return result;
+}
+
+/**
+ * @brief Stop listening and free the udev context.
+ *
+ * @param hotplug Monitor to clean up.
+ */
+void input_hotplug_cleanup(InputHotplug *hotplug) {
+    if (hotplug->monitor) {
+        udev_monitor_unref(hotplug->monitor);
+        hotplug->monitor = NULL;
+    }
+    if (hotplug->udev) {
+        udev_unref(hotplug->udev);
+        hotplug->udev = NULL;
+    }
+    hotplug->fd = -1;
+}
@@ -0,0 +1,336 @@
+#include "sonarpen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSP_HAVE_X86 1
+#endif
+
+/* This page contains the per-block DSP kernels, with SSE2 and AVX2 versions picked at run time */
+
+/**
+ * @brief One implementation of every kernel.
+ */
+typedef struct {
+    const char *name;
+    uint64_t (*sum_squares)(const int16_t *samples, size_t count);
+    void (*deinterleave_stereo)(const int16_t *src, unsigned int channel, int16_t *dst, size_t frames);
+    double (*dot)(const float *weights, const int16_t *samples, size_t count);
+    void (*dot4)(const float *const weights[4], const int16_t *samples, size_t count, double sums[4]);
+} DspKernels;
+
+// Scalar versions, used as the tail of the vector versions and on other architectures
+
+static uint64_t sum_squares_scalar(const int16_t *samples, size_t count) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (uint32_t)(samples[i] * samples[i]);
+    }
+    return sum;
+}
+
+static void deinterleave_stereo_scalar(const int16_t *src, unsigned int channel, int16_t *dst, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        dst[i] = src[2 * i + channel];
+    }
+}
+
+static double dot_scalar(const float *weights, const int16_t *samples, size_t count) {
+    double sum = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (double)weights[i] * samples[i];
+    }
+    return sum;
+}
+
+static void dot4_scalar(const float *const weights[4], const int16_t *samples, size_t count, double sums[4]) {
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        double x = samples[i];
+        s0 += weights[0][i] * x;
+        s1 += weights[1][i] * x;
+        s2 += weights[2][i] * x;
+        s3 += weights[3][i] * x;
+    }
+    sums[0] = s0;
+    sums[1] = s1;
+    sums[2] = s2;
+    sums[3] = s3;
+}
+
+static const DspKernels scalar_kernels = {
+    "scalar", sum_squares_scalar, deinterleave_stereo_scalar, dot_scalar, dot4_scalar
+};
+
+#ifdef DSP_HAVE_X86
+
+// SSE2 versions: 8 samples per step
+
+__attribute__((target("sse2")))
+static float hsum_sse2(__m128 v) {
+    __m128 high = _mm_movehl_ps(v, v);
+    v = _mm_add_ps(v, high);
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sum_squares_sse2(const int16_t *samples, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+        // Each pair sum is at most 2 * 32768^2 = 2^31, which fits when read as unsigned
+        __m128i pairs = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(pairs, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(pairs, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1] + sum_squares_scalar(samples + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void deinterleave_stereo_sse2(const int16_t *src, unsigned int channel, int16_t *dst, size_t frames) {
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 8));
+        // Move the wanted channel into the low half of each 32-bit frame, sign-extended
+        if (channel == 0) {
+            a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+            b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        } else {
+            a = _mm_srai_epi32(a, 16);
+            b = _mm_srai_epi32(b, 16);
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+    deinterleave_stereo_scalar(src + 2 * i, channel, dst + i, frames - i);
+}
+
+// Widen 8 samples to two vectors of 4 floats
+__attribute__((target("sse2")))
+static void load_s16_sse2(const int16_t *samples, __m128 *low, __m128 *high) {
+    __m128i v = _mm_loadu_si128((const __m128i *)samples);
+    *low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+    *high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+}
+
+__attribute__((target("sse2")))
+static double dot_sse2(const float *weights, const int16_t *samples, size_t count) {
+    __m128 acc = _mm_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128 low, high;
+        load_s16_sse2(samples + i, &low, &high);
+        acc = _mm_add_ps(acc, _mm_mul_ps(low, _mm_loadu_ps(weights + i)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(high, _mm_loadu_ps(weights + i + 4)));
+    }
+    return hsum_sse2(acc) + dot_scalar(weights + i, samples + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void dot4_sse2(const float *const weights[4], const int16_t *samples, size_t count, double sums[4]) {
+    __m128 acc[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128 low, high;
+        load_s16_sse2(samples + i, &low, &high);
+        for (int k = 0; k < 4; k++) {
+            acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(low, _mm_loadu_ps(weights[k] + i)));
+            acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(high, _mm_loadu_ps(weights[k] + i + 4)));
+        }
+    }
+
+    const float *const tail[4] = { weights[0] + i, weights[1] + i, weights[2] + i, weights[3] + i };
+    dot4_scalar(tail, samples + i, count - i, sums);
+    for (int k = 0; k < 4; k++) {
+        sums[k] += hsum_sse2(acc[k]);
+    }
+}
+
+static const DspKernels sse2_kernels = {
+    "sse2", sum_squares_sse2, deinterleave_stereo_sse2, dot_sse2, dot4_sse2
+};
+
+// AVX2 versions: twice the width of SSE2
+
+__attribute__((target("avx2")))
+static float hsum_avx2(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_squares_avx2(const int16_t *samples, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(samples + i));
+        __m256i pairs = _mm256_madd_epi16(v, v);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(pairs, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(pairs, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_squares_sse2(samples + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_stereo_avx2(const int16_t *src, unsigned int channel, int16_t *dst, size_t frames) {
+    size_t i = 0;
+
+    for (; i + 16 <= frames; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 16));
+        if (channel == 0) {
+            a = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+            b = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+        } else {
+            a = _mm256_srai_epi32(a, 16);
+            b = _mm256_srai_epi32(b, 16);
+        }
+        // packs works per 128-bit lane; put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i), packed);
+    }
+    deinterleave_stereo_sse2(src + 2 * i, channel, dst + i, frames - i);
+}
+
+__attribute__((target("avx2")))
+static double dot_avx2(const float *weights, const int16_t *samples, size_t count) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(samples + i))));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(x, _mm256_loadu_ps(weights + i)));
+    }
+    return hsum_avx2(acc) + dot_scalar(weights + i, samples + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void dot4_avx2(const float *const weights[4], const int16_t *samples, size_t count, double sums[4]) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(samples + i))));
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(x, _mm256_loadu_ps(weights[0] + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(x, _mm256_loadu_ps(weights[1] + i)));
+        acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(x, _mm256_loadu_ps(weights[2] + i)));
+        acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(x, _mm256_loadu_ps(weights[3] + i)));
+    }
+
+    const float *const tail[4] = { weights[0] + i, weights[1] + i, weights[2] + i, weights[3] + i };
+    dot4_scalar(tail, samples + i, count - i, sums);
+    sums[0] += hsum_avx2(acc0);
+    sums[1] += hsum_avx2(acc1);
+    sums[2] += hsum_avx2(acc2);
+    sums[3] += hsum_avx2(acc3);
+}
+
+static const DspKernels avx2_kernels = {
+    "avx2", sum_squares_avx2, deinterleave_stereo_avx2, dot_avx2, dot4_avx2
+};
+
+#endif // DSP_HAVE_X86
+
+static const DspKernels *active_kernels = &scalar_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernels the CPU runs; SONARPEN_DSP=scalar|sse2|avx2 caps the choice
+static void select_kernels(void) {
+#ifdef DSP_HAVE_X86
+    const char *limit = getenv("SONARPEN_DSP");
+    int allow_sse2 = !(limit && strcmp(limit, "scalar") == 0);
+    int allow_avx2 = allow_sse2 && !(limit && strcmp(limit, "sse2") == 0);
+
+    __builtin_cpu_init();
+    if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+        active_kernels = &avx2_kernels;
+    } else if (allow_sse2 && __builtin_cpu_supports("sse2")) {
+        active_kernels = &sse2_kernels;
+    }
+#endif
+}
+
+static const DspKernels *kernels(void) {
+    pthread_once(&kernels_once, select_kernels);
+    return active_kernels;
+}
+
+/**
+ * @brief Name of the kernel set in use: "avx2", "sse2" or "scalar".
+ */
+const char *dsp_kernel_name(void) {
+    return kernels()->name;
+}
+
+/**
+ * @brief Sum of squared samples, accumulated exactly in integers.
+ *
+ * @param samples 16-bit samples.
+ * @param count Number of samples.
+ * @return uint64_t Sum of samples[i]^2.
+ */
+uint64_t dsp_sum_squares_s16(const int16_t *samples, size_t count) {
+    return kernels()->sum_squares(samples, count);
+}
+
+/**
+ * @brief Copy one channel out of interleaved 16-bit frames.
+ *
+ * dst may equal src, so a buffer can be reduced to mono in place.
+ *
+ * @param src Interleaved frames.
+ * @param channels Channels per frame.
+ * @param channel Channel to extract.
+ * @param dst Receives frames samples.
+ * @param frames Number of frames.
+ */
+void dsp_deinterleave_s16(const int16_t *src, unsigned int channels, unsigned int channel,
+                          int16_t *dst, size_t frames) {
+    if (channels == 2) {
+        kernels()->deinterleave_stereo(src, channel, dst, frames);
+        return;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        dst[i] = src[i * channels + channel];
+    }
+}
+
+/**
+ * @brief Multiply-accumulate float weights with 16-bit samples.
+ *
+ * @param weights Weight per sample.
+ * @param samples 16-bit samples.
+ * @param count Number of samples.
+ * @return double Sum of weights[i] * samples[i].
+ */
+double dsp_dot_s16(const float *weights, const int16_t *samples, size_t count) {
+    return kernels()->dot(weights, samples, count);
+}
+
+/**
+ * @brief Multiply-accumulate four weight tables with the same samples in one pass.
+ *
+ * @param weights Four weight tables of count entries.
+ * @param samples 16-bit samples.
+ * @param count Number of samples.
+ * @param sums Receives the four sums.
+ */
+void dsp_dot4_s16(const float *const weights[4], const int16_t *samples, size_t count, double sums[4]) {
+    kernels()->dot4(weights, samples, count, sums);
+}
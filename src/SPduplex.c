@@ -0,0 +1,209 @@
+#include "sonarpen.h"
+
+/* This page contains the full-duplex engine that runs capture and playback on one clock */
+
+// Linked capture must not start by itself: after a restart it would start the playback with an empty buffer
+static void hold_capture_for_playback(AudioCapture *capture) {
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_uframes_t boundary;
+
+    snd_pcm_sw_params_alloca(&sw_params);
+    if (snd_pcm_sw_params_current(capture->handle, sw_params) < 0 ||
+        snd_pcm_sw_params_get_boundary(sw_params, &boundary) < 0 ||
+        snd_pcm_sw_params_set_start_threshold(capture->handle, sw_params, boundary) < 0 ||
+        snd_pcm_sw_params(capture->handle, sw_params) < 0) {
+        return;
+    }
+    capture->start_with_playback = 1;
+}
+
+/**
+ * @brief Open capture and playback at the same rate and link them.
+ *
+ * Linking only works when both directions belong to the same card; otherwise
+ * the streams run unlinked and the offset measurement still tells how far
+ * apart they are. Linked capture only ever starts together with playback.
+ *
+ * @param duplex Duplex state to fill.
+ * @param capture Capture structure to initialize.
+ * @param config Requested parameters; a zero rate selects DUPLEX_SAMPLE_RATE.
+ * @return int 0 on success, -1 on failure.
+ */
+int init_audio_duplex(AudioDuplex *duplex, AudioCapture *capture, const AudioConfig *config) {
+    AudioConfig shared = *config;
+    AudioStreamInfo playback_info;
+    int err;
+
+    if (shared.rate == 0) {
+        shared.rate = DUPLEX_SAMPLE_RATE;
+    }
+
+    memset(duplex, 0, sizeof(*duplex));
+
+    if (init_audio_capture_config(capture, &shared) < 0) {
+        fprintf(stderr, "Failed to initialize audio capture.\n");
+        return -1;
+    }
+
+    if (init_audio_playback_config(&shared) < 0) {
+        cleanup_audio_capture(capture);
+        return -1;
+    }
+
+    get_playback_info(&playback_info);
+    if (playback_info.rate != capture->info.rate) {
+        fprintf(stderr, "Capture runs at %u Hz but playback at %u Hz; duplex needs one rate\n",
+                capture->info.rate, playback_info.rate);
+        cleanup_audio_playback();
+        cleanup_audio_capture(capture);
+        return -1;
+    }
+
+    duplex->capture = capture;
+    duplex->playback = get_playback_handle();
+    duplex->rate = capture->info.rate;
+
+    if ((err = snd_pcm_link(capture->handle, duplex->playback)) == 0) {
+        duplex->linked = 1;
+        hold_capture_for_playback(capture);
+    } else {
+        fprintf(stderr, "Cannot link capture and playback (%s), running them unlinked\n", snd_strerror(err));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Prefill the playback buffer with the tone and start both streams.
+ *
+ * Starting with a full playback buffer keeps the first periods from
+ * underrunning. Linked streams start together from the playback side.
+ *
+ * @param duplex Initialized duplex engine.
+ * @param frequency Probe tone frequency in Hz.
+ * @return int 0 on success, -1 on failure.
+ */
+int audio_duplex_start(AudioDuplex *duplex, float frequency) {
+    AudioStreamInfo playback_info;
+    int err;
+
+    get_playback_info(&playback_info);
+
+    while (snd_pcm_state(duplex->playback) == SND_PCM_STATE_PREPARED &&
+           snd_pcm_avail(duplex->playback) >= (snd_pcm_sframes_t)playback_info.period_frames) {
+        if (play_tone(frequency) < 0) {
+            return -1;
+        }
+    }
+
+    if (snd_pcm_state(duplex->playback) == SND_PCM_STATE_PREPARED &&
+        (err = snd_pcm_start(duplex->playback)) < 0) {
+        fprintf(stderr, "Error starting playback: %s\n", snd_strerror(err));
+        return -1;
+    }
+
+    if (snd_pcm_state(duplex->capture->handle) == SND_PCM_STATE_PREPARED &&
+        (err = snd_pcm_start(duplex->capture->handle)) < 0) {
+        fprintf(stderr, "Error starting capture: %s\n", snd_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Nanoseconds between two ALSA timestamps
+static int64_t htimestamp_diff_ns(const snd_htimestamp_t *a, const snd_htimestamp_t *b) {
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000ll + (a->tv_nsec - b->tv_nsec);
+}
+
+/**
+ * @brief Measure how far the playback position is ahead of the capture position.
+ *
+ * Both hardware positions are sampled with their timestamps and brought to
+ * the same instant, so the result is frame accurate even for unlinked
+ * streams. Capture frame m was recorded while playback frame m + offset was
+ * leaving the DAC; the analog and acoustic path adds a device-specific
+ * constant on top. Must be called from the capture thread.
+ *
+ * @param duplex Running duplex engine.
+ * @return int 0 on success, -1 on failure. The result is in duplex->offset_frames.
+ */
+int audio_duplex_measure_offset(AudioDuplex *duplex) {
+    AudioStreamInfo playback_info;
+    snd_pcm_uframes_t avail_p, avail_c;
+    snd_htimestamp_t ts_p, ts_c;
+    uint64_t written;
+
+    get_playback_info(&playback_info);
+
+    // Retry if the tone thread wrote in between, so written and avail_p match
+    for (int attempt = 0; ; attempt++) {
+        written = get_playback_frames_written();
+        if (snd_pcm_avail(duplex->playback) < 0 ||
+            snd_pcm_htimestamp(duplex->playback, &avail_p, &ts_p) < 0) {
+            return -1;
+        }
+        if (written == get_playback_frames_written() || attempt == 3) {
+            break;
+        }
+    }
+
+    if (snd_pcm_avail(duplex->capture->handle) < 0 ||
+        snd_pcm_htimestamp(duplex->capture->handle, &avail_c, &ts_c) < 0) {
+        return -1;
+    }
+
+    int64_t played = (int64_t)written - (int64_t)(playback_info.buffer_frames - avail_p);
+    int64_t captured = (int64_t)duplex->capture->frames_read + (int64_t)avail_c;
+
+    // Move the playback position to the capture timestamp
+    if ((ts_p.tv_sec || ts_p.tv_nsec) && (ts_c.tv_sec || ts_c.tv_nsec)) {
+        played += htimestamp_diff_ns(&ts_c, &ts_p) * (int64_t)duplex->rate / 1000000000ll;
+    }
+
+    duplex->offset_frames = (snd_pcm_sframes_t)(played - captured);
+    return 0;
+}
+
+/**
+ * @brief Point the detector reference at the phase the emitted tone had.
+ *
+ * After this the lock-in reference for every captured frame equals the
+ * tone phase of the playback frame it was recorded against.
+ *
+ * @param duplex Duplex engine with a measured offset.
+ * @param detector Detector attached to the capture stream.
+ */
+void audio_duplex_align_detector(AudioDuplex *duplex, ToneDetector *detector) {
+    int64_t frame = (int64_t)duplex->capture->frames_read + duplex->offset_frames;
+    tone_detector_set_phase(detector, get_tone_phase_at((uint64_t)frame));
+}
+
+/**
+ * @brief Count the restarts of both directions.
+ *
+ * Each restart breaks the relation between captured and emitted frames, so
+ * a change of this count means the offset must be measured again.
+ *
+ * @param duplex Duplex engine.
+ * @return unsigned int Xruns and suspends recovered on either side.
+ */
+unsigned int audio_duplex_restarts(const AudioDuplex *duplex) {
+    return audio_recovery_total(&duplex->capture->recovery) + audio_recovery_total(get_playback_recovery());
+}
+
+/**
+ * @brief Unlink and close both directions.
+ *
+ * @param duplex Duplex engine.
+ */
+void cleanup_audio_duplex(AudioDuplex *duplex) {
+    if (duplex->linked) {
+        snd_pcm_unlink(duplex->capture->handle);
+        duplex->linked = 0;
+    }
+    cleanup_audio_playback();
+    if (duplex->capture) {
+        cleanup_audio_capture(duplex->capture);
+    }
+}
@@ -0,0 +1,259 @@
+#include "sonarpen.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* This page contains the epoll event loop that wakes the driver only when an input source has work */
+
+// epoll user data: source slot + 1 in the high half (0 is the wakeup fd), descriptor index in the low half
+#define EVENT_TAG(slot, index) ((((uint64_t)(slot) + 1) << 32) | (uint32_t)(index))
+#define EVENT_TAG_SLOT(tag) ((int)((tag) >> 32) - 1)
+#define EVENT_TAG_INDEX(tag) ((int)((tag) & 0xFFFFFFFFu))
+
+/**
+ * @brief Create the epoll instance and the wakeup eventfd.
+ *
+ * @param loop Loop to initialize.
+ * @return int 0 on success, -1 on failure.
+ */
+int event_loop_init(EventLoop *loop) {
+    memset(loop, 0, sizeof(*loop));
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        perror("eventfd");
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Find a free source slot
+static int alloc_source(EventLoop *loop) {
+    for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (!loop->sources[i].in_use) {
+            memset(&loop->sources[i], 0, sizeof(loop->sources[i]));
+            loop->sources[i].in_use = 1;
+            return i;
+        }
+    }
+    fprintf(stderr, "Event loop: too many sources\n");
+    return -1;
+}
+
+/**
+ * @brief Watch a plain file descriptor.
+ *
+ * @param loop Initialized loop.
+ * @param fd Descriptor to watch.
+ * @param events EPOLLIN/EPOLLOUT mask.
+ * @param callback Called with the ready events.
+ * @param userdata Passed to the callback.
+ * @return int 0 on success, -1 on failure.
+ */
+int event_loop_add_fd(EventLoop *loop, int fd, uint32_t events, EventCallback callback, void *userdata) {
+    int slot = alloc_source(loop);
+    if (slot < 0) {
+        return -1;
+    }
+
+    EventSource *source = &loop->sources[slot];
+    source->fds[0].fd = fd;
+    source->fds[0].events = (short)events;
+    source->num_fds = 1;
+    source->callback = callback;
+    source->userdata = userdata;
+
+    struct epoll_event ev = { .events = events, .data.u64 = EVENT_TAG(slot, 0) };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        source->in_use = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Watch every poll descriptor of an ALSA PCM.
+ *
+ * ALSA may describe readiness with several descriptors whose raw events do
+ * not mean "frames available" (e.g. a timer fd). The callback therefore gets
+ * the events translated by snd_pcm_poll_descriptors_revents().
+ *
+ * @param loop Initialized loop.
+ * @param pcm Open PCM handle.
+ * @param callback Called with POLLIN (capture) or POLLOUT (playback) when the PCM is ready.
+ * @param userdata Passed to the callback.
+ * @return int 0 on success, -1 on failure.
+ */
+int event_loop_add_pcm(EventLoop *loop, snd_pcm_t *pcm, EventCallback callback, void *userdata) {
+    int slot = alloc_source(loop);
+    if (slot < 0) {
+        return -1;
+    }
+
+    EventSource *source = &loop->sources[slot];
+    int count = snd_pcm_poll_descriptors_count(pcm);
+    if (count <= 0 || count > EVENT_SOURCE_MAX_FDS) {
+        fprintf(stderr, "Event loop: PCM has %d poll descriptors\n", count);
+        source->in_use = 0;
+        return -1;
+    }
+
+    source->num_fds = snd_pcm_poll_descriptors(pcm, source->fds, (unsigned int)count);
+    source->pcm = pcm;
+    source->callback = callback;
+    source->userdata = userdata;
+
+    for (int i = 0; i < source->num_fds; i++) {
+        struct epoll_event ev = { .events = (uint32_t)source->fds[i].events, .data.u64 = EVENT_TAG(slot, i) };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fds[i].fd, &ev) < 0) {
+            perror("epoll_ctl");
+            for (int j = 0; j < i; j++) {
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fds[j].fd, NULL);
+            }
+            source->in_use = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Stop watching a descriptor added with event_loop_add_fd().
+ *
+ * @param loop Initialized loop.
+ * @param fd Descriptor to remove.
+ */
+void event_loop_remove_fd(EventLoop *loop, int fd) {
+    for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        EventSource *source = &loop->sources[i];
+        if (source->in_use && source->pcm == NULL && source->fds[0].fd == fd) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            source->in_use = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Stop watching a PCM added with event_loop_add_pcm().
+ *
+ * A prepared playback stream always polls writable, so a PCM that is
+ * stopped for a while must be taken out of the loop.
+ *
+ * @param loop Initialized loop.
+ * @param pcm PCM handle to remove.
+ */
+void event_loop_remove_pcm(EventLoop *loop, snd_pcm_t *pcm) {
+    for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        EventSource *source = &loop->sources[i];
+        if (source->in_use && source->pcm == pcm) {
+            for (int j = 0; j < source->num_fds; j++) {
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fds[j].fd, NULL);
+            }
+            source->in_use = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Interrupt a blocking event_loop_run_once(). Async-signal-safe.
+ *
+ * @param loop Initialized loop.
+ */
+void event_loop_wake(EventLoop *loop) {
+    uint64_t one = 1;
+    ssize_t rc = write(loop->wake_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+// Translate the raw events of one PCM descriptor and run the callback
+static void dispatch_pcm(EventSource *source, int index, uint32_t events) {
+    unsigned short revents = 0;
+
+    for (int i = 0; i < source->num_fds; i++) {
+        source->fds[i].revents = i == index ? (short)events : 0;
+    }
+
+    if (snd_pcm_poll_descriptors_revents(source->pcm, source->fds, (unsigned int)source->num_fds, &revents) < 0) {
+        return;
+    }
+    if (revents) {
+        source->callback(source->userdata, revents);
+    }
+}
+
+/**
+ * @brief Wait for ready sources and run their callbacks.
+ *
+ * @param loop Initialized loop.
+ * @param timeout_ms Maximum wait, -1 to wait until something is ready.
+ * @return int Number of sources dispatched, 0 on timeout or wakeup, -1 on failure.
+ */
+int event_loop_run_once(EventLoop *loop, int timeout_ms) {
+    struct epoll_event events[EVENT_LOOP_MAX_SOURCES * EVENT_SOURCE_MAX_FDS];
+    int dispatched = 0;
+
+    int n = epoll_wait(loop->epoll_fd, events, (int)(sizeof(events) / sizeof(events[0])), timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = events[i].data.u64;
+
+        if (tag == 0) {
+            // Wakeup request: just clear the counter
+            uint64_t count;
+            ssize_t rc = read(loop->wake_fd, &count, sizeof(count));
+            (void)rc;
+            continue;
+        }
+
+        EventSource *source = &loop->sources[EVENT_TAG_SLOT(tag)];
+        if (!source->in_use) {
+            continue;
+        }
+
+        if (source->pcm) {
+            dispatch_pcm(source, EVENT_TAG_INDEX(tag), events[i].events);
+        } else {
+            source->callback(source->userdata, events[i].events);
+        }
+        dispatched++;
+    }
+
+    return dispatched;
+}
+
+/**
+ * @brief Close the epoll instance and the wakeup eventfd.
+ *
+ * Watched descriptors are not closed; they belong to their owners.
+ *
+ * @param loop Loop to clean up.
+ */
+void event_loop_cleanup(EventLoop *loop) {
+    if (loop->wake_fd >= 0) close(loop->wake_fd);
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    loop->wake_fd = -1;
+    loop->epoll_fd = -1;
+}
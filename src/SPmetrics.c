@@ -0,0 +1,223 @@
+#include "sonarpen.h"
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* This page contains the lock-free metrics of the hot path and the shared page sonarpen-stat reads them from */
+
+// Metrics go here until metrics_publish() moves them into shared memory
+static SonarpenMetrics private_metrics;
+static SonarpenMetrics *metrics = &private_metrics;
+
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+    "audio blocks", "touch frames", "tablet reports", "pressure drops", "touch resyncs",
+    "capture overruns", "capture resumes", "playback underruns", "playback resumes",
+    "idle bursts",
+};
+
+static const char *gauge_names[METRIC_GAUGE_COUNT] = {
+    "queue depth", "queue depth max", "tone level (x1000)", "tone idle",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "capture interval", "detector time", "touch to tablet", "pressure to tablet",
+};
+
+/**
+ * @brief Move the metrics into the shared page METRICS_SHM_NAME.
+ *
+ * Call before the pipeline threads start. If another running driver owns
+ * the page, or shared memory is unavailable, metrics stay private.
+ *
+ * @return int 0 on success, -1 if the metrics are not published.
+ */
+int metrics_publish(void) {
+    struct timespec ts;
+    int fd = shm_open(METRICS_SHM_NAME, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Metrics: cannot create %s: %s\n", METRICS_SHM_NAME, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(SonarpenMetrics)) < 0) {
+        fprintf(stderr, "Metrics: cannot size %s: %s\n", METRICS_SHM_NAME, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    SonarpenMetrics *page = mmap(NULL, sizeof(SonarpenMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "Metrics: cannot map %s: %s\n", METRICS_SHM_NAME, strerror(errno));
+        return -1;
+    }
+
+    // A page left behind by a crashed driver is reused, a live driver's is not
+    if (page->magic == METRICS_MAGIC && page->pid != getpid() && kill((pid_t)page->pid, 0) == 0) {
+        fprintf(stderr, "Metrics: driver %lld already publishes %s\n", (long long)page->pid, METRICS_SHM_NAME);
+        munmap(page, sizeof(SonarpenMetrics));
+        return -1;
+    }
+
+    page->magic = 0;
+    atomic_thread_fence(memory_order_release);
+    memcpy(page, metrics, sizeof(SonarpenMetrics));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    page->version = METRICS_VERSION;
+    page->pid = getpid();
+    page->started_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    atomic_thread_fence(memory_order_release);
+    page->magic = METRICS_MAGIC;
+
+    metrics = page;
+    return 0;
+}
+
+/**
+ * @brief Remove the shared page. Call only after the pipeline threads are joined.
+ */
+void metrics_unpublish(void) {
+    if (metrics == &private_metrics) {
+        return;
+    }
+    SonarpenMetrics *page = metrics;
+    metrics = &private_metrics;
+    page->magic = 0;  // Tells readers still mapping it that the driver is gone
+    munmap(page, sizeof(SonarpenMetrics));
+    shm_unlink(METRICS_SHM_NAME);
+}
+
+/**
+ * @brief Map the page of the running driver read-only.
+ *
+ * @return const SonarpenMetrics* The page, or NULL if no driver publishes metrics.
+ */
+const SonarpenMetrics *metrics_map(void) {
+    struct stat st;
+    int fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No driver metrics at %s: %s\n", METRICS_SHM_NAME, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SonarpenMetrics)) {
+        fprintf(stderr, "Driver metrics at %s have an unknown layout\n", METRICS_SHM_NAME);
+        close(fd);
+        return NULL;
+    }
+    const SonarpenMetrics *page = mmap(NULL, sizeof(SonarpenMetrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("metrics_map: mmap");
+        return NULL;
+    }
+    if (page->magic != METRICS_MAGIC || page->version != METRICS_VERSION) {
+        fprintf(stderr, "Driver metrics at %s are not initialized or of another version\n", METRICS_SHM_NAME);
+        munmap((void *)page, sizeof(SonarpenMetrics));
+        return NULL;
+    }
+    return page;
+}
+
+/**
+ * @brief Unmap a page from metrics_map().
+ *
+ * @param page Mapped page.
+ */
+void metrics_unmap(const SonarpenMetrics *page) {
+    munmap((void *)page, sizeof(SonarpenMetrics));
+}
+
+/**
+ * @brief Add to a counter.
+ *
+ * @param counter Counter to add to.
+ * @param n Amount.
+ */
+void metrics_count(MetricCounter counter, uint64_t n) {
+    atomic_fetch_add_explicit(&metrics->counters[counter], n, memory_order_relaxed);
+}
+
+/**
+ * @brief Set a gauge.
+ *
+ * @param gauge Gauge to set.
+ * @param value New value.
+ */
+void metrics_set(MetricGauge gauge, int64_t value) {
+    atomic_store_explicit(&metrics->gauges[gauge], value, memory_order_relaxed);
+}
+
+/**
+ * @brief Raise a gauge to the value if it is below it.
+ *
+ * @param gauge Gauge holding a maximum.
+ * @param value Candidate value.
+ */
+void metrics_set_max(MetricGauge gauge, int64_t value) {
+    int64_t old = atomic_load_explicit(&metrics->gauges[gauge], memory_order_relaxed);
+    while (old < value && !atomic_compare_exchange_weak_explicit(&metrics->gauges[gauge], &old, value,
+                                                                 memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Add one duration to a histogram.
+ *
+ * @param histogram Histogram to update.
+ * @param ns Duration in nanoseconds.
+ */
+void metrics_record(MetricHistogram histogram, uint64_t ns) {
+    MetricsHistogram *h = &metrics->histograms[histogram];
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+
+    uint64_t old = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    while (old < ns && !atomic_compare_exchange_weak_explicit(&h->max_ns, &old, ns,
+                                                              memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Copy the recovery counts of both streams into the metrics.
+ *
+ * @param capture Capture stream counts.
+ * @param playback Playback stream counts, or NULL.
+ */
+void metrics_note_recovery(const AudioRecovery *capture, const AudioRecovery *playback) {
+    atomic_store_explicit(&metrics->counters[METRIC_CAPTURE_XRUNS], atomic_load(&capture->xruns), memory_order_relaxed);
+    atomic_store_explicit(&metrics->counters[METRIC_CAPTURE_SUSPENDS], atomic_load(&capture->suspends),
+                          memory_order_relaxed);
+    if (playback) {
+        atomic_store_explicit(&metrics->counters[METRIC_PLAYBACK_XRUNS], atomic_load(&playback->xruns),
+                              memory_order_relaxed);
+        atomic_store_explicit(&metrics->counters[METRIC_PLAYBACK_SUSPENDS], atomic_load(&playback->suspends),
+                              memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Display name of a counter.
+ */
+const char *metrics_counter_name(MetricCounter counter) {
+    return counter_names[counter];
+}
+
+/**
+ * @brief Display name of a gauge.
+ */
+const char *metrics_gauge_name(MetricGauge gauge) {
+    return gauge_names[gauge];
+}
+
+/**
+ * @brief Display name of a histogram.
+ */
+const char *metrics_histogram_name(MetricHistogram histogram) {
+    return histogram_names[histogram];
+}
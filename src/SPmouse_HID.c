@@ -2,6 +2,17 @@
 #include <fcntl.h>
 #include <linux/uinput.h>
 #include <math.h>
+#include <signal.h>
+
+static SonarpenPipeline *active_pipeline = NULL;
+
+// Stop the pipeline on Ctrl-C so the virtual tablet is destroyed cleanly
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    if (active_pipeline) {
+        pipeline_stop(active_pipeline);
+    }
+}
 
 // Define emit function
 void emit(int fd, int type, int code, int value) {
@@ -15,8 +26,115 @@ void emit(int fd, int type, int code, int value) {
     }
 }
 
+/**
+ * @brief Start a new output report.
+ *
+ * @param frame Frame to reset.
+ * @param fd uinput file descriptor.
+ * @param time Timestamp of the source events, or NULL to take the current time once.
+ */
+void uinput_frame_begin(UinputFrame *frame, int fd, const struct timeval *time) {
+    frame->fd = fd;
+    frame->count = 0;
+    if (time) {
+        frame->time = *time;
+    } else {
+        gettimeofday(&frame->time, NULL);
+    }
+}
+
+/**
+ * @brief Queue one event. Events beyond the frame capacity are dropped.
+ *
+ * @param frame Frame started with uinput_frame_begin().
+ * @param type Event type.
+ * @param code Event code.
+ * @param value Event value.
+ */
+void uinput_frame_add(UinputFrame *frame, int type, int code, int value) {
+    // Keep the last slot for SYN_REPORT
+    if (frame->count >= UINPUT_FRAME_MAX_EVENTS - 1) {
+        return;
+    }
+
+    struct input_event *ev = &frame->events[frame->count++];
+    ev->time = frame->time;
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+/**
+ * @brief Terminate the report with SYN_REPORT and write it in one syscall.
+ *
+ * @param frame Frame to submit.
+ * @return int 0 on success, -1 if the write failed or was short.
+ */
+int uinput_frame_commit(UinputFrame *frame) {
+    struct input_event *syn = &frame->events[frame->count++];
+    syn->time = frame->time;
+    syn->type = EV_SYN;
+    syn->code = SYN_REPORT;
+    syn->value = 0;
+
+    size_t size = frame->count * sizeof(struct input_event);
+    ssize_t written = write(frame->fd, frame->events, size);
+    frame->count = 0;
+
+    if (written < 0) {
+        perror("uinput_frame_commit: write");
+        return -1;
+    }
+    if ((size_t)written != size) {
+        fprintf(stderr, "uinput_frame_commit: short write (%zd of %zu bytes)\n", written, size);
+        return -1;
+    }
+    metrics_count(METRIC_TABLET_REPORTS, 1);
+    return 0;
+}
+
+/**
+ * @brief Axes used when no source device is known yet.
+ *
+ * @param axes Axes to fill.
+ */
+void tablet_axes_default(TabletAxes *axes) {
+    memset(axes, 0, sizeof(*axes));
+    axes->x.maximum = COORD_OUTPUT_MAX;
+    axes->x.resolution = 100;
+    axes->y = axes->x;
+    axes->direct = 1;
+}
+
+/**
+ * @brief Derive the tablet axes from a source device and the mapping onto it.
+ *
+ * The range is always 0..COORD_OUTPUT_MAX, so a device bound later fits the
+ * same tablet; only the resolution follows the source's physical size.
+ *
+ * @param dev Source touch device.
+ * @param mapping Rotation, region and area.
+ * @param axes Axes to fill; defaults when the device has no usable axes.
+ * @return int 0 on success, -1 if the defaults were used.
+ */
+int tablet_axes_from_device(struct libevdev *dev, const CoordMapping *mapping, TabletAxes *axes) {
+    CoordTransform transform;
+
+    tablet_axes_default(axes);
+    axes->direct = libevdev_has_property(dev, INPUT_PROP_DIRECT);
+    if (coord_transform_from_device(&transform, dev, mapping) < 0) {
+        return -1;
+    }
+
+    if (transform.resolution_x > 0 && transform.resolution_y > 0) {
+        axes->x.resolution = transform.resolution_x;
+        axes->y.resolution = transform.resolution_y;
+    }
+    return 0;
+}
+
 // Define setup_uinput_device function
-int setup_uinput_device(void) {
+int setup_uinput_device(const TabletAxes *axes) {
     struct uinput_setup usetup;
     struct uinput_abs_setup abs_setup;
 
@@ -26,6 +144,7 @@ int setup_uinput_device(void) {
         return -1;
     }
 
+    // Enable the necessary events for a pen tablet
     ioctl(fd, UI_SET_EVBIT, EV_ABS);
     ioctl(fd, UI_SET_ABSBIT, ABS_X);
     ioctl(fd, UI_SET_ABSBIT, ABS_Y);
@@ -33,104 +152,235 @@ int setup_uinput_device(void) {
     ioctl(fd, UI_SET_EVBIT, EV_KEY);
     ioctl(fd, UI_SET_KEYBIT, BTN_TOOL_PEN);
     ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH);
+    if (axes->direct) {
+        ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+    }
 
+    // Positions are mapped onto these ranges by the pipeline
     memset(&abs_setup, 0, sizeof(abs_setup));
     abs_setup.code = ABS_X;
-    abs_setup.absinfo.minimum = 0;
-    abs_setup.absinfo.maximum = 32767;
-    abs_setup.absinfo.resolution = 100;
+    abs_setup.absinfo = axes->x;
     ioctl(fd, UI_ABS_SETUP, &abs_setup);
 
     abs_setup.code = ABS_Y;
+    abs_setup.absinfo = axes->y;
     ioctl(fd, UI_ABS_SETUP, &abs_setup);
 
+    memset(&abs_setup, 0, sizeof(abs_setup));
     abs_setup.code = ABS_PRESSURE;
     abs_setup.absinfo.minimum = 0;
-    abs_setup.absinfo.maximum = 255;
+    abs_setup.absinfo.maximum = PRESSURE_MAX;
     ioctl(fd, UI_ABS_SETUP, &abs_setup);
 
     memset(&usetup, 0, sizeof(usetup));
     usetup.id.bustype = BUS_USB;
-    usetup.id.vendor = 0x1209;
-    usetup.id.product = 0x5678;
+    usetup.id.vendor = UINPUT_VENDOR_ID;
+    usetup.id.product = UINPUT_PRODUCT_ID;
     strcpy(usetup.name, "Virtual Pen Tablet");
 
     ioctl(fd, UI_DEV_SETUP, &usetup);
     ioctl(fd, UI_DEV_CREATE);
-fprintf("innitialized");
+    printf("Virtual pen tablet initialized\n");
     return fd;
 }
 
 // Main function for SPmouse_HID
-int SPmouse_HID() {
-    static float last_volume = 0.0;
+int SPmouse_HID(const SonarpenConfig *config) {
+    SonarpenConfig defaults;
+    if (config == NULL) {
+        sonarpen_config_default(&defaults);
+        config = &defaults;
+    }
 
-    AudioCapture audio_capture = {0};
-    if (init_audio_capture(&audio_capture) < 0) {
-        fprintf(stderr, "Failed to initialize audio capture.\n");
-        return 1;
+    // Only guarded sections are checked, and the first one opens in pipeline_run()
+    if (config->assert_no_alloc) {
+        if (alloc_guard_enable() < 0) {
+            return 1;
+        }
+        printf("Allocation guard on: the audio path aborts if it allocates\n");
     }
 
-    struct libevdev *touchpad_dev = NULL;
-    const char *touchpad_path = "/dev/input/event7";
-    if (init_touchpad_device(&touchpad_dev, touchpad_path) != 0) {
-        cleanup_audio_capture(&audio_capture);
-        return 1;
+    // Use the given touch device, the one from the last run, or the best one udev knows about
+    char touchpad_path[64] = "";
+    if (config->input_path) {
+        snprintf(touchpad_path, sizeof(touchpad_path), "%s", config->input_path);
+    } else if (config->cache && find_input_device(config->cache, touchpad_path, sizeof(touchpad_path)) == 0) {
+        printf("Using cached touch device %s\n", touchpad_path);
+    } else {
+        printf("Searching for touch devices...\n");
+        if (discover_touch_device(touchpad_path, sizeof(touchpad_path)) < 0) {
+            printf("No touch device found yet, waiting for one to be plugged in\n");
+        }
     }
 
-    int uinput_fd = setup_uinput_device();
+    InputHotplug hotplug;
+    int have_hotplug = input_hotplug_init(&hotplug, config->input_path) == 0;
+
+    // Size the tablet like the source when it is already known
+    TabletAxes axes;
+    if (!touchpad_path[0] || probe_touch_axes(touchpad_path, &config->mapping, &axes) < 0) {
+        tablet_axes_default(&axes);
+    }
+
+    int uinput_fd = setup_uinput_device(&axes);
     if (uinput_fd < 0) {
-        libevdev_free(touchpad_dev);
-        cleanup_audio_capture(&audio_capture);
+        if (have_hotplug) input_hotplug_cleanup(&hotplug);
         return 1;
     }
 
-    if (init_audio_playback() < 0) {
-        libevdev_free(touchpad_dev);
-        cleanup_audio_capture(&audio_capture);
+    // Capture and playback at one rate, linked, so the tone and the measurement share a clock
+    AudioCapture audio_capture = {0};
+    AudioDuplex duplex;
+    if (init_audio_duplex(&duplex, &audio_capture, &config->audio) < 0) {
+        if (have_hotplug) input_hotplug_cleanup(&hotplug);
+        ioctl(uinput_fd, UI_DEV_DESTROY);
+        close(uinput_fd);
+        return 1;
+    }
+
+    AudioStreamInfo playback_info;
+    get_playback_info(&playback_info);
+    print_stream_info("Capture", &audio_capture.info);
+    print_stream_info("Playback", &playback_info);
+    if (config->cache && config->cache->audio_in_use) {
+        device_cache_set_stream(config->cache, &audio_capture.info);
+    }
+
+    // Probe tone: given, swept now, swept for this card before, or the default
+    float carrier = PROBE_TONE_FREQUENCY;
+    if (config->cache && config->cache->audio_in_use && config->cache->carrier > 0.0f) {
+        carrier = config->cache->carrier;
+    }
+    if (config->carrier > 0.0f) {
+        carrier = config->carrier;
+    } else if (config->sweep_carriers) {
+        CarrierSweep sweep;
+        if (carrier_sweep(&duplex, config->num_carrier_candidates ? config->carrier_candidates : NULL,
+                          config->num_carrier_candidates, &sweep) == 0) {
+            carrier = sweep.results[sweep.best].frequency;
+            if (config->cache && config->cache->audio_in_use) {
+                config->cache->carrier = carrier;
+            }
+        }
+    }
+    printf("Probe tone: %.0f Hz\n", carrier);
+
+    // Working memory of the audio path, mapped once so it can be prefaulted and locked as a whole
+    Arena arena;
+    if (arena_init(&arena, HOT_PATH_ARENA_SIZE) < 0) {
+        if (have_hotplug) input_hotplug_cleanup(&hotplug);
+        cleanup_audio_duplex(&duplex);
         ioctl(uinput_fd, UI_DEV_DESTROY);
         close(uinput_fd);
         return 1;
     }
 
-    while (1) {
-        float volume = capture_audio(&audio_capture);
-        if (volume < 0) {
-            break;
+    // Measure only the probe tone, which allows much shorter capture blocks
+    ToneDetector *detector = (ToneDetector *)arena_alloc(&arena, sizeof(ToneDetector));
+    if (detector && tone_detector_init(detector, config->detector, carrier,
+                                       audio_capture.info.rate, DETECTOR_BANDWIDTH_HZ) == 0) {
+        audio_capture.detector = detector;
+        if (audio_capture.block_frames > DETECTOR_BLOCK_FRAMES) {
+            audio_capture.block_frames = DETECTOR_BLOCK_FRAMES;
         }
+        tone_detector_set_block(detector, audio_capture.block_frames);
+        printf("Tone detector: %u-frame blocks, %s kernels%s\n", audio_capture.block_frames, dsp_kernel_name(),
+               detector->type == DETECTOR_LOCKIN_FIXED ? ", fixed-point path" : "");
+    }
 
-        last_volume = volume;
-        printf("Microphone Volume (RMS): %.2f\n", volume);
+    // Pressure curve from the last calibration of this card, or a fresh one when asked for
+    DeviceCache *card_cache = config->cache && config->cache->audio_in_use ? config->cache : NULL;
+    PressureCalibration calibration;
+    PressureCurve pressure_curve;
+    pressure_calibration_default(&calibration);
+    if (card_cache && card_cache->has_calibration) {
+        // Levels depend on the response at the carrier, so a calibration at another one is stale
+        if (card_cache->calibration_carrier == carrier) {
+            calibration = card_cache->calibration;
+        } else if (!config->calibrate) {
+            printf("Pressure calibration was made at %.0f Hz, run with --calibrate again\n",
+                   card_cache->calibration_carrier);
+        }
+    }
+    if (config->calibrate && pressure_calibrate(&duplex, carrier, &calibration) == 0 && card_cache) {
+        card_cache->calibration = calibration;
+        card_cache->calibration_carrier = carrier;
+        card_cache->has_calibration = 1;
+    }
+    if (pressure_curve_build(&pressure_curve, &calibration) < 0) {
+        pressure_calibration_default(&calibration);
+        pressure_curve_build(&pressure_curve, &calibration);
+    }
+    printf("Pressure: zero at %.1f, full at %.1f, gamma %.2f, %d levels\n",
+           pressure_curve.zero_level, calibration.full, pressure_curve.gamma, PRESSURE_MAX + 1);
 
-        struct input_event ev;
-        int rc = libevdev_next_event(touchpad_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+    SonarpenPipeline pipeline;
+    int result = 1;
+    if (pipeline_init(&pipeline, &audio_capture, uinput_fd, carrier, &arena) == 0) {
+        pipeline.duplex = &duplex;
+        pipeline.single_thread = config->single_thread;
+        pipeline.hotplug = have_hotplug ? &hotplug : NULL;
+        pipeline.pressure_curve = &pressure_curve;
+        pipeline.coord_mapping = &config->mapping;
+        pipeline.realtime = config->realtime.enabled ? &config->realtime : NULL;
+        pipeline.idle_duty = config->idle_duty;
+        pressure_filter_init(&pipeline.pressure_filter, config->pressure_filter, calibration.full);
+        pressure_filter_set_step(&pipeline.pressure_filter,
+                                 (float)audio_capture.block_frames / audio_capture.info.rate);
+        pipeline.fixed_point = audio_capture.detector && audio_capture.detector->type == DETECTOR_LOCKIN_FIXED;
 
-        if (rc == 0) {
-            if (ev.type == EV_ABS) {
-                if (ev.code == ABS_X) {
-                    emit(uinput_fd, EV_ABS, ABS_X, ev.value);
-                } else if (ev.code == ABS_Y) {
-                    emit(uinput_fd, EV_ABS, ABS_Y, ev.value);
-                }
-            }
+        if (touchpad_path[0] && pipeline_bind_touch_device(&pipeline, touchpad_path) < 0 && !have_hotplug) {
+            pipeline_cleanup(&pipeline);
+            arena_cleanup(&arena);
+            cleanup_audio_duplex(&duplex);
+            ioctl(uinput_fd, UI_DEV_DESTROY);
+            close(uinput_fd);
+            return 1;
+        }
 
-            int pressure = (int)(last_volume * 255.0f / MAX_RMS_VALUE);
-            if (pressure > 255) pressure = 255;
-            emit(uinput_fd, EV_ABS, ABS_PRESSURE, pressure);
+        // Remember what works now, so the next start can skip the scans
+        if (config->cache) {
+            if (pipeline.touch_dev) {
+                device_cache_set_input(config->cache, pipeline.touch_dev);
+            }
+            device_cache_save(config->cache);
+        }
 
-            emit(uinput_fd, EV_SYN, SYN_REPORT, 0);
+        // Counters and latencies for sonarpen-stat, published before the memory gets locked
+        if (metrics_publish() == 0) {
+            printf("Metrics published at %s, read them with sonarpen-stat\n", METRICS_SHM_NAME);
         }
 
-        if (play_tone(2000.0) < 0) {
-            break;
+        // Everything the audio path touches exists now; keep it resident
+        if (pipeline.realtime) {
+            realtime_lock_memory();
+            realtime_prefault(audio_capture.buffer, BUFFER_SIZE);
+            realtime_prefault(arena.base, arena.used);
         }
+
+        active_pipeline = &pipeline;
+        signal(SIGINT, handle_stop_signal);
+        signal(SIGTERM, handle_stop_signal);
+
+        result = pipeline_run(&pipeline) < 0 ? 1 : 0;
+
+        const AudioRecovery *playback_recovery = get_playback_recovery();
+        printf("Audio recoveries: capture %u overruns, %u resumes; playback %u underruns, %u resumes\n",
+               atomic_load(&audio_capture.recovery.xruns), atomic_load(&audio_capture.recovery.suspends),
+               atomic_load(&playback_recovery->xruns), atomic_load(&playback_recovery->suspends));
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        active_pipeline = NULL;
+        pipeline_cleanup(&pipeline);
+        metrics_unpublish();
     }
 
-    libevdev_free(touchpad_dev);
-    cleanup_audio_capture(&audio_capture);
-    cleanup_audio_playback();
+    if (have_hotplug) input_hotplug_cleanup(&hotplug);
+    cleanup_audio_duplex(&duplex);
+    arena_cleanup(&arena);
     ioctl(uinput_fd, UI_DEV_DESTROY);
     close(uinput_fd);
 
-    return 0;
+    return result;
 }
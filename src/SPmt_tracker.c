@@ -0,0 +1,174 @@
+#include "sonarpen.h"
+
+/* This page contains the multi-touch slot tracker that picks the pen out of all contacts */
+
+// Event timestamp in nanoseconds (CLOCK_MONOTONIC once init_touchpad_device() set the clock)
+static uint64_t event_time_ns(const struct timeval *time) {
+    return (uint64_t)time->tv_sec * 1000000000ull + (uint64_t)time->tv_usec * 1000ull;
+}
+
+/**
+ * @brief Initialize the tracker from the current device state.
+ *
+ * Devices without protocol B slots leave the tracker disabled, and the
+ * forwarder keeps using ABS_X/ABS_Y.
+ *
+ * @param tracker Tracker to initialize.
+ * @param dev Source touch device.
+ */
+void mt_tracker_init(MtTracker *tracker, struct libevdev *dev) {
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->pen_slot = -1;
+
+    if (!libevdev_has_event_code(dev, EV_ABS, ABS_MT_SLOT) ||
+        !libevdev_has_event_code(dev, EV_ABS, ABS_MT_TRACKING_ID)) {
+        return;
+    }
+
+    tracker->enabled = 1;
+    tracker->num_slots = libevdev_get_num_slots(dev);
+    if (tracker->num_slots > MT_MAX_SLOTS) {
+        tracker->num_slots = MT_MAX_SLOTS;
+    }
+
+    uint64_t now = monotonic_time_ns();
+    mt_tracker_resync(tracker, dev, now);
+    for (int i = 0; i < tracker->num_slots; i++) {
+        tracker->slots[i].dirty = 0;
+    }
+}
+
+/**
+ * @brief Rebuild every slot from libevdev's state, e.g. after SYN_DROPPED.
+ *
+ * @param tracker Enabled tracker.
+ * @param dev Source touch device.
+ * @param now_ns Time assigned to contacts that appeared while events were lost.
+ */
+void mt_tracker_resync(MtTracker *tracker, struct libevdev *dev, uint64_t now_ns) {
+    if (!tracker->enabled) {
+        return;
+    }
+
+    tracker->current_slot = libevdev_get_current_slot(dev);
+    for (int i = 0; i < tracker->num_slots; i++) {
+        MtContact *contact = &tracker->slots[i];
+        int id = libevdev_get_slot_value(dev, i, ABS_MT_TRACKING_ID);
+
+        if (id != contact->tracking_id) {
+            contact->down_ns = now_ns;
+            if (i == tracker->pen_slot) {
+                tracker->pen_slot = -1;
+            }
+        }
+        contact->tracking_id = id;
+        contact->x = libevdev_get_slot_value(dev, i, ABS_MT_POSITION_X);
+        contact->y = libevdev_get_slot_value(dev, i, ABS_MT_POSITION_Y);
+        contact->dirty = 1;
+    }
+}
+
+/**
+ * @brief Apply one source event to the slot state.
+ *
+ * @param tracker Tracker; ignored when disabled.
+ * @param ev Event read from the source device.
+ */
+void mt_tracker_handle_event(MtTracker *tracker, const struct input_event *ev) {
+    if (!tracker->enabled || ev->type != EV_ABS) {
+        return;
+    }
+
+    if (ev->code == ABS_MT_SLOT) {
+        tracker->current_slot = ev->value;
+        return;
+    }
+
+    if (tracker->current_slot < 0 || tracker->current_slot >= tracker->num_slots) {
+        return;
+    }
+
+    MtContact *contact = &tracker->slots[tracker->current_slot];
+    switch (ev->code) {
+    case ABS_MT_TRACKING_ID:
+        if (ev->value >= 0 && contact->tracking_id < 0) {
+            contact->down_ns = event_time_ns(&ev->time);
+        }
+        if (ev->value < 0 && tracker->current_slot == tracker->pen_slot) {
+            tracker->pen_slot = -1;
+        }
+        contact->tracking_id = ev->value;
+        contact->dirty = 1;
+        break;
+    case ABS_MT_POSITION_X:
+        contact->x = ev->value;
+        contact->dirty = 1;
+        break;
+    case ABS_MT_POSITION_Y:
+        contact->y = ev->value;
+        contact->dirty = 1;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Record the time the acoustic pressure rose, i.e. the pen touched down.
+ *
+ * @param tracker Tracker.
+ * @param onset_ns CLOCK_MONOTONIC time of the pressure onset.
+ */
+void mt_tracker_note_onset(MtTracker *tracker, uint64_t onset_ns) {
+    tracker->onset_ns = onset_ns;
+    tracker->pen_locked = 0;
+}
+
+/**
+ * @brief Decide which contact is the pen.
+ *
+ * A contact that touched down within PEN_ONSET_WINDOW_NS of the acoustic
+ * onset is taken as the pen and kept until it lifts. Without such a match
+ * the newest contact is used, since a palm normally lands before the nib;
+ * that guess is re-evaluated on every frame.
+ *
+ * @param tracker Enabled tracker.
+ * @return int Slot of the pen, or -1 if no contact is down.
+ */
+int mt_tracker_select_pen(MtTracker *tracker) {
+    if (tracker->pen_locked && tracker->pen_slot >= 0 &&
+        tracker->slots[tracker->pen_slot].tracking_id >= 0) {
+        return tracker->pen_slot;
+    }
+
+    int best = -1, newest = -1;
+    uint64_t best_gap = PEN_ONSET_WINDOW_NS + 1;
+
+    for (int i = 0; i < tracker->num_slots; i++) {
+        const MtContact *contact = &tracker->slots[i];
+        if (contact->tracking_id < 0) {
+            continue;
+        }
+
+        if (newest < 0 || contact->down_ns > tracker->slots[newest].down_ns) {
+            newest = i;
+        }
+
+        if (tracker->onset_ns) {
+            uint64_t gap = contact->down_ns > tracker->onset_ns ? contact->down_ns - tracker->onset_ns
+                                                                : tracker->onset_ns - contact->down_ns;
+            if (gap < best_gap) {
+                best_gap = gap;
+                best = i;
+            }
+        }
+    }
+
+    if (best >= 0) {
+        tracker->pen_slot = best;
+        tracker->pen_locked = 1;
+    } else {
+        tracker->pen_slot = newest;
+    }
+    return tracker->pen_slot;
+}
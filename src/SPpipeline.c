@@ -0,0 +1,1156 @@
+#include "sonarpen.h"
+#include <sys/epoll.h>
+#include <time.h>
+
+/* This page contains the threads that connect audio capture, tone playback and touch forwarding */
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t monotonic_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Capture and measure one audio block.
+ *
+ * On the first successful block of a duplex stream, and again after either
+ * stream was restarted, the detector reference is locked to the emitted tone.
+ *
+ * @return int 0 on success, 1 if the stream was restarted and there is no sample, -1 if capture failed.
+ */
+static int capture_block(SonarpenPipeline *pipeline, PressureSample *sample) {
+    float volume = capture_audio(pipeline->capture);
+    if (volume == CAPTURE_RECOVERED) {
+        return 1;
+    }
+    if (volume < 0) {
+        return -1;
+    }
+
+    // Either stream restarted: the offset and everything measured against it are stale
+    if (pipeline->duplex) {
+        unsigned int restarts = audio_duplex_restarts(pipeline->duplex);
+        if (restarts != pipeline->restarts_seen) {
+            pipeline->restarts_seen = restarts;
+            pipeline->aligned = 0;
+            pipeline->quiet_align = 0;
+            if (pipeline->capture->detector) {
+                tone_detector_reset(pipeline->capture->detector);
+            }
+            pressure_filter_reset(&pipeline->pressure_filter);
+        }
+    }
+
+    // Once both streams run, lock the detector reference to the emitted tone
+    if (!pipeline->aligned && pipeline->duplex && audio_duplex_measure_offset(pipeline->duplex) == 0) {
+        AudioDuplex *duplex = pipeline->duplex;
+        if (!pipeline->quiet_align) {
+            printf("Duplex offset: %ld frames (%.2f ms), streams %s\n",
+                   (long)duplex->offset_frames, 1000.0 * duplex->offset_frames / duplex->rate,
+                   duplex->linked ? "linked" : "unlinked");
+        }
+        if (pipeline->capture->detector) {
+            audio_duplex_align_detector(duplex, pipeline->capture->detector);
+        }
+        pipeline->aligned = 1;
+        pipeline->quiet_align = 0;
+    }
+
+    uint64_t now = monotonic_time_ns();
+    if (pipeline->last_block_ns) {
+        metrics_record(METRIC_CAPTURE_INTERVAL, now - pipeline->last_block_ns);
+    }
+    pipeline->last_block_ns = now;
+    metrics_count(METRIC_AUDIO_BLOCKS, 1);
+    metrics_note_recovery(&pipeline->capture->recovery, get_playback_recovery());
+    sample->timestamp_ns = now;
+
+    // The fixed-point detector left its level as an integer; it stays one up to the pressure value
+    if (pipeline->fixed_point) {
+        int32_t level_q = pipeline->capture->detector->level_q;
+        metrics_set(METRIC_TONE_LEVEL, ((int64_t)level_q * 1000) >> LEVEL_FRAC_BITS);
+        sample->level_q = pressure_filter_process_fixed(&pipeline->pressure_filter, level_q);
+        return 0;
+    }
+    metrics_set(METRIC_TONE_LEVEL, (int64_t)(volume * 1000.0f));
+
+    // Smooth block-to-block jitter here, where blocks arrive at an even pace
+    float dt = (float)pipeline->capture->block_frames / pipeline->capture->info.rate;
+    sample->level = pressure_filter_process(&pipeline->pressure_filter, volume, dt);
+    return 0;
+}
+
+// Whether a sample is above the level at which the pen counts as lifted
+static int above_release(const SonarpenPipeline *pipeline, const PressureSample *sample) {
+    if (pipeline->fixed_point) {
+        return sample->level_q > pipeline->pressure_curve->release_q;
+    }
+    return sample->level > pipeline->pressure_curve->release_level;
+}
+
+// Wait on idle_cond with idle_lock held; the bound also lets waiters notice pipeline_stop(), which cannot signal
+static void idle_wait(SonarpenPipeline *pipeline, uint64_t deadline_ns) {
+    struct timespec ts = { .tv_sec = (time_t)(deadline_ns / 1000000000ull),
+                           .tv_nsec = (long)(deadline_ns % 1000000000ull) };
+    pthread_cond_timedwait(&pipeline->idle_cond, &pipeline->idle_lock, &ts);
+}
+
+/**
+ * @brief End idle: a touch frame or a pen onset was seen.
+ *
+ * Runs on the input/output side. Whoever owns the streams restarts the
+ * tone before its next capture block.
+ */
+static void idle_leave(SonarpenPipeline *pipeline) {
+    pipeline->last_activity_ns = monotonic_time_ns();
+    if (!atomic_load(&pipeline->idle)) {
+        return;
+    }
+    pthread_mutex_lock(&pipeline->idle_lock);
+    atomic_store(&pipeline->idle, 0);
+    pthread_cond_broadcast(&pipeline->idle_cond);
+    pthread_mutex_unlock(&pipeline->idle_lock);
+}
+
+/**
+ * @brief Raise idle once neither a contact nor pen pressure was seen for IDLE_ENTER_MS.
+ *
+ * Runs on the input/output side after every wakeup.
+ *
+ * @return int Event loop timeout in ms until idle is due, -1 for none.
+ */
+static int idle_check(SonarpenPipeline *pipeline) {
+    if (!pipeline->idle_duty || atomic_load(&pipeline->idle)) {
+        return -1;
+    }
+
+    uint64_t now = monotonic_time_ns();
+    if ((pipeline->touch_dev && pipeline->touch_frame.contact) || pipeline->pen_sounding) {
+        pipeline->last_activity_ns = now;
+    }
+    uint64_t due = pipeline->last_activity_ns + IDLE_ENTER_MS * 1000000ull;
+    if (now >= due) {
+        atomic_store(&pipeline->idle, 1);
+        return -1;
+    }
+    return (int)((due - now + 999999) / 1000000);
+}
+
+// Playback frame leaving the device now; once the stream stopped, everything written counts as played
+static uint64_t playback_position(void) {
+    AudioStreamInfo info;
+    uint64_t written = get_playback_frames_written();
+    snd_pcm_sframes_t avail = snd_pcm_avail(get_playback_handle());
+
+    get_playback_info(&info);
+    if (avail < 0 || (snd_pcm_uframes_t)avail >= info.buffer_frames) {
+        return written;
+    }
+    return written - (info.buffer_frames - (snd_pcm_uframes_t)avail);
+}
+
+// Top the playback buffer up without waiting, for the capture thread while the tone thread is parked
+static int keep_tone_queued(SonarpenPipeline *pipeline) {
+    AudioStreamInfo info;
+    snd_pcm_sframes_t avail;
+
+    get_playback_info(&info);
+    while ((avail = snd_pcm_avail(get_playback_handle())) < 0 || avail >= (snd_pcm_sframes_t)info.period_frames) {
+        if (play_tone(pipeline->tone_frequency) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Start both streams with the tone fading in.
+ *
+ * The streams start over from empty buffers, so the offset is measured
+ * again and the levels of the previous run are forgotten.
+ */
+static int tone_duty_start(SonarpenPipeline *pipeline) {
+    set_tone_amplitude(1.0f, TONE_RAMP_MS);
+    if (audio_duplex_start(pipeline->duplex, pipeline->tone_frequency) < 0) {
+        return -1;
+    }
+
+    pipeline->aligned = 0;
+    pipeline->quiet_align = 1;
+    pipeline->last_block_ns = 0;
+    if (pipeline->capture->detector) {
+        tone_detector_reset(pipeline->capture->detector);
+    }
+    pressure_filter_reset(&pipeline->pressure_filter);
+    return 0;
+}
+
+// Ramp the tone out from the next frame written, so stopping the streams does not click
+static void tone_duty_fade(SonarpenPipeline *pipeline) {
+    AudioStreamInfo info;
+
+    get_playback_info(&info);
+    set_tone_amplitude(0.0f, TONE_RAMP_MS);
+    pipeline->fade_end_frame = get_playback_frames_written() + (uint64_t)info.rate * TONE_RAMP_MS / 1000;
+    pipeline->tone_duty = TONE_FADING;
+}
+
+// Stop both streams and prepare them for the next start; dropping a linked stream stops its partner too
+static int tone_duty_stop(SonarpenPipeline *pipeline) {
+    snd_pcm_t *playback = pipeline->duplex->playback;
+    snd_pcm_t *capture = pipeline->capture->handle;
+    int err;
+
+    snd_pcm_drop(playback);
+    snd_pcm_drop(capture);
+    if ((err = snd_pcm_prepare(playback)) < 0 || (err = snd_pcm_prepare(capture)) < 0) {
+        fprintf(stderr, "Error preparing the streams for the next burst: %s\n", snd_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Move the tone between continuous play and the idle bursts.
+ *
+ * Called by whoever owns the streams, between capture blocks and while they
+ * are parked. A burst fades out and stops; while parked the streams restart
+ * IDLE_BURST_PERIOD_MS after the previous burst started, or as soon as
+ * idle drops.
+ *
+ * @param pipeline Pipeline with a duplex engine.
+ * @param now Current CLOCK_MONOTONIC time.
+ * @return int 0 on success, -1 if the streams could not be stopped or started.
+ */
+static int tone_duty_update(SonarpenPipeline *pipeline, uint64_t now) {
+    int idle = atomic_load(&pipeline->idle);
+
+    switch (pipeline->tone_duty) {
+    case TONE_CONTINUOUS:
+        if (idle) {
+            pipeline->burst_start_ns = now;
+            tone_duty_fade(pipeline);
+            metrics_set(METRIC_TONE_IDLE, 1);
+        }
+        break;
+
+    case TONE_BURST:
+        if (!idle) {
+            pipeline->tone_duty = TONE_CONTINUOUS;
+            metrics_set(METRIC_TONE_IDLE, 0);
+        } else if (now >= pipeline->duty_deadline_ns) {
+            tone_duty_fade(pipeline);
+        }
+        break;
+
+    case TONE_FADING:
+        if (!idle) {
+            set_tone_amplitude(1.0f, TONE_RAMP_MS);
+            pipeline->tone_duty = TONE_CONTINUOUS;
+            metrics_set(METRIC_TONE_IDLE, 0);
+        } else if (playback_position() >= pipeline->fade_end_frame) {
+            if (tone_duty_stop(pipeline) < 0) {
+                return -1;
+            }
+            pipeline->tone_duty = TONE_PARKED;
+            pipeline->duty_deadline_ns = pipeline->burst_start_ns + IDLE_BURST_PERIOD_MS * 1000000ull;
+        }
+        break;
+
+    case TONE_PARKED:
+        if (idle && now < pipeline->duty_deadline_ns) {
+            break;
+        }
+        if (tone_duty_start(pipeline) < 0) {
+            return -1;
+        }
+        if (idle) {
+            pipeline->tone_duty = TONE_BURST;
+            pipeline->burst_start_ns = now;
+            pipeline->duty_deadline_ns = now + IDLE_BURST_MS * 1000000ull;
+            metrics_count(METRIC_IDLE_BURSTS, 1);
+        } else {
+            pipeline->tone_duty = TONE_CONTINUOUS;
+            metrics_set(METRIC_TONE_IDLE, 0);
+        }
+        break;
+    }
+    return 0;
+}
+
+// Capture thread: take the playback over once the tone thread finished its current write
+static void tone_gate_close(SonarpenPipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->idle_lock);
+    atomic_store(&pipeline->tone_gate_closed, 1);
+    while (!pipeline->tone_parked && atomic_load(&pipeline->running)) {
+        idle_wait(pipeline, monotonic_time_ns() + IDLE_BURST_PERIOD_MS * 1000000ull);
+    }
+    pthread_mutex_unlock(&pipeline->idle_lock);
+}
+
+// Capture thread: hand the running playback back to the tone thread
+static void tone_gate_open(SonarpenPipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->idle_lock);
+    atomic_store(&pipeline->tone_gate_closed, 0);
+    pthread_cond_broadcast(&pipeline->idle_cond);
+    pthread_mutex_unlock(&pipeline->idle_lock);
+}
+
+/**
+ * @brief Capture thread side of the idle duty cycle, run before every block.
+ *
+ * The tone thread stays parked for as long as the tone is not continuous,
+ * and the capture thread tops the playback buffer up itself, so a single
+ * thread decides when the streams stop and start.
+ *
+ * @return int 0 to capture a block, 1 if the streams are stopped, -1 on failure.
+ */
+static int capture_duty_cycle(SonarpenPipeline *pipeline) {
+    if (pipeline->tone_duty == TONE_CONTINUOUS) {
+        if (!atomic_load(&pipeline->idle)) {
+            return 0;
+        }
+        tone_gate_close(pipeline);
+    }
+
+    if (tone_duty_update(pipeline, monotonic_time_ns()) < 0) {
+        return -1;
+    }
+
+    switch (pipeline->tone_duty) {
+    case TONE_CONTINUOUS:
+        tone_gate_open(pipeline);
+        return 0;
+    case TONE_PARKED:
+        // Sleep until the next burst is due or a touch ends idle
+        pthread_mutex_lock(&pipeline->idle_lock);
+        while (atomic_load(&pipeline->idle) && atomic_load(&pipeline->running) &&
+               monotonic_time_ns() < pipeline->duty_deadline_ns) {
+            idle_wait(pipeline, pipeline->duty_deadline_ns);
+        }
+        pthread_mutex_unlock(&pipeline->idle_lock);
+        return 1;
+    default:
+        return keep_tone_queued(pipeline);
+    }
+}
+
+/**
+ * @brief Capture thread: measures the mic level block by block and queues it.
+ *
+ * If the output thread falls behind and the queue is full, the oldest sample
+ * is dropped; the output thread only ever needs the newest values. With
+ * idle_duty set it also runs the idle bursts.
+ */
+static void *capture_thread_main(void *arg) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)arg;
+    PressureSample sample;
+    int woke_last = 0;
+
+    if (pipeline->realtime) {
+        realtime_enter_thread("sp-capture", pipeline->realtime->priority, pipeline->realtime->capture_cpu);
+    }
+
+    alloc_guard_enter();
+    while (atomic_load(&pipeline->running)) {
+        int rc = pipeline->idle_duty ? capture_duty_cycle(pipeline) : 0;
+        if (rc == 0) {
+            rc = capture_block(pipeline, &sample);
+        }
+        if (rc < 0) {
+            pipeline_stop(pipeline);
+            break;
+        }
+        // Levels of a fading tone say nothing about the pen
+        if (rc > 0 || pipeline->tone_duty == TONE_FADING) {
+            continue;
+        }
+        if (spsc_queue_push_overwrite(&pipeline->pressure_queue, &sample) > 0) {
+            metrics_count(METRIC_PRESSURE_DROPS, 1);
+        }
+
+        // Wake the output loop while the pen may be down, so pressure flows without touch motion
+        int above = above_release(pipeline, &sample);
+        if (above || woke_last) {
+            event_loop_wake(&pipeline->loop);
+        }
+        woke_last = above;
+    }
+    alloc_guard_leave();
+
+    return NULL;
+}
+
+/**
+ * @brief Tone thread: keeps the probe tone flowing to the playback device.
+ *
+ * While the capture thread runs the idle bursts, it waits at the gate.
+ */
+static void *tone_thread_main(void *arg) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)arg;
+
+    if (pipeline->realtime) {
+        realtime_enter_thread("sp-tone", pipeline->realtime->priority, pipeline->realtime->tone_cpu);
+    }
+
+    alloc_guard_enter();
+    while (atomic_load(&pipeline->running)) {
+        if (atomic_load(&pipeline->tone_gate_closed)) {
+            pthread_mutex_lock(&pipeline->idle_lock);
+            pipeline->tone_parked = 1;
+            pthread_cond_broadcast(&pipeline->idle_cond);
+            while (atomic_load(&pipeline->tone_gate_closed) && atomic_load(&pipeline->running)) {
+                idle_wait(pipeline, monotonic_time_ns() + IDLE_BURST_PERIOD_MS * 1000000ull);
+            }
+            pipeline->tone_parked = 0;
+            pthread_mutex_unlock(&pipeline->idle_lock);
+            continue;
+        }
+        if (play_tone(pipeline->tone_frequency) < 0) {
+            pipeline_stop(pipeline);
+            break;
+        }
+    }
+    alloc_guard_leave();
+
+    return NULL;
+}
+
+/**
+ * @brief Take a new pressure sample and watch for the pen touching down.
+ *
+ * The onset time lets the multi-touch tracker tell the pen from a palm.
+ */
+static void update_pressure(SonarpenPipeline *pipeline, const PressureSample *sample) {
+    const PressureCurve *curve = pipeline->pressure_curve;
+    int onset, released;
+    pipeline->last_pressure = *sample;
+
+    if (pipeline->fixed_point) {
+        onset = sample->level_q > curve->onset_q;
+        released = sample->level_q < curve->release_q;
+    } else {
+        onset = sample->level > curve->onset_level;
+        released = sample->level < curve->release_level;
+    }
+
+    if (!pipeline->pen_sounding && onset) {
+        pipeline->pen_sounding = 1;
+        mt_tracker_note_onset(&pipeline->mt, sample->timestamp_ns);
+        if (pipeline->idle_duty) {
+            idle_leave(pipeline);
+        }
+    } else if (pipeline->pen_sounding && released) {
+        pipeline->pen_sounding = 0;
+    }
+}
+
+/**
+ * @brief Drain the pressure queue, keeping only the newest sample.
+ */
+static void refresh_pressure(SonarpenPipeline *pipeline) {
+    PressureSample sample;
+    int64_t depth = 0;
+
+    while (spsc_queue_pop(&pipeline->pressure_queue, &sample) == 0) {
+        update_pressure(pipeline, &sample);
+        depth++;
+    }
+    metrics_set(METRIC_QUEUE_DEPTH, depth);
+    metrics_set_max(METRIC_QUEUE_DEPTH_MAX, depth);
+}
+
+// Pen state a source frame and the current pressure call for: contact needs both the touch and the tone
+static PenState next_pen_state(const SonarpenPipeline *pipeline, const TouchFrame *touch) {
+    if (pipeline->touch_dev == NULL || !touch->contact) {
+        return PEN_OUT;
+    }
+    return pipeline->pen_sounding ? PEN_CONTACT : PEN_HOVER;
+}
+
+/**
+ * @brief Write one report that moves the pen to the given state.
+ *
+ * Only what changed is sent: the mapped position, the pressure and the tool
+ * and touch keys. Positions are dropped while the pen is out of range. The
+ * reported state only advances once the report is written; after a failed
+ * write the pen keeps its old state and the next report sends everything.
+ *
+ * @return int 1 if a report was written, 0 if nothing changed.
+ */
+static int emit_pen_frame(SonarpenPipeline *pipeline, const TouchFrame *touch, const struct timeval *time,
+                           PenState state) {
+    UinputFrame frame;
+    uinput_frame_begin(&frame, pipeline->uinput_fd, time);
+
+    // Out of range the position stays -1, so the full position is sent again when the pen comes back
+    int x = -1, y = -1;
+    if (state != PEN_OUT) {
+        coord_transform_apply(&pipeline->transform, touch->x, touch->y, &x, &y);
+        if (x != pipeline->reported_x) {
+            uinput_frame_add(&frame, EV_ABS, ABS_X, x);
+        }
+        if (y != pipeline->reported_y) {
+            uinput_frame_add(&frame, EV_ABS, ABS_Y, y);
+        }
+    }
+
+    int pressure = 0;
+    if (state == PEN_CONTACT) {
+        pressure = pipeline->fixed_point
+                       ? pressure_curve_map_fixed(pipeline->pressure_curve, pipeline->last_pressure.level_q)
+                       : pressure_curve_map(pipeline->pressure_curve, pipeline->last_pressure.level);
+    }
+    if (pressure != pipeline->reported_pressure) {
+        uinput_frame_add(&frame, EV_ABS, ABS_PRESSURE, pressure);
+    }
+
+    if (pipeline->keys_unknown || (state != PEN_OUT) != (pipeline->pen_state != PEN_OUT)) {
+        uinput_frame_add(&frame, EV_KEY, BTN_TOOL_PEN, state != PEN_OUT);
+    }
+    if (pipeline->keys_unknown || (state == PEN_CONTACT) != (pipeline->pen_state == PEN_CONTACT)) {
+        uinput_frame_add(&frame, EV_KEY, BTN_TOUCH, state == PEN_CONTACT);
+    }
+
+    int written = 0;
+    if (frame.count > 0) {
+        if (uinput_frame_commit(&frame) < 0) {
+            // Part of the report may have arrived: send every axis and key again with the next one
+            pipeline->reported_x = -1;
+            pipeline->reported_y = -1;
+            pipeline->reported_pressure = -1;
+            pipeline->keys_unknown = 1;
+            return 0;
+        }
+        written = 1;
+    }
+
+    pipeline->reported_x = x;
+    pipeline->reported_y = y;
+    pipeline->reported_pressure = pressure;
+    pipeline->pen_state = state;
+    pipeline->keys_unknown = 0;
+    return written;
+}
+
+/**
+ * @brief Move the pen to a new state with the report order tablets use.
+ *
+ * The pen enters range with its full position before it touches down, and
+ * lifts before it leaves range, each step in its own report.
+ *
+ * @return int 1 if any report was written.
+ */
+static int set_pen_state(SonarpenPipeline *pipeline, const TouchFrame *touch, const struct timeval *time,
+                         PenState target) {
+    int written = 0;
+    if ((pipeline->pen_state == PEN_OUT && target == PEN_CONTACT) ||
+        (pipeline->pen_state == PEN_CONTACT && target == PEN_OUT)) {
+        written = emit_pen_frame(pipeline, touch, time, PEN_HOVER);
+    }
+    return emit_pen_frame(pipeline, touch, time, target) | written;
+}
+
+/**
+ * @brief Forward one source frame to the virtual tablet with the current pressure.
+ *
+ * Reports are stamped with the source frame time.
+ *
+ * @return int 1 if a report was written.
+ */
+static int forward_touch_frame(SonarpenPipeline *pipeline, const TouchFrame *touch) {
+    return set_pen_state(pipeline, touch, &touch->time, next_pen_state(pipeline, touch));
+}
+
+/**
+ * @brief Forward pressure changes that arrive while the touch position stands still.
+ *
+ * @param time Report timestamp, or NULL for the current time.
+ * @return int 1 if a report was written.
+ */
+static int forward_pressure(SonarpenPipeline *pipeline, const struct timeval *time) {
+    const TouchFrame *touch = &pipeline->touch_frame;
+    PenState target = next_pen_state(pipeline, touch);
+
+    if (target != pipeline->pen_state || target == PEN_CONTACT) {
+        return set_pen_state(pipeline, touch, time, target);
+    }
+    return 0;
+}
+
+/**
+ * @brief Forward the newest pressure and record how long its sample took to reach the tablet.
+ */
+static void forward_live_pressure(SonarpenPipeline *pipeline) {
+    uint64_t captured = pipeline->last_pressure.timestamp_ns;
+
+    if (forward_pressure(pipeline, NULL) && captured != pipeline->forwarded_pressure_ns) {
+        metrics_record(METRIC_PRESSURE_LATENCY, monotonic_time_ns() - captured);
+        pipeline->forwarded_pressure_ns = captured;
+    }
+}
+
+/**
+ * @brief Read every pending source frame and forward it.
+ *
+ * @return int 0 once the device has no more events, -1 on a read error.
+ */
+static int drain_touch_events(SonarpenPipeline *pipeline) {
+    TouchFrame *touch = &pipeline->touch_frame;
+    int rc;
+
+    while ((rc = read_touch_frame(pipeline->touch_dev, touch, &pipeline->mt)) > 0) {
+        refresh_pressure(pipeline);
+        metrics_count(METRIC_TOUCH_FRAMES, 1);
+        if (pipeline->idle_duty) {
+            idle_leave(pipeline);
+        }
+        if (touch->resynced) {
+            metrics_count(METRIC_TOUCH_RESYNCS, 1);
+        }
+
+        // Source frames carry CLOCK_MONOTONIC kernel timestamps
+        if (forward_touch_frame(pipeline, touch)) {
+            uint64_t stamped = (uint64_t)touch->time.tv_sec * 1000000000ull + (uint64_t)touch->time.tv_usec * 1000ull;
+            uint64_t now = monotonic_time_ns();
+            if (now > stamped) {
+                metrics_record(METRIC_TOUCH_LATENCY, now - stamped);
+            }
+        }
+        touch->changed = 0;
+        touch->resynced = 0;
+    }
+
+    if (rc == -ENODEV) {
+        // Unplugged; the hotplug monitor binds it again when it returns
+        printf("Touch device %s is gone\n", pipeline->touch_path);
+        pipeline_unbind_touch_device(pipeline);
+        return 0;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Error reading touch device: %s\n", strerror(-rc));
+        return -1;
+    }
+    return 0;
+}
+
+// Event loop handler: the touch device has events
+static void on_touch_ready(void *userdata, uint32_t events) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)userdata;
+    (void)events;
+
+    alloc_guard_enter();
+    refresh_pressure(pipeline);
+    int rc = drain_touch_events(pipeline);
+    alloc_guard_leave();
+    if (rc < 0) {
+        pipeline->io_error = 1;
+        pipeline_stop(pipeline);
+    }
+}
+
+// Event loop handler: udev reported input devices being added or removed
+static void on_hotplug_ready(void *userdata, uint32_t events) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)userdata;
+    char path[sizeof(pipeline->touch_path)];
+    int action;
+    (void)events;
+
+    while ((action = input_hotplug_receive(pipeline->hotplug, path, sizeof(path))) != 0) {
+        if (action == HOTPLUG_REMOVED && pipeline->touch_dev && strcmp(path, pipeline->touch_path) == 0) {
+            printf("Touch device %s removed\n", path);
+            pipeline_unbind_touch_device(pipeline);
+        } else if (action == HOTPLUG_ADDED && pipeline->touch_dev == NULL) {
+            pipeline_bind_touch_device(pipeline, path);
+        }
+    }
+}
+
+// Event loop handler (single-thread mode): a capture block is ready
+static void on_capture_ready(void *userdata, uint32_t events) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)userdata;
+    PressureSample sample;
+    (void)events;
+
+    alloc_guard_enter();
+    int rc = capture_block(pipeline, &sample);
+    if (rc == 0 && pipeline->tone_duty != TONE_FADING) {
+        update_pressure(pipeline, &sample);
+        forward_live_pressure(pipeline);
+    }
+    alloc_guard_leave();
+    if (rc < 0) {
+        pipeline->io_error = 1;
+        pipeline_stop(pipeline);
+    }
+}
+
+// Event loop handler (single-thread mode): the playback buffer has room
+static void on_playback_ready(void *userdata, uint32_t events) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)userdata;
+    (void)events;
+
+    alloc_guard_enter();
+    int rc = play_tone(pipeline->tone_frequency);
+    alloc_guard_leave();
+    if (rc < 0) {
+        pipeline->io_error = 1;
+        pipeline_stop(pipeline);
+    }
+}
+
+// Watch both PCMs from the event loop
+static int add_pcm_sources(SonarpenPipeline *pipeline) {
+    if (event_loop_add_pcm(&pipeline->loop, pipeline->capture->handle, on_capture_ready, pipeline) < 0 ||
+        event_loop_add_pcm(&pipeline->loop, get_playback_handle(), on_playback_ready, pipeline) < 0) {
+        event_loop_remove_pcm(&pipeline->loop, pipeline->capture->handle);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Event loop side of the idle duty cycle, run after every wakeup.
+ *
+ * The PCMs leave the epoll set while they are stopped, since a prepared
+ * playback stream would keep the loop spinning.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int loop_duty_cycle(SonarpenPipeline *pipeline) {
+    ToneDuty before = pipeline->tone_duty;
+
+    if (tone_duty_update(pipeline, monotonic_time_ns()) < 0) {
+        return -1;
+    }
+    if (before != TONE_PARKED && pipeline->tone_duty == TONE_PARKED) {
+        event_loop_remove_pcm(&pipeline->loop, pipeline->capture->handle);
+        event_loop_remove_pcm(&pipeline->loop, get_playback_handle());
+    } else if (before == TONE_PARKED && pipeline->tone_duty != TONE_PARKED) {
+        return add_pcm_sources(pipeline);
+    }
+    return 0;
+}
+
+// Event loop timeout until the duty cycle or idle needs the thread again, -1 for none
+static int loop_timeout_ms(SonarpenPipeline *pipeline) {
+    int timeout = idle_check(pipeline);
+
+    if (pipeline->idle_duty && (pipeline->tone_duty == TONE_BURST || pipeline->tone_duty == TONE_PARKED)) {
+        uint64_t now = monotonic_time_ns();
+        int due = now >= pipeline->duty_deadline_ns ? 0
+                                                     : (int)((pipeline->duty_deadline_ns - now + 999999) / 1000000);
+        if (timeout < 0 || due < timeout) {
+            timeout = due;
+        }
+    }
+    return timeout;
+}
+
+/**
+ * @brief Run every stage from one thread, driven by the event loop.
+ *
+ * The touch device and the poll descriptors of both PCMs share one epoll
+ * set, so the thread sleeps until one of them has work. The idle bursts
+ * are timed with the loop timeout.
+ */
+static int pipeline_run_single_thread(SonarpenPipeline *pipeline) {
+    if (add_pcm_sources(pipeline) < 0) {
+        return -1;
+    }
+
+    while (atomic_load(&pipeline->running)) {
+        if (event_loop_run_once(&pipeline->loop, loop_timeout_ms(pipeline)) < 0) {
+            return -1;
+        }
+        if (pipeline->idle_duty && loop_duty_cycle(pipeline) < 0) {
+            return -1;
+        }
+    }
+
+    return pipeline->io_error ? -1 : 0;
+}
+
+/**
+ * @brief Forward touch input and pressure until the pipeline stops.
+ *
+ * Sleeps until touch input arrives, the capture thread has pressure news or
+ * someone calls pipeline_stop().
+ */
+static int pipeline_run_io(SonarpenPipeline *pipeline) {
+    while (atomic_load(&pipeline->running)) {
+        if (event_loop_run_once(&pipeline->loop, idle_check(pipeline)) < 0) {
+            return -1;
+        }
+        alloc_guard_enter();
+        refresh_pressure(pipeline);
+        forward_live_pressure(pipeline);
+        alloc_guard_leave();
+    }
+
+    return pipeline->io_error ? -1 : 0;
+}
+
+// Real-time loop thread: returns the loop result as its exit value
+static void *loop_thread_main(void *arg) {
+    SonarpenPipeline *pipeline = (SonarpenPipeline *)arg;
+    int result;
+
+    if (pipeline->single_thread) {
+        // This thread services the audio, so it gets the audio priority
+        realtime_enter_thread("sp-loop", pipeline->realtime->priority, pipeline->realtime->io_cpu);
+        result = pipeline_run_single_thread(pipeline);
+    } else {
+        // Touch forwarding runs just below the audio threads, which must never miss a period
+        realtime_enter_thread("sp-io", pipeline->realtime->priority - 1, pipeline->realtime->io_cpu);
+        result = pipeline_run_io(pipeline);
+    }
+
+    return (void *)(intptr_t)result;
+}
+
+/**
+ * @brief Run the event loop until the pipeline stops.
+ *
+ * Without real-time scheduling the loop runs on the caller. With it, the
+ * loop gets a thread of its own, so the caller keeps its name, policy and
+ * CPUs for whatever it does after pipeline_run() returns.
+ *
+ * @return int 0 on a clean stop, -1 on failure.
+ */
+static int run_loop(SonarpenPipeline *pipeline) {
+    if (pipeline->realtime == NULL) {
+        return pipeline->single_thread ? pipeline_run_single_thread(pipeline) : pipeline_run_io(pipeline);
+    }
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    void *result;
+    int err;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REALTIME_THREAD_STACK);
+    err = pthread_create(&thread, &attr, loop_thread_main, pipeline);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start event loop thread: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_join(thread, &result);
+
+    return (int)(intptr_t)result;
+}
+
+/**
+ * @brief Prepare the pipeline. No threads are started yet.
+ *
+ * The touch device is attached separately with pipeline_bind_touch_device().
+ *
+ * @param pipeline Pipeline to initialize.
+ * @param capture Initialized audio capture stream.
+ * @param uinput_fd Virtual tablet file descriptor.
+ * @param tone_frequency Probe tone frequency in Hz.
+ * @param arena Preallocated memory for the pressure queue, or NULL to allocate it.
+ * @return int 0 on success, -1 on failure.
+ */
+int pipeline_init(SonarpenPipeline *pipeline, AudioCapture *capture, int uinput_fd, float tone_frequency,
+                  Arena *arena) {
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->capture = capture;
+    pipeline->uinput_fd = uinput_fd;
+    pipeline->tone_frequency = tone_frequency;
+    pipeline->reported_x = -1;
+    pipeline->reported_y = -1;
+    atomic_init(&pipeline->running, 0);
+    atomic_init(&pipeline->idle, 0);
+    atomic_init(&pipeline->tone_gate_closed, 0);
+
+    // Idle waits have deadlines on the same clock as everything else here
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pipeline->idle_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&pipeline->idle_lock, NULL);
+
+    if (spsc_queue_init(&pipeline->pressure_queue, PRESSURE_QUEUE_LEN, sizeof(PressureSample), arena) < 0) {
+        pthread_cond_destroy(&pipeline->idle_cond);
+        pthread_mutex_destroy(&pipeline->idle_lock);
+        return -1;
+    }
+
+    if (event_loop_init(&pipeline->loop) < 0) {
+        spsc_queue_cleanup(&pipeline->pressure_queue);
+        pthread_cond_destroy(&pipeline->idle_cond);
+        pthread_mutex_destroy(&pipeline->idle_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Take over a touch device: map its ranges and start tracking its contacts.
+ *
+ * @return int 0 on success, -1 if the device has no usable position range.
+ */
+static int attach_touch_device(SonarpenPipeline *pipeline, struct libevdev *dev, const char *path) {
+    CoordMapping whole_surface;
+    const CoordMapping *mapping = pipeline->coord_mapping;
+
+    if (mapping == NULL) {
+        coord_mapping_default(&whole_surface);
+        mapping = &whole_surface;
+    }
+    if (coord_transform_from_device(&pipeline->transform, dev, mapping) < 0) {
+        fprintf(stderr, "Touch device %s has no usable position range\n", path);
+        return -1;
+    }
+
+    pipeline->touch_dev = dev;
+    snprintf(pipeline->touch_path, sizeof(pipeline->touch_path), "%s", path);
+
+    memset(&pipeline->touch_frame, 0, sizeof(pipeline->touch_frame));
+    pipeline->touch_frame.x = libevdev_get_event_value(dev, EV_ABS, ABS_X);
+    pipeline->touch_frame.y = libevdev_get_event_value(dev, EV_ABS, ABS_Y);
+    mt_tracker_init(&pipeline->mt, dev);
+    return 0;
+}
+
+/**
+ * @brief Open a touch device and start forwarding it.
+ *
+ * Audio keeps running; only the touch side is (re)attached. The pipeline
+ * owns the device until pipeline_unbind_touch_device(). Positions are
+ * mapped from the ranges of this device onto the tablet with
+ * pipeline->coord_mapping.
+ *
+ * @param pipeline Initialized pipeline without a bound device.
+ * @param path Event device node.
+ * @return int 0 on success, -1 on failure.
+ */
+int pipeline_bind_touch_device(SonarpenPipeline *pipeline, const char *path) {
+    struct libevdev *dev = NULL;
+
+    if (init_touchpad_device(&dev, path) != 0) {
+        return -1;
+    }
+
+    if (attach_touch_device(pipeline, dev, path) < 0 ||
+        event_loop_add_fd(&pipeline->loop, libevdev_get_fd(dev), EPOLLIN, on_touch_ready, pipeline) < 0) {
+        int fd = libevdev_get_fd(dev);
+        pipeline->touch_dev = NULL;
+        libevdev_free(dev);
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Attach a touch device whose events the caller feeds in, e.g. from a recording.
+ *
+ * The device is not polled; events go through pipeline_replay_touch_event().
+ * The pipeline owns the device from now on, as with pipeline_bind_touch_device().
+ *
+ * @param pipeline Initialized pipeline without a bound device.
+ * @param dev Device description, typically built with libevdev_new().
+ * @param name Name used in messages.
+ * @return int 0 on success, -1 if the device has no usable position range.
+ */
+int pipeline_attach_touch_device(SonarpenPipeline *pipeline, struct libevdev *dev, const char *name) {
+    return attach_touch_device(pipeline, dev, name);
+}
+
+// Timestamp of a replayed report
+static struct timeval replay_time(uint64_t time_ns) {
+    struct timeval tv;
+    tv.tv_sec = (time_t)(time_ns / 1000000000ull);
+    tv.tv_usec = (suseconds_t)(time_ns % 1000000000ull / 1000);
+    return tv;
+}
+
+/**
+ * @brief Feed one detector level as the capture side would, then forward it.
+ *
+ * Replay runs every stage on the calling thread, so the queue is bypassed
+ * and the report carries the given time instead of the wall clock.
+ *
+ * @param pipeline Pipeline with a pressure curve.
+ * @param volume Detector level of one block.
+ * @param dt Length of the block in seconds.
+ * @param time_ns Time the block ended, on the same clock as the touch events.
+ */
+void pipeline_replay_level(SonarpenPipeline *pipeline, float volume, float dt, uint64_t time_ns) {
+    PressureSample sample;
+    struct timeval time = replay_time(time_ns);
+
+    // A fixed-point level converts back exactly, since it is a multiple of 2^-LEVEL_FRAC_BITS
+    if (pipeline->fixed_point) {
+        sample.level_q = pressure_filter_process_fixed(&pipeline->pressure_filter,
+                                                       (int32_t)lrintf(volume * (1 << LEVEL_FRAC_BITS)));
+    } else {
+        sample.level = pressure_filter_process(&pipeline->pressure_filter, volume, dt);
+    }
+    sample.timestamp_ns = time_ns;
+    update_pressure(pipeline, &sample);
+    forward_pressure(pipeline, &time);
+}
+
+/**
+ * @brief Feed one event of the attached touch device.
+ *
+ * @param pipeline Pipeline with a device from pipeline_attach_touch_device().
+ * @param ev Recorded event; a SYN_REPORT forwards the assembled frame.
+ */
+void pipeline_replay_touch_event(SonarpenPipeline *pipeline, const struct input_event *ev) {
+    TouchFrame *touch = &pipeline->touch_frame;
+
+    if (touch_frame_add_event(touch, &pipeline->mt, ev)) {
+        forward_touch_frame(pipeline, touch);
+        touch->changed = 0;
+        touch->resynced = 0;
+    }
+}
+
+/**
+ * @brief Take the pen out of range at the end of a replay.
+ *
+ * @param pipeline Pipeline being replayed into.
+ * @param time_ns Time of the final report.
+ */
+void pipeline_replay_finish(SonarpenPipeline *pipeline, uint64_t time_ns) {
+    struct timeval time = replay_time(time_ns);
+    set_pen_state(pipeline, &pipeline->touch_frame, &time, PEN_OUT);
+}
+
+/**
+ * @brief Stop forwarding and close the touch device.
+ *
+ * @param pipeline Pipeline; nothing happens if no device is bound.
+ */
+void pipeline_unbind_touch_device(SonarpenPipeline *pipeline) {
+    if (pipeline->touch_dev == NULL) {
+        return;
+    }
+
+    // Take the pen out of range before its source goes away
+    set_pen_state(pipeline, &pipeline->touch_frame, NULL, PEN_OUT);
+
+    // Attached devices have no descriptor
+    int fd = libevdev_get_fd(pipeline->touch_dev);
+    if (fd >= 0) {
+        event_loop_remove_fd(&pipeline->loop, fd);
+    }
+    libevdev_free(pipeline->touch_dev);
+    if (fd >= 0) {
+        close(fd);
+    }
+    pipeline->touch_dev = NULL;
+    pipeline->touch_path[0] = '\0';
+}
+
+/**
+ * @brief Start the capture and tone threads and run the input/output loop.
+ *
+ * Returns once pipeline_stop() is called or any stage fails. Both worker
+ * threads are joined before returning. With pipeline->single_thread set, no
+ * worker threads are created and one event loop services all stages.
+ * The event loop runs on the caller, or with pipeline->realtime set on a
+ * SCHED_FIFO thread of its own, so the caller's scheduling never changes.
+ * The audio loops and the forwarding handlers run as alloc_guard sections,
+ * so alloc_guard_enable() turns any allocation on them into an abort.
+ * With pipeline->idle_duty set and a duplex engine, the tone drops to
+ * short bursts while nothing touches the screen.
+ *
+ * @param pipeline Initialized pipeline.
+ * @return int 0 on a clean stop, -1 on failure.
+ */
+int pipeline_run(SonarpenPipeline *pipeline) {
+    int result = 0;
+    int err;
+
+    if (pipeline->duplex && audio_duplex_start(pipeline->duplex, pipeline->tone_frequency) < 0) {
+        return -1;
+    }
+
+    // Bursts restart both streams together, which needs the duplex engine
+    if (pipeline->duplex == NULL) {
+        pipeline->idle_duty = 0;
+    }
+    pipeline->tone_duty = TONE_CONTINUOUS;
+    pipeline->last_activity_ns = monotonic_time_ns();
+    atomic_store(&pipeline->idle, 0);
+    metrics_set(METRIC_TONE_IDLE, 0);
+
+    if (pipeline->hotplug &&
+        event_loop_add_fd(&pipeline->loop, pipeline->hotplug->fd, EPOLLIN, on_hotplug_ready, pipeline) < 0) {
+        return -1;
+    }
+
+    atomic_store(&pipeline->running, 1);
+
+    if (pipeline->single_thread) {
+        result = run_loop(pipeline);
+        pipeline_stop(pipeline);
+        return result;
+    }
+
+    // Real-time threads get small stacks, so locking and pre-faulting them stays cheap
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pipeline->realtime) {
+        pthread_attr_setstacksize(&attr, REALTIME_THREAD_STACK);
+    }
+
+    if ((err = pthread_create(&pipeline->capture_thread, &attr, capture_thread_main, pipeline)) != 0) {
+        fprintf(stderr, "Failed to start capture thread: %s\n", strerror(err));
+        pthread_attr_destroy(&attr);
+        atomic_store(&pipeline->running, 0);
+        return -1;
+    }
+
+    if ((err = pthread_create(&pipeline->tone_thread, &attr, tone_thread_main, pipeline)) != 0) {
+        fprintf(stderr, "Failed to start tone thread: %s\n", strerror(err));
+        pthread_attr_destroy(&attr);
+        pipeline_stop(pipeline);
+        pthread_join(pipeline->capture_thread, NULL);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    result = run_loop(pipeline);
+
+    pipeline_stop(pipeline);
+    pthread_join(pipeline->capture_thread, NULL);
+    pthread_join(pipeline->tone_thread, NULL);
+
+    return result;
+}
+
+/**
+ * @brief Ask every pipeline thread to stop. Async-signal-safe.
+ *
+ * @param pipeline Running pipeline.
+ */
+void pipeline_stop(SonarpenPipeline *pipeline) {
+    atomic_store(&pipeline->running, 0);
+    event_loop_wake(&pipeline->loop);
+}
+
+/**
+ * @brief Free pipeline resources and close the touch device.
+ *
+ * The capture stream and the uinput device passed to pipeline_init() stay open.
+ *
+ * @param pipeline Stopped pipeline.
+ */
+void pipeline_cleanup(SonarpenPipeline *pipeline) {
+    pipeline_unbind_touch_device(pipeline);
+    event_loop_cleanup(&pipeline->loop);
+    spsc_queue_cleanup(&pipeline->pressure_queue);
+    pthread_cond_destroy(&pipeline->idle_cond);
+    pthread_mutex_destroy(&pipeline->idle_lock);
+}
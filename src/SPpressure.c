@@ -0,0 +1,366 @@
+#include "sonarpen.h"
+
+/* This page contains the pressure calibration, the carrier sweep and the lookup table that maps mic levels to pen pressure */
+
+#define PRESSURE_LUT_SIZE (1 << PRESSURE_LUT_BITS)
+
+/**
+ * @brief Fill the calibration used before the pen was ever calibrated.
+ *
+ * The curve is linear over the whole mic range, like the old mapping, and
+ * the touch-down thresholds stay at PEN_ONSET_LEVEL/PEN_RELEASE_LEVEL.
+ *
+ * @param cal Calibration to fill.
+ */
+void pressure_calibration_default(PressureCalibration *cal) {
+    cal->noise_floor = 0.0f;
+    cal->hover = 0.0f;
+    cal->light = MAX_RMS_VALUE * PRESSURE_LIGHT_TARGET;
+    cal->full = MAX_RMS_VALUE;
+}
+
+/**
+ * @brief Fit the transfer curve to a calibration and tabulate it.
+ *
+ * Output is 0 up to the hover level and PRESSURE_MAX from the full-press
+ * level on. In between it follows a gamma curve chosen so that the light
+ * touch lands at PRESSURE_LIGHT_TARGET of the range.
+ *
+ * @param curve Curve to build.
+ * @param cal Measured levels; must increase from hover to full.
+ * @return int 0 on success, -1 if the levels are unusable.
+ */
+int pressure_curve_build(PressureCurve *curve, const PressureCalibration *cal) {
+    float zero = cal->hover > cal->noise_floor ? cal->hover : cal->noise_floor;
+    if (!(cal->light > zero && cal->full > cal->light)) {
+        fprintf(stderr, "Pressure calibration levels do not increase, ignoring them\n");
+        return -1;
+    }
+
+    float light = (cal->light - zero) / (cal->full - zero);
+    float gamma = logf(PRESSURE_LIGHT_TARGET) / logf(light);
+    if (gamma < PRESSURE_GAMMA_MIN) gamma = PRESSURE_GAMMA_MIN;
+    if (gamma > PRESSURE_GAMMA_MAX) gamma = PRESSURE_GAMMA_MAX;
+
+    curve->zero_level = zero;
+    curve->scale = PRESSURE_LUT_SIZE / (cal->full - zero);
+    curve->gamma = gamma;
+    for (int i = 0; i <= PRESSURE_LUT_SIZE; i++) {
+        curve->lut[i] = (uint16_t)lrintf(PRESSURE_MAX * powf((float)i / PRESSURE_LUT_SIZE, gamma));
+    }
+
+    // A real hover measurement is never exactly zero; only then are the thresholds derived from it
+    if (cal->hover > 0.0f) {
+        curve->onset_level = zero + (cal->light - zero) * 0.5f;
+        curve->release_level = zero + (cal->light - zero) * 0.25f;
+    } else {
+        curve->onset_level = PEN_ONSET_LEVEL;
+        curve->release_level = PEN_RELEASE_LEVEL;
+    }
+
+    // The same curve for the fixed-point path
+    const float one = (float)(1 << LEVEL_FRAC_BITS);
+    curve->zero_q = (int32_t)lrintf(curve->zero_level * one);
+    curve->scale_q = (int64_t)llround((double)curve->scale / one * (1 << 24));
+    curve->onset_q = (int32_t)lrintf(curve->onset_level * one);
+    curve->release_q = (int32_t)lrintf(curve->release_level * one);
+    return 0;
+}
+
+/**
+ * @brief Map a mic level to ABS_PRESSURE with the tabulated curve.
+ *
+ * @param curve Curve from pressure_curve_build().
+ * @param level Detector output.
+ * @return int Pressure in 0..PRESSURE_MAX.
+ */
+int pressure_curve_map(const PressureCurve *curve, float level) {
+    float x = (level - curve->zero_level) * curve->scale;
+    if (x <= 0.0f) {
+        return 0;
+    }
+    if (x >= PRESSURE_LUT_SIZE) {
+        return PRESSURE_MAX;
+    }
+
+    // Interpolate between neighbouring entries
+    int i = (int)x;
+    float frac = x - i;
+    return curve->lut[i] + (int)(frac * (curve->lut[i + 1] - curve->lut[i]));
+}
+
+/**
+ * @brief Map a fixed-point level to ABS_PRESSURE, in integers only.
+ *
+ * @param curve Curve from pressure_curve_build().
+ * @param level_q Detector output with LEVEL_FRAC_BITS fraction bits.
+ * @return int Pressure in 0..PRESSURE_MAX.
+ */
+int pressure_curve_map_fixed(const PressureCurve *curve, int32_t level_q) {
+    int64_t x = (int64_t)(level_q - curve->zero_q) * curve->scale_q;
+    if (x <= 0) {
+        return 0;
+    }
+    if (x >= (int64_t)PRESSURE_LUT_SIZE << 24) {
+        return PRESSURE_MAX;
+    }
+
+    int i = (int)(x >> 24);
+    int32_t frac = (int32_t)((x >> 8) & 0xFFFF);
+    return curve->lut[i] + (((curve->lut[i + 1] - curve->lut[i]) * frac) >> 16);
+}
+
+// Keep the tone queued and capture one block; returns the block level
+static float service_block(AudioDuplex *duplex, float frequency) {
+    static unsigned int restarts_seen;
+    AudioStreamInfo playback_info;
+    snd_pcm_sframes_t avail;
+    float level;
+
+    get_playback_info(&playback_info);
+    do {
+        while ((avail = snd_pcm_avail(duplex->playback)) < 0 ||
+               avail >= (snd_pcm_sframes_t)playback_info.period_frames) {
+            if (play_tone(frequency) < 0) {
+                return -1.0f;
+            }
+        }
+        level = capture_audio(duplex->capture);
+    } while (level == CAPTURE_RECOVERED);
+
+    // Lock the detector to the tone again after either stream restarted
+    if (level >= 0 && audio_duplex_restarts(duplex) != restarts_seen &&
+        audio_duplex_measure_offset(duplex) == 0) {
+        restarts_seen = audio_duplex_restarts(duplex);
+        if (duplex->capture->detector) {
+            tone_detector_reset(duplex->capture->detector);
+            audio_duplex_align_detector(duplex, duplex->capture->detector);
+        }
+    }
+    return level;
+}
+
+// Keep both streams flowing until the user presses Enter
+static int wait_for_enter(AudioDuplex *duplex, float frequency) {
+    struct pollfd stdin_fd = { .fd = STDIN_FILENO, .events = POLLIN };
+    int c;
+
+    while (poll(&stdin_fd, 1, 0) == 0) {
+        if (service_block(duplex, frequency) < 0) {
+            return -1;
+        }
+    }
+    while ((c = getchar()) != '\n' && c != EOF) {
+    }
+    return 0;
+}
+
+// Average level over total_ms, skipping the first settle_ms while the detector settles
+static int measure_level(AudioDuplex *duplex, float frequency, unsigned int settle_ms, unsigned int total_ms,
+                         float *level) {
+    uint64_t target = (uint64_t)duplex->rate * total_ms / 1000;
+    uint64_t settle = (uint64_t)duplex->rate * settle_ms / 1000;
+    uint64_t frames = 0;
+    double sum = 0.0;
+    unsigned int blocks = 0;
+
+    while (frames < target) {
+        float value = service_block(duplex, frequency);
+        if (value < 0) {
+            return -1;
+        }
+        frames += duplex->capture->block_frames;
+        if (frames > settle) {
+            sum += value;
+            blocks++;
+        }
+    }
+
+    *level = blocks ? (float)(sum / blocks) : 0.0f;
+    return 0;
+}
+
+/**
+ * @brief Interactive calibration: record idle, hover, light and full-press levels.
+ *
+ * The duplex streams are started and kept running between the prompts.
+ *
+ * @param duplex Initialized duplex engine with a detector on its capture side.
+ * @param frequency Probe tone frequency in Hz.
+ * @param cal Receives the levels; untouched unless all steps succeed.
+ * @return int 0 on success, -1 on failure.
+ */
+int pressure_calibrate(AudioDuplex *duplex, float frequency, PressureCalibration *cal) {
+    PressureCalibration measured;
+    struct {
+        const char *prompt;
+        float *level;
+    } steps[] = {
+        { "Put the pen away from the screen", &measured.noise_floor },
+        { "Hold the pen just above the screen without touching it", &measured.hover },
+        { "Touch the screen as lightly as you would draw a faint line", &measured.light },
+        { "Press the pen down firmly", &measured.full },
+    };
+
+    if (audio_duplex_start(duplex, frequency) < 0) {
+        return -1;
+    }
+    if (audio_duplex_measure_offset(duplex) == 0 && duplex->capture->detector) {
+        audio_duplex_align_detector(duplex, duplex->capture->detector);
+    }
+
+    printf("Pressure calibration\n");
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        printf("  %s, then press Enter and hold still...", steps[i].prompt);
+        fflush(stdout);
+        if (wait_for_enter(duplex, frequency) < 0 ||
+            measure_level(duplex, frequency, PRESSURE_CALIBRATION_MS / 4, PRESSURE_CALIBRATION_MS,
+                          steps[i].level) < 0) {
+            return -1;
+        }
+        printf("  level %.1f\n", *steps[i].level);
+    }
+
+    PressureCurve check;
+    if (pressure_curve_build(&check, &measured) < 0) {
+        return -1;
+    }
+    *cal = measured;
+    return 0;
+}
+
+// Candidates swept when none are given: the old 2 kHz tone up to the near-ultrasonic band
+static const float default_carriers[] = {
+    2000.0f, 3000.0f, 4000.0f, 6000.0f, 8000.0f, 10000.0f, 12000.0f, 14000.0f,
+    16000.0f, 17000.0f, 18000.0f, 19000.0f, 20000.0f, 21000.0f,
+};
+
+/**
+ * @brief Parse a comma-separated list of carrier frequencies in Hz.
+ *
+ * @param list Text such as "2000,18000,19500".
+ * @param candidates Receives the frequencies.
+ * @param max Capacity of candidates.
+ * @return int Number of frequencies, -1 if the list is empty, too long or not positive numbers.
+ */
+int carrier_parse_list(const char *list, float *candidates, int max) {
+    int count = 0;
+    char *end;
+
+    while (*list) {
+        float frequency = strtof(list, &end);
+        if (end == list || frequency <= 0.0f || count == max || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        candidates[count++] = frequency;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count > 0 ? count : -1;
+}
+
+/**
+ * @brief Measure the response of the jack and codec at candidate carriers and pick the best one.
+ *
+ * Each candidate gets a narrowband lock-in detector of its own. The level
+ * is measured once with the tone silenced and once with it playing, and the
+ * carrier with the highest ratio wins. A near-ultrasonic carrier within
+ * CARRIER_INAUDIBLE_MARGIN_DB of the winner is taken instead, since it
+ * cannot be heard. The streams are started and keep running, with the tone
+ * back at full amplitude; the capture detector is restored.
+ *
+ * @param duplex Initialized duplex engine.
+ * @param candidates Frequencies in Hz, or NULL for the defaults.
+ * @param count Entries in candidates.
+ * @param sweep Receives every measurement and the chosen carrier.
+ * @return int 0 if a carrier was chosen, -1 on failure or if the pen answered on none.
+ */
+int carrier_sweep(AudioDuplex *duplex, const float *candidates, int count, CarrierSweep *sweep) {
+    AudioCapture *capture = duplex->capture;
+    ToneDetector *saved_detector = capture->detector;
+    ToneDetector detector;
+    AudioStreamInfo playback_info;
+    int result = 0;
+
+    if (candidates == NULL) {
+        candidates = default_carriers;
+        count = (int)(sizeof(default_carriers) / sizeof(default_carriers[0]));
+    }
+    if (count > CARRIER_MAX_CANDIDATES) {
+        count = CARRIER_MAX_CANDIDATES;
+    }
+    memset(sweep, 0, sizeof(*sweep));
+    sweep->best = -1;
+
+    // Whatever is queued still plays at the old amplitude, so wait for the buffer to drain first
+    get_playback_info(&playback_info);
+    unsigned int settle_ms = (unsigned int)(playback_info.buffer_frames * 1000 / duplex->rate) + CARRIER_SETTLE_MS;
+
+    set_tone_amplitude(0.0f, 0);
+    if (audio_duplex_start(duplex, PROBE_TONE_FREQUENCY) < 0) {
+        set_tone_amplitude(1.0f, TONE_RAMP_MS);
+        return -1;
+    }
+
+    printf("Carrier sweep at %u Hz\n", duplex->rate);
+    for (int i = 0; i < count; i++) {
+        CarrierResult *r = &sweep->results[sweep->count++];
+        float frequency = candidates[i];
+        r->frequency = frequency;
+
+        if (frequency > duplex->rate * CARRIER_MAX_RATE_SHARE ||
+            tone_detector_init(&detector, DETECTOR_LOCKIN, frequency, duplex->rate, DETECTOR_BANDWIDTH_HZ) < 0) {
+            printf("  %7.0f Hz  above the usable band\n", frequency);
+            continue;
+        }
+        if (capture->block_frames <= DETECTOR_BLOCK_FRAMES) {
+            tone_detector_set_block(&detector, capture->block_frames);
+        }
+        capture->detector = &detector;
+
+        // Noise with the tone silenced, then the answer with it fading in
+        set_tone_amplitude(0.0f, TONE_RAMP_MS);
+        if (measure_level(duplex, frequency, settle_ms, settle_ms + CARRIER_MEASURE_MS, &r->noise) < 0) {
+            result = -1;
+            break;
+        }
+        set_tone_amplitude(1.0f, TONE_RAMP_MS);
+        if (measure_level(duplex, frequency, settle_ms, settle_ms + CARRIER_MEASURE_MS, &r->signal) < 0) {
+            result = -1;
+            break;
+        }
+
+        r->snr_db = 20.0f * log10f(r->signal / (r->noise > 1.0f ? r->noise : 1.0f));
+        r->usable = r->signal >= CARRIER_MIN_LEVEL;
+        printf("  %7.0f Hz  signal %8.1f  noise %7.1f  SNR %5.1f dB%s\n",
+               frequency, r->signal, r->noise, r->snr_db, r->usable ? "" : "  (no answer)");
+    }
+
+    capture->detector = saved_detector;
+    set_tone_amplitude(1.0f, TONE_RAMP_MS);
+    if (result < 0) {
+        return -1;
+    }
+
+    int best = -1, inaudible = -1;
+    for (int i = 0; i < sweep->count; i++) {
+        const CarrierResult *r = &sweep->results[i];
+        if (r->usable && (best < 0 || r->snr_db > sweep->results[best].snr_db)) {
+            best = i;
+        }
+    }
+    for (int i = 0; best >= 0 && i < sweep->count; i++) {
+        const CarrierResult *r = &sweep->results[i];
+        if (r->usable && r->frequency >= CARRIER_INAUDIBLE_HZ &&
+            r->snr_db >= sweep->results[best].snr_db - CARRIER_INAUDIBLE_MARGIN_DB &&
+            (inaudible < 0 || r->snr_db > sweep->results[inaudible].snr_db)) {
+            inaudible = i;
+        }
+    }
+    sweep->best = inaudible >= 0 ? inaudible : best;
+
+    if (sweep->best < 0) {
+        fprintf(stderr, "Carrier sweep: the pen answered on no carrier, is it plugged in?\n");
+        return -1;
+    }
+    return 0;
+}
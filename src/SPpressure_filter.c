@@ -0,0 +1,193 @@
+#include "sonarpen.h"
+
+/* This page contains the adaptive filters that smooth the mic level before it becomes pressure */
+
+/**
+ * @brief Set up a pressure filter with its default tuning.
+ *
+ * @param filter Filter to initialize.
+ * @param type Filter method.
+ * @param full_level Detector level of a firm press; the filter works on level / full_level.
+ * @return int 0 on success, -1 if full_level is not positive.
+ */
+int pressure_filter_init(PressureFilter *filter, PressureFilterType type, float full_level) {
+    if (full_level <= 0.0f) {
+        fprintf(stderr, "Pressure filter: full level must be positive\n");
+        return -1;
+    }
+
+    memset(filter, 0, sizeof(*filter));
+    filter->type = type;
+    filter->full_level = full_level;
+    filter->min_cutoff = ONE_EURO_MIN_CUTOFF_HZ;
+    filter->beta = ONE_EURO_BETA;
+    filter->d_cutoff = ONE_EURO_DERIVATIVE_CUTOFF_HZ;
+    filter->q = KALMAN_PROCESS_NOISE;
+    filter->r = KALMAN_MEASUREMENT_NOISE;
+    filter->fx_full = (int32_t)lrintf(full_level * (1 << LEVEL_FRAC_BITS));
+    if (filter->fx_full < 1) filter->fx_full = 1;
+    return 0;
+}
+
+/**
+ * @brief Forget the filter state, e.g. after the audio stream restarted.
+ *
+ * @param filter Filter to reset.
+ */
+void pressure_filter_reset(PressureFilter *filter) {
+    filter->primed = 0;
+    filter->x = 0.0f;
+    filter->dx = 0.0f;
+    filter->p = 0.0f;
+    filter->fx_x = 0;
+    filter->fx_dx = 0;
+    filter->fx_p = 0;
+}
+
+// Smoothing factor of a one-pole low-pass with the given cutoff for one step of dt seconds
+static float lowpass_alpha(float cutoff, float dt) {
+    float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+    return dt / (dt + tau);
+}
+
+/**
+ * @brief Filter one detector level.
+ *
+ * One Euro raises its cutoff with the filtered speed of the level, so it
+ * is heavily smoothed at constant pressure and nearly transparent during a
+ * fast press or lift. The Kalman filter trusts each measurement more the
+ * longer the gap since the last one.
+ *
+ * @param filter Initialized filter.
+ * @param level Detector output for the newest block.
+ * @param dt Seconds covered by the block.
+ * @return float Filtered level, in detector units.
+ */
+float pressure_filter_process(PressureFilter *filter, float level, float dt) {
+    float z = level / filter->full_level;
+
+    if (filter->type == PRESSURE_FILTER_NONE || dt <= 0.0f) {
+        return level;
+    }
+
+    if (!filter->primed) {
+        filter->x = z;
+        filter->dx = 0.0f;
+        filter->p = filter->r;
+        filter->primed = 1;
+        return level;
+    }
+
+    switch (filter->type) {
+    case PRESSURE_FILTER_ONE_EURO: {
+        float speed = (z - filter->x) / dt;
+        filter->dx += lowpass_alpha(filter->d_cutoff, dt) * (speed - filter->dx);
+        float cutoff = filter->min_cutoff + filter->beta * fabsf(filter->dx);
+        filter->x += lowpass_alpha(cutoff, dt) * (z - filter->x);
+        break;
+    }
+    case PRESSURE_FILTER_KALMAN: {
+        filter->p += filter->q * dt;
+        float gain = filter->p / (filter->p + filter->r);
+        filter->x += gain * (z - filter->x);
+        filter->p *= 1.0f - gain;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return filter->x * filter->full_level;
+}
+
+/**
+ * @brief Precompute the fixed-point coefficients for blocks of a constant length.
+ *
+ * The fixed-point filter runs only at this step. The One Euro smoothing
+ * factor c / (1 + c) with c = 2 pi cutoff dt costs one integer division.
+ *
+ * @param filter Initialized filter.
+ * @param dt Seconds covered by each block.
+ */
+void pressure_filter_set_step(PressureFilter *filter, float dt) {
+    const double q16 = 65536.0, q30 = 1073741824.0;
+
+    if (dt <= 0.0f) {
+        filter->fx_steps_per_s = 0;
+        return;
+    }
+    filter->fx_alpha_d = (int32_t)lrint(lowpass_alpha(filter->d_cutoff, dt) * q16);
+    filter->fx_c_min = (int32_t)lrint(2.0 * M_PI * filter->min_cutoff * dt * q16);
+    filter->fx_c_beta = (int32_t)lrint(2.0 * M_PI * filter->beta * dt * q16);
+    filter->fx_steps_per_s = (int32_t)lrint(256.0 / dt);
+    filter->fx_q_dt = (int64_t)llround(filter->q * dt * q30);
+    filter->fx_r = (int64_t)llround(filter->r * q30);
+}
+
+/**
+ * @brief Filter one fixed-point detector level in integers only.
+ *
+ * Same filters as pressure_filter_process(), on levels normalized to Q16
+ * of the full-press level, at the step set with pressure_filter_set_step().
+ *
+ * @param filter Initialized filter.
+ * @param level_q Detector output with LEVEL_FRAC_BITS fraction bits.
+ * @return int32_t Filtered level with LEVEL_FRAC_BITS fraction bits.
+ */
+int32_t pressure_filter_process_fixed(PressureFilter *filter, int32_t level_q) {
+    int32_t z = (int32_t)(((int64_t)level_q << 16) / filter->fx_full);
+
+    if (filter->type == PRESSURE_FILTER_NONE || filter->fx_steps_per_s == 0) {
+        return level_q;
+    }
+
+    if (!filter->primed) {
+        filter->fx_x = z;
+        filter->fx_dx = 0;
+        filter->fx_p = filter->fx_r;
+        filter->primed = 1;
+        return level_q;
+    }
+
+    switch (filter->type) {
+    case PRESSURE_FILTER_ONE_EURO: {
+        int64_t speed = ((int64_t)(z - filter->fx_x) * filter->fx_steps_per_s) >> 8;
+        filter->fx_dx += (filter->fx_alpha_d * (speed - filter->fx_dx)) >> 16;
+        int64_t c = filter->fx_c_min + ((filter->fx_c_beta * llabs(filter->fx_dx)) >> 16);
+        int64_t alpha = (c << 16) / (c + 65536);
+        filter->fx_x += (int32_t)((alpha * (z - filter->fx_x)) >> 16);
+        break;
+    }
+    case PRESSURE_FILTER_KALMAN: {
+        filter->fx_p += filter->fx_q_dt;
+        int64_t gain = (filter->fx_p << 16) / (filter->fx_p + filter->fx_r);
+        filter->fx_x += (int32_t)((gain * (z - filter->fx_x)) >> 16);
+        filter->fx_p = (filter->fx_p * (65536 - gain)) >> 16;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return (int32_t)(((int64_t)filter->fx_x * filter->fx_full) >> 16);
+}
+
+/**
+ * @brief Look up a filter by its command line name.
+ *
+ * @param name "none", "euro" or "kalman".
+ * @param type Receives the filter method.
+ * @return int 0 on success, -1 for an unknown name.
+ */
+int pressure_filter_parse(const char *name, PressureFilterType *type) {
+    if (strcmp(name, "none") == 0) {
+        *type = PRESSURE_FILTER_NONE;
+    } else if (strcmp(name, "euro") == 0) {
+        *type = PRESSURE_FILTER_ONE_EURO;
+    } else if (strcmp(name, "kalman") == 0) {
+        *type = PRESSURE_FILTER_KALMAN;
+    } else {
+        return -1;
+    }
+    return 0;
+}
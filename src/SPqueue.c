@@ -0,0 +1,135 @@
+#include "sonarpen.h"
+
+/* This page contains the lock-free single-producer/single-consumer queue used between pipeline threads */
+
+/**
+ * @brief Initialize a queue.
+ *
+ * The capacity is rounded up to the next power of two so that indices can be
+ * wrapped with a mask. All storage is allocated here; push and pop never allocate.
+ *
+ * @param queue Pointer to the queue to initialize.
+ * @param capacity Minimum number of elements the queue must hold.
+ * @param elem_size Size of one element in bytes.
+ * @param arena Arena to take the storage from, or NULL to allocate it on the heap.
+ * @return int 0 on success, -1 on failure.
+ */
+int spsc_queue_init(SpscQueue *queue, size_t capacity, size_t elem_size, Arena *arena) {
+    size_t slots = 1;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    queue->owns_slots = arena == NULL;
+    queue->slots = arena ? (unsigned char *)arena_alloc(arena, slots * elem_size)
+                         : (unsigned char *)calloc(slots, elem_size);
+    if (queue->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for queue\n");
+        return -1;
+    }
+
+    queue->capacity = slots;
+    queue->elem_size = elem_size;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return 0;
+}
+
+/**
+ * @brief Append one element. Must only be called from the producer thread.
+ *
+ * @param queue Pointer to the queue.
+ * @param elem Element to copy into the queue.
+ * @return int 0 on success, -1 if the queue is full.
+ */
+int spsc_queue_push(SpscQueue *queue, const void *elem) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head - tail == queue->capacity) {
+        return -1;
+    }
+
+    memcpy(queue->slots + (head & (queue->capacity - 1)) * queue->elem_size, elem, queue->elem_size);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Append one element, dropping the oldest one if the queue is full.
+ *
+ * For consumers that want the newest values: a producer running ahead
+ * never loses what it just measured. The producer takes the oldest slot
+ * by moving tail itself, which spsc_queue_pop() detects, so a pop that
+ * raced with it reads again. Must only be called from the producer thread.
+ *
+ * @param queue Pointer to the queue.
+ * @param elem Element to copy into the queue.
+ * @return int 0 if nothing was dropped, 1 if the oldest element was.
+ */
+int spsc_queue_push_overwrite(SpscQueue *queue, const void *elem) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    int dropped = 0;
+
+    // A failed exchange means the consumer just made room
+    if (head - tail == queue->capacity &&
+        atomic_compare_exchange_strong_explicit(&queue->tail, &tail, tail + 1,
+                                                memory_order_acq_rel, memory_order_acquire)) {
+        dropped = 1;
+    }
+
+    memcpy(queue->slots + (head & (queue->capacity - 1)) * queue->elem_size, elem, queue->elem_size);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return dropped;
+}
+
+/**
+ * @brief Remove the oldest element. Must only be called from the consumer thread.
+ *
+ * @param queue Pointer to the queue.
+ * @param elem Destination for the element.
+ * @return int 0 on success, -1 if the queue is empty.
+ */
+int spsc_queue_pop(SpscQueue *queue, void *elem) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (head == tail) {
+            return -1;
+        }
+
+        memcpy(elem, queue->slots + (tail & (queue->capacity - 1)) * queue->elem_size, queue->elem_size);
+        // Only spsc_queue_push_overwrite() moves tail behind our back, and then the copy may be torn
+        if (atomic_compare_exchange_strong_explicit(&queue->tail, &tail, tail + 1,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Number of elements currently queued. Safe to call from any thread.
+ *
+ * @param queue Pointer to the queue.
+ * @return size_t Approximate depth; exact when called from producer or consumer.
+ */
+size_t spsc_queue_depth(SpscQueue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    return head - tail;
+}
+
+/**
+ * @brief Free the queue storage; storage from an arena goes with the arena.
+ *
+ * @param queue Pointer to the queue.
+ */
+void spsc_queue_cleanup(SpscQueue *queue) {
+    if (queue->owns_slots) {
+        free(queue->slots);
+    }
+    queue->slots = NULL;
+    queue->capacity = 0;
+}
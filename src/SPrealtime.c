@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include "sonarpen.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* This page contains the real-time mode: SCHED_FIFO threads, CPU pinning and locked, pre-faulted memory */
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0x40000000
+#endif
+
+/**
+ * @brief Fill the settings used when real-time mode is off.
+ *
+ * @param rt Settings to fill.
+ */
+void realtime_config_default(RealtimeConfig *rt) {
+    rt->enabled = 0;
+    rt->priority = REALTIME_DEFAULT_PRIORITY;
+    rt->capture_cpu = -1;
+    rt->tone_cpu = -1;
+    rt->io_cpu = -1;
+}
+
+/**
+ * @brief Parse the CPUs of the capture, tone and input/output threads, "C[,T[,I]]".
+ *
+ * Omitted or negative entries leave that thread unpinned.
+ *
+ * @param text CPU list from the command line.
+ * @param rt Settings to update; untouched on failure.
+ * @return int 0 on success, -1 if the list is malformed or names a CPU that does not exist.
+ */
+int realtime_parse_cpus(const char *text, RealtimeConfig *rt) {
+    int cpus[3] = { -1, -1, -1 };
+    long online = sysconf(_SC_NPROCESSORS_CONF);
+    const char *p = text;
+
+    for (int i = 0; i < 3 && *p; i++) {
+        char *end;
+        long cpu = strtol(p, &end, 10);
+        if (end == p || cpu >= online || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        cpus[i] = cpu < 0 ? -1 : (int)cpu;
+        p = *end == ',' ? end + 1 : end;
+    }
+    if (*p) {
+        return -1;
+    }
+
+    rt->capture_cpu = cpus[0];
+    rt->tone_cpu = cpus[1];
+    rt->io_cpu = cpus[2];
+    return 0;
+}
+
+/**
+ * @brief Keep the process in RAM so the audio path never waits for a page fault.
+ *
+ * Future mappings (thread stacks, ALSA buffers) are only locked as well
+ * when RLIMIT_MEMLOCK allows it; with the usual small limit they would fail
+ * to map once the limit is reached, so then only the current pages are
+ * locked and later ones are pre-faulted instead.
+ *
+ * @return int 0 if memory is locked, -1 if not permitted (the driver runs on regardless).
+ */
+int realtime_lock_memory(void) {
+    struct rlimit limit;
+    int flags = MCL_CURRENT;
+
+    if (geteuid() == 0 || (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY)) {
+        flags |= MCL_FUTURE;
+    }
+
+    if (mlockall(flags) < 0) {
+        fprintf(stderr, "Real-time: cannot lock memory (%s), pages are pre-faulted only\n", strerror(errno));
+        return -1;
+    }
+    printf("Real-time: memory locked%s\n", flags & MCL_FUTURE ? ", including future allocations" : "");
+    return 0;
+}
+
+/**
+ * @brief Touch every page of a buffer so later accesses do not fault.
+ *
+ * Contents are preserved.
+ *
+ * @param buffer Start of the buffer.
+ * @param len Size in bytes.
+ */
+void realtime_prefault(void *buffer, size_t len) {
+    volatile unsigned char *bytes = (volatile unsigned char *)buffer;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (buffer == NULL || len == 0) {
+        return;
+    }
+    for (size_t i = 0; i < len; i += (size_t)page) {
+        bytes[i] = bytes[i];
+    }
+    bytes[len - 1] = bytes[len - 1];
+}
+
+// Grow the stack of the calling thread by REALTIME_STACK_PREFAULT bytes once, while faults are still harmless
+static void prefault_stack(void) {
+    volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+    memset((unsigned char *)stack, 0, sizeof(stack));
+}
+
+/**
+ * @brief Give the calling thread a real-time priority and, optionally, a CPU.
+ *
+ * Like rtkit, the priority is capped at RLIMIT_RTPRIO for unprivileged users
+ * and SCHED_RESET_ON_FORK keeps children from inheriting it. When SCHED_FIFO
+ * is not permitted the thread falls back to the highest nice level allowed.
+ *
+ * @param name Thread name shown by ps and top.
+ * @param priority SCHED_FIFO priority, 1..99.
+ * @param cpu CPU to pin to, -1 for any.
+ * @return int 0 with SCHED_FIFO, -1 after falling back to normal scheduling.
+ */
+int realtime_enter_thread(const char *name, int priority, int cpu) {
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    struct sched_param param = {0};
+    struct rlimit limit;
+    int err;
+
+    pthread_setname_np(pthread_self(), name);
+    prefault_stack();
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+            fprintf(stderr, "Real-time: cannot pin %s to CPU %d: %s\n", name, cpu, strerror(err));
+        }
+    }
+
+    if (geteuid() != 0 && getrlimit(RLIMIT_RTPRIO, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY && (rlim_t)priority > limit.rlim_cur) {
+        priority = (int)limit.rlim_cur;
+    }
+
+    if (priority > 0) {
+        param.sched_priority = priority;
+        if (sched_setscheduler(tid, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == 0) {
+            printf("Real-time: %s at SCHED_FIFO priority %d", name, priority);
+            if (cpu >= 0) printf(" on CPU %d", cpu);
+            printf("\n");
+            return 0;
+        }
+        err = errno;
+    } else {
+        err = EPERM;
+    }
+
+    // Not permitted: at least get ahead of ordinary processes
+    int nice_level = REALTIME_FALLBACK_NICE;
+    while (nice_level < 0 && setpriority(PRIO_PROCESS, (id_t)tid, nice_level) < 0) {
+        nice_level++;
+    }
+    fprintf(stderr, "Real-time: %s cannot use SCHED_FIFO (%s), running at nice %d\n",
+            name, strerror(err), nice_level);
+    return -1;
+}
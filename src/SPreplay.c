@@ -0,0 +1,497 @@
+#include "sonarpen.h"
+
+/* This page contains the offline replay: WAV and evemu recordings in, virtual tablet events to a file */
+
+// Little-endian fields of the RIFF headers
+static uint16_t read_le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Open a WAV file and position it at the first sample.
+ *
+ * Only 16-bit PCM is accepted (plain or WAVE_FORMAT_EXTENSIBLE), with any
+ * number of channels.
+ *
+ * @param wav Reader to initialize.
+ * @param path WAV file.
+ * @return int 0 on success, -1 if the file cannot be read or has another format.
+ */
+int wav_reader_open(WavReader *wav, const char *path) {
+    unsigned char header[40];
+    int have_format = 0;
+
+    memset(wav, 0, sizeof(*wav));
+    wav->file = fopen(path, "rb");
+    if (wav->file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(header, 1, 12, wav->file) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "%s: not a WAV file\n", path);
+        wav_reader_close(wav);
+        return -1;
+    }
+
+    // Walk the chunks up to the samples
+    for (;;) {
+        if (fread(header, 1, 8, wav->file) != 8) {
+            fprintf(stderr, "%s: no sample data\n", path);
+            wav_reader_close(wav);
+            return -1;
+        }
+        uint32_t size = read_le32(header + 4);
+
+        if (memcmp(header, "fmt ", 4) == 0) {
+            size_t len = size < sizeof(header) ? size : sizeof(header);
+            if (len < 16 || fread(header, 1, len, wav->file) != len) {
+                break;
+            }
+            uint16_t format = read_le16(header);
+            if (format == 0xFFFE && len >= 26) {
+                format = read_le16(header + 24);
+            }
+            wav->channels = read_le16(header + 2);
+            wav->rate = read_le32(header + 4);
+            if (format != 1 || read_le16(header + 14) != 16 || wav->channels == 0 ||
+                wav->channels > sizeof(wav->scratch) / sizeof(wav->scratch[0]) || wav->rate == 0) {
+                fprintf(stderr, "%s: only 16-bit PCM is supported\n", path);
+                wav_reader_close(wav);
+                return -1;
+            }
+            have_format = 1;
+            size -= (uint32_t)len;
+        } else if (memcmp(header, "data", 4) == 0) {
+            if (!have_format) {
+                break;
+            }
+            wav->frames_left = size / (2 * wav->channels);
+            return 0;
+        }
+
+        // Chunks are padded to an even size
+        if (fseek(wav->file, (long)size + (size & 1), SEEK_CUR) < 0) {
+            break;
+        }
+    }
+
+    fprintf(stderr, "%s: malformed WAV file\n", path);
+    wav_reader_close(wav);
+    return -1;
+}
+
+/**
+ * @brief Read the next frames of the first channel.
+ *
+ * @param wav Open reader.
+ * @param samples Receives one sample per frame.
+ * @param frames Frames wanted.
+ * @return int Frames read, fewer than asked only at the end of the data, or -1 on a read error.
+ */
+int wav_reader_read(WavReader *wav, int16_t *samples, int frames) {
+    size_t capacity = sizeof(wav->scratch) / sizeof(wav->scratch[0]) / wav->channels;
+    int done = 0;
+
+    while (done < frames && wav->frames_left > 0) {
+        size_t want = (size_t)(frames - done);
+        if (want > capacity) want = capacity;
+        if (want > wav->frames_left) want = wav->frames_left;
+
+        // Samples are stored little-endian, like the hosts the driver runs on
+        size_t got = fread(wav->scratch, 2 * wav->channels, want, wav->file);
+        if (got == 0) {
+            if (ferror(wav->file)) {
+                perror("wav_reader_read");
+                return -1;
+            }
+            wav->frames_left = 0;  // Truncated file: stop at what is there
+            break;
+        }
+
+        dsp_deinterleave_s16(wav->scratch, wav->channels, 0, samples + done, got);
+        done += (int)got;
+        wav->frames_left -= (uint32_t)got;
+    }
+    return done;
+}
+
+/**
+ * @brief Close the WAV file.
+ *
+ * @param wav Reader; closing twice is harmless.
+ */
+void wav_reader_close(WavReader *wav) {
+    if (wav->file) {
+        fclose(wav->file);
+        wav->file = NULL;
+    }
+}
+
+// Enable every code set in one line of a "B:" or "P:" bitmask; offset counts the bytes seen for this mask
+static void enable_mask_bytes(struct libevdev *dev, int type, const char *hex, unsigned int *offset) {
+    unsigned int byte;
+    int used;
+
+    while (sscanf(hex, " %2x%n", &byte, &used) == 1) {
+        for (unsigned int bit = 0; bit < 8; bit++) {
+            if (!(byte & (1u << bit))) {
+                continue;
+            }
+            unsigned int code = *offset * 8 + bit;
+            if (type < 0) {
+                libevdev_enable_property(dev, code);
+            } else if (type == EV_SYN) {
+                libevdev_enable_event_type(dev, code);
+            } else if (type != EV_ABS && type != EV_REP) {
+                // Axes come with their ranges on the A: lines; autorepeat is not needed
+                libevdev_enable_event_code(dev, (unsigned int)type, code, NULL);
+            }
+        }
+        (*offset)++;
+        hex += used;
+    }
+}
+
+// Apply one header line to the device
+static int parse_header_line(struct libevdev *dev, const char *line, unsigned int offsets[EV_CNT + 1]) {
+    switch (line[0]) {
+    case 'N': {
+        char name[128];
+        if (sscanf(line, "N: %127[^\n]", name) == 1) {
+            libevdev_set_name(dev, name);
+        }
+        return 0;
+    }
+    case 'I': {
+        unsigned int bus, vendor, product, version;
+        if (sscanf(line, "I: %x %x %x %x", &bus, &vendor, &product, &version) != 4) {
+            return -1;
+        }
+        libevdev_set_id_bustype(dev, (int)bus);
+        libevdev_set_id_vendor(dev, (int)vendor);
+        libevdev_set_id_product(dev, (int)product);
+        libevdev_set_id_version(dev, (int)version);
+        return 0;
+    }
+    case 'P':
+        enable_mask_bytes(dev, -1, line + 2, &offsets[EV_CNT]);
+        return 0;
+    case 'B': {
+        unsigned int type;
+        int used;
+        if (sscanf(line, "B: %x%n", &type, &used) != 1 || type >= EV_CNT) {
+            return -1;
+        }
+        enable_mask_bytes(dev, (int)type, line + used, &offsets[type]);
+        return 0;
+    }
+    case 'A': {
+        struct input_absinfo abs = {0};
+        unsigned int code;
+        int n = sscanf(line, "A: %x %d %d %d %d %d", &code, &abs.minimum, &abs.maximum,
+                       &abs.fuzz, &abs.flat, &abs.resolution);
+        if (n < 5 || code > ABS_MAX) {
+            return -1;
+        }
+        // Enabling ABS_MT_SLOT also sets up the slots
+        return libevdev_enable_event_code(dev, EV_ABS, code, &abs) < 0 ? -1 : 0;
+    }
+    default:
+        return 0;  // LEDs, switches and anything newer
+    }
+}
+
+// Parse an "E:" line
+static int parse_event_line(const char *line, struct input_event *ev) {
+    long sec, usec;
+    unsigned int type, code;
+    int value;
+
+    if (sscanf(line, "E: %ld.%ld %x %x %d", &sec, &usec, &type, &code, &value) != 5) {
+        return -1;
+    }
+    ev->time.tv_sec = (time_t)sec;
+    ev->time.tv_usec = (suseconds_t)usec;
+    ev->type = (uint16_t)type;
+    ev->code = (uint16_t)code;
+    ev->value = value;
+    return 0;
+}
+
+/**
+ * @brief Open an evemu-record file and build the device its header describes.
+ *
+ * @param rec Reader to initialize.
+ * @param path Recording.
+ * @return int 0 on success, -1 if the file cannot be read or the header is malformed.
+ */
+int evemu_reader_open(EvemuReader *rec, const char *path) {
+    unsigned int offsets[EV_CNT + 1] = {0};
+    int line_no = 0;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->file = fopen(path, "r");
+    if (rec->file == NULL) {
+        perror(path);
+        return -1;
+    }
+    rec->dev = libevdev_new();
+    if (rec->dev == NULL) {
+        evemu_reader_close(rec);
+        return -1;
+    }
+
+    while (fgets(rec->line, sizeof(rec->line), rec->file)) {
+        line_no++;
+        if (rec->line[0] == '#' || rec->line[0] == '\n') {
+            continue;
+        }
+        if (rec->line[0] == 'E') {
+            rec->pending = 1;
+            return 0;
+        }
+        if (rec->line[1] != ':' || parse_header_line(rec->dev, rec->line, offsets) < 0) {
+            fprintf(stderr, "%s:%d: malformed line: %s", path, line_no, rec->line);
+            evemu_reader_close(rec);
+            return -1;
+        }
+    }
+
+    // A device description without events is still a valid recording
+    return 0;
+}
+
+/**
+ * @brief Read the next recorded event.
+ *
+ * @param rec Open reader.
+ * @param ev Receives the event with its recorded time.
+ * @return int 1 on success, 0 at the end of the recording, -1 on a malformed line.
+ */
+int evemu_reader_next(EvemuReader *rec, struct input_event *ev) {
+    for (;;) {
+        if (!rec->pending && !fgets(rec->line, sizeof(rec->line), rec->file)) {
+            return 0;
+        }
+        rec->pending = 0;
+
+        if (rec->line[0] != 'E') {
+            continue;  // Comments, and the headers of further devices
+        }
+        if (parse_event_line(rec->line, ev) < 0) {
+            fprintf(stderr, "Malformed event: %s", rec->line);
+            return -1;
+        }
+        return 1;
+    }
+}
+
+/**
+ * @brief Close the recording and free the device unless it was handed over.
+ *
+ * @param rec Reader; closing twice is harmless.
+ */
+void evemu_reader_close(EvemuReader *rec) {
+    if (rec->dev) {
+        libevdev_free(rec->dev);
+        rec->dev = NULL;
+    }
+    if (rec->file) {
+        fclose(rec->file);
+        rec->file = NULL;
+    }
+}
+
+/**
+ * @brief Fill the settings of a replay with the driver defaults.
+ *
+ * @param config Settings to fill; the paths stay NULL.
+ */
+void replay_config_default(ReplayConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->tone_frequency = PROBE_TONE_FREQUENCY;
+    config->block_frames = DETECTOR_BLOCK_FRAMES;
+    config->detector = DETECTOR_LOCKIN;
+    config->pressure_filter = PRESSURE_FILTER_ONE_EURO;
+    pressure_calibration_default(&config->calibration);
+    coord_mapping_default(&config->mapping);
+}
+
+// Nanoseconds of an event time
+static uint64_t timeval_ns(const struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000000ull + (uint64_t)tv->tv_usec * 1000ull;
+}
+
+/**
+ * @brief Run recorded mic audio and touch events through the pipeline as fast as possible.
+ *
+ * Both recordings share one timeline that starts at the first touch event;
+ * the WAV starts audio_offset_ms later. Audio is cut into blocks of
+ * block_frames, the capture block of a driver run with the same period
+ * (periods above DETECTOR_BLOCK_FRAMES are cut to it), and each block is
+ * delivered, in time order with the touch events, at the time it ends. Reports carry timeline times as well, so the
+ * same input always gives byte-identical output.
+ *
+ * @param config Recordings, output file and processing settings.
+ * @param stats Receives counts and timings.
+ * @return int 0 on success, -1 on failure.
+ */
+int replay_run(const ReplayConfig *config, ReplayStats *stats) {
+    EvemuReader rec;
+    WavReader wav = {0};
+    ToneDetector detector;
+    PressureCurve curve;
+    SonarpenPipeline pipeline;
+    int16_t block[DETECTOR_BLOCK_FRAMES];
+    struct input_event ev;
+    int result = -1;
+    int out_fd = -1;
+    int have_pipeline = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    if (config->audio_offset_ms < 0) {
+        fprintf(stderr, "Replay: the audio offset cannot be negative\n");
+        return -1;
+    }
+    if (config->block_frames == 0 || config->block_frames > DETECTOR_BLOCK_FRAMES) {
+        fprintf(stderr, "Replay: blocks must have 1..%d frames\n", DETECTOR_BLOCK_FRAMES);
+        return -1;
+    }
+    if (pressure_curve_build(&curve, &config->calibration) < 0) {
+        fprintf(stderr, "Replay: invalid pressure calibration\n");
+        return -1;
+    }
+    if (evemu_reader_open(&rec, config->events_path) < 0) {
+        return -1;
+    }
+    if (config->wav_path) {
+        if (wav_reader_open(&wav, config->wav_path) < 0) {
+            goto out;
+        }
+        if (tone_detector_init(&detector, config->detector, config->tone_frequency, wav.rate,
+                               DETECTOR_BANDWIDTH_HZ) < 0 ||
+            tone_detector_set_block(&detector, config->block_frames) < 0) {
+            fprintf(stderr, "Replay: no tone detector for %u Hz audio\n", wav.rate);
+            goto out;
+        }
+    }
+
+    out_fd = open(config->output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror(config->output_path);
+        goto out;
+    }
+    if (pipeline_init(&pipeline, NULL, out_fd, config->tone_frequency, NULL) < 0) {
+        goto out;
+    }
+    have_pipeline = 1;
+    pipeline.pressure_curve = &curve;
+    pipeline.coord_mapping = &config->mapping;
+    pressure_filter_init(&pipeline.pressure_filter, config->pressure_filter, config->calibration.full);
+    if (config->wav_path) {
+        pressure_filter_set_step(&pipeline.pressure_filter, (float)config->block_frames / wav.rate);
+        pipeline.fixed_point = detector.type == DETECTOR_LOCKIN_FIXED;
+    }
+    if (pipeline_attach_touch_device(&pipeline, rec.dev, config->events_path) < 0) {
+        goto out;
+    }
+    rec.dev = NULL;
+
+    uint64_t started = monotonic_time_ns();
+    int rc = evemu_reader_next(&rec, &ev);
+    uint64_t origin = rc > 0 ? timeval_ns(&ev.time) : 0;
+    uint64_t audio_start = REPLAY_EPOCH_NS + (uint64_t)llround(config->audio_offset_ms * 1e6);
+    uint64_t now = REPLAY_EPOCH_NS;
+    float dt = config->wav_path ? (float)config->block_frames / wav.rate : 0.0f;
+    int audio_left = config->wav_path != NULL;
+
+    while (rc > 0 || audio_left) {
+        uint64_t event_ns = rc > 0 ? REPLAY_EPOCH_NS + timeval_ns(&ev.time) - origin : UINT64_MAX;
+        uint64_t block_end = UINT64_MAX;
+        if (audio_left) {
+            block_end = audio_start + (stats->audio_blocks + 1) * config->block_frames * 1000000000ull / wav.rate;
+        }
+
+        if (audio_left && block_end <= event_ns) {
+            int frames = wav_reader_read(&wav, block, config->block_frames);
+            if (frames < 0) {
+                goto out;
+            }
+            if (frames < (int)config->block_frames) {
+                audio_left = 0;  // The driver never sees partial blocks either
+                continue;
+            }
+            float level = tone_detector_process(&detector, block, frames);
+            pipeline_replay_level(&pipeline, level, dt, block_end);
+            stats->audio_blocks++;
+            now = block_end;
+        } else {
+            ev.time.tv_sec = (time_t)(event_ns / 1000000000ull);
+            ev.time.tv_usec = (suseconds_t)(event_ns % 1000000000ull / 1000);
+            pipeline_replay_touch_event(&pipeline, &ev);
+            stats->touch_events++;
+            if (event_ns > now) now = event_ns;
+            rc = evemu_reader_next(&rec, &ev);
+        }
+    }
+    if (rc < 0) {
+        goto out;
+    }
+
+    pipeline_replay_finish(&pipeline, now);
+    stats->processing_ms = (monotonic_time_ns() - started) / 1e6;
+    stats->recording_ms = (now - REPLAY_EPOCH_NS) / 1e6;
+    stats->output_events = (unsigned long)(lseek(out_fd, 0, SEEK_CUR) / (off_t)sizeof(struct input_event));
+    result = 0;
+
+out:
+    if (have_pipeline) {
+        pipeline_cleanup(&pipeline);
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    wav_reader_close(&wav);
+    evemu_reader_close(&rec);
+    return result;
+}
+
+/**
+ * @brief Print a replay output file in the event format of evemu-record.
+ *
+ * Times are shown on the replay timeline, so they line up with the E: lines
+ * of the touch recording.
+ *
+ * @param path File written by replay_run().
+ * @param out Stream to print to.
+ * @return int 0 on success, -1 if the file cannot be read.
+ */
+int replay_dump(const char *path, FILE *out) {
+    struct input_event ev;
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fread(&ev, sizeof(ev), 1, file) == 1) {
+        uint64_t ns = timeval_ns(&ev.time);
+        ns = ns > REPLAY_EPOCH_NS ? ns - REPLAY_EPOCH_NS : 0;
+        const char *type = libevdev_event_type_get_name(ev.type);
+        const char *code = libevdev_event_code_get_name(ev.type, ev.code);
+
+        fprintf(out, "E: %lu.%06lu %04x %04x %04d\t# %s / %s\n",
+                (unsigned long)(ns / 1000000000ull), (unsigned long)(ns % 1000000000ull / 1000),
+                ev.type, ev.code, ev.value, type ? type : "?", code ? code : "?");
+    }
+
+    int failed = ferror(file);
+    fclose(file);
+    return failed ? -1 : 0;
+}
@@ -8,77 +8,346 @@
 #define SAMPLE_RATE 48000
 #define PCM_DEVICE "default"
 
+#define TONE_TABLE_SIZE (1 << TONE_TABLE_BITS)
+#define TONE_GAIN_ONE (1 << 24)
+
+/**
+ * @brief Precompute the wavetable and reset the oscillator to silence.
+ *
+ * @param engine Engine to initialize.
+ * @param sample_rate Output sample rate in Hz.
+ */
+void tone_engine_init(ToneEngine *engine, unsigned int sample_rate) {
+    for (int i = 0; i <= TONE_TABLE_SIZE; i++) {
+        engine->table[i] = (int16_t)lrint(32767.0 * sin(2.0 * M_PI * i / TONE_TABLE_SIZE));
+    }
+    engine->phase = 0;
+    engine->phase_inc = 0;
+    engine->gain = 0;
+    engine->target_gain = 0;
+    engine->gain_step = 0;
+    engine->sample_rate = sample_rate;
+    engine->frequency = 0.0f;
+}
+
+/**
+ * @brief Change the tone frequency. The phase stays continuous.
+ *
+ * @param engine Initialized engine.
+ * @param frequency Frequency in Hz.
+ */
+void tone_engine_set_frequency(ToneEngine *engine, float frequency) {
+    engine->frequency = frequency;
+    engine->phase_inc = (uint32_t)llrint((double)frequency * 4294967296.0 / engine->sample_rate);
+}
+
+/**
+ * @brief Ramp the output level to a new amplitude.
+ *
+ * @param engine Initialized engine.
+ * @param amplitude Target amplitude, 0.0 (silent) to 1.0 (full scale).
+ * @param ramp_frames Length of the ramp, 0 to jump immediately.
+ */
+void tone_engine_set_amplitude(ToneEngine *engine, float amplitude, unsigned int ramp_frames) {
+    if (amplitude < 0.0f) amplitude = 0.0f;
+    if (amplitude > 1.0f) amplitude = 1.0f;
+
+    engine->target_gain = (int32_t)(amplitude * TONE_GAIN_ONE);
+    if (ramp_frames == 0) {
+        engine->gain = engine->target_gain;
+        engine->gain_step = 0;
+    } else {
+        engine->gain_step = (engine->target_gain - engine->gain) / (int32_t)ramp_frames;
+        if (engine->gain_step == 0) {
+            engine->gain_step = engine->target_gain > engine->gain ? 1 : -1;
+        }
+    }
+}
+
+/**
+ * @brief Render samples into one channel of an interleaved buffer.
+ *
+ * Other channels are left untouched.
+ *
+ * @param engine Initialized engine.
+ * @param dst First sample of the tone channel.
+ * @param frames Number of frames to render.
+ * @param stride Distance between frames in samples (the channel count).
+ */
+void tone_engine_render(ToneEngine *engine, int16_t *dst, size_t frames, unsigned int stride) {
+    const int shift = 32 - TONE_TABLE_BITS;
+    uint32_t phase = engine->phase;
+    uint32_t inc = engine->phase_inc;
+    int32_t gain = engine->gain;
+
+    for (size_t i = 0; i < frames; i++) {
+        // Table index from the top bits, interpolation weight from the next 16
+        uint32_t idx = phase >> shift;
+        int32_t frac = (int32_t)((phase >> (shift - 16)) & 0xFFFF);
+        int32_t a = engine->table[idx];
+        int32_t b = engine->table[idx + 1];
+        int32_t sample = a + (((b - a) * frac) >> 16);
+
+        dst[i * stride] = (int16_t)(((int64_t)sample * gain) >> 24);
+        phase += inc;
+
+        if (gain != engine->target_gain) {
+            gain += engine->gain_step;
+            if ((engine->gain_step > 0 && gain > engine->target_gain) ||
+                (engine->gain_step < 0 && gain < engine->target_gain)) {
+                gain = engine->target_gain;
+            }
+        }
+    }
+
+    engine->phase = phase;
+    engine->gain = gain;
+}
+
+/**
+ * @brief Phase of the next rendered sample in radians.
+ *
+ * @param engine Initialized engine.
+ */
+double tone_engine_phase(const ToneEngine *engine) {
+    return engine->phase * (2.0 * M_PI / 4294967296.0);
+}
+
 static snd_pcm_t *playback_handle = NULL;
 static unsigned int sample_rate = SAMPLE_RATE;
 static int channels = 2;
-static double phase = 0.0;  // Keep phase between calls
+static ToneEngine tone_engine;  // Keeps phase and gain between calls
+static AudioStreamInfo playback_info;
+static AudioRecovery playback_recovery;
+static snd_pcm_uframes_t write_frames = BUFFER_LEN;  // Frames written per play_tone() call
+
+// Frame counter and phase line of the emitted tone, read by the capture thread
+static atomic_uint_fast64_t frames_written;
+static atomic_uint_fast32_t tone_phase_origin;  // Phase of frame 0 on the current phase line
+static atomic_uint_fast32_t tone_phase_inc;
 
 int init_audio_playback() {
+    return init_audio_playback_config(NULL);
+}
+
+/**
+ * @brief Open the playback device with explicit stream parameters.
+ *
+ * With an explicit period size each play_tone() call writes one period, so
+ * the tone never sits in a deeper queue than the device buffer.
+ *
+ * @param config Requested parameters, or NULL for the device defaults.
+ * @return int 0 on success, -1 on failure.
+ */
+int init_audio_playback_config(const AudioConfig *config) {
+    AudioConfig defaults;
     int err;
+
+    if (config == NULL) {
+        audio_config_default(&defaults);
+        config = &defaults;
+    }
+
     // Open PCM device for playback
-    if ((err = snd_pcm_open(&playback_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+    if ((err = snd_pcm_open(&playback_handle, config->device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
         fprintf(stderr, "Playback open error: %s\n", snd_strerror(err));
         return -1;
     }
 
-    // Set hardware parameters
-    snd_pcm_hw_params_t *params;
-    snd_pcm_hw_params_alloca(&params);
-    snd_pcm_hw_params_any(playback_handle, params);
+    // Set and apply hardware and software parameters
+    if (configure_pcm_stream(playback_handle, config, channels, SAMPLE_RATE, &playback_info) < 0) {
+        snd_pcm_close(playback_handle);
+        playback_handle = NULL;
+        return -1;
+    }
 
-    // Set access type
-    snd_pcm_hw_params_set_access(playback_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    sample_rate = playback_info.rate;
+    atomic_store(&frames_written, 0);
+    tone_engine_init(&tone_engine, sample_rate);
+    tone_engine_set_amplitude(&tone_engine, 1.0f, sample_rate * TONE_RAMP_MS / 1000);
+    write_frames = BUFFER_LEN;
+    if (config->period_frames > 0 && playback_info.period_frames < BUFFER_LEN) {
+        write_frames = playback_info.period_frames;
+    }
 
-    // Set sample format
-    snd_pcm_hw_params_set_format(playback_handle, params, SND_PCM_FORMAT_S16_LE);
+    return 0;
+}
 
-    // Set channels
-    snd_pcm_hw_params_set_channels(playback_handle, params, channels);
+/**
+ * @brief Negotiated parameters of the playback stream.
+ *
+ * @param info Receives the parameters.
+ */
+void get_playback_info(AudioStreamInfo *info) {
+    *info = playback_info;
+}
 
-    // Set sample rate
-    snd_pcm_hw_params_set_rate_near(playback_handle, params, &sample_rate, 0);
+// Restart the phase line so that phase(k) = origin + k * inc from the next frame written on
+static void restart_phase_line(void) {
+    uint32_t written = (uint32_t)atomic_load(&frames_written);
+    atomic_store(&tone_phase_inc, tone_engine.phase_inc);
+    atomic_store(&tone_phase_origin, tone_engine.phase - written * tone_engine.phase_inc);
+}
 
-    // Apply hardware parameters
-    if ((err = snd_pcm_hw_params(playback_handle, params)) < 0) {
-        fprintf(stderr, "Unable to set HW parameters: %s\n", snd_strerror(err));
-        snd_pcm_close(playback_handle);
-        return -1;
+// Write one period straight into the mmap ring buffer
+static int play_tone_mmap(void) {
+    snd_pcm_uframes_t remaining = write_frames;
+    int err;
+
+    while (remaining > 0) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(playback_handle);
+        if (avail < 0) {
+            if (audio_stream_recover(playback_handle, (int)avail, &playback_recovery, "Playback") < 0) {
+                fprintf(stderr, "Error writing to PCM device: %s\n", snd_strerror((int)avail));
+                return -1;
+            }
+            continue;
+        }
+
+        if ((snd_pcm_uframes_t)avail < remaining) {
+            if (snd_pcm_state(playback_handle) == SND_PCM_STATE_PREPARED) {
+                // Buffer is full but not running yet: start it
+                snd_pcm_start(playback_handle);
+            } else if ((err = snd_pcm_wait(playback_handle, 1000)) < 0 &&
+                       audio_stream_recover(playback_handle, err, &playback_recovery, "Playback") < 0) {
+                fprintf(stderr, "Error waiting for PCM device: %s\n", snd_strerror(err));
+                return -1;
+            }
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset, frames = remaining;
+        // Nothing was rendered yet, so the phase line still holds after a recovery
+        if ((err = snd_pcm_mmap_begin(playback_handle, &areas, &offset, &frames)) < 0) {
+            if (audio_stream_recover(playback_handle, err, &playback_recovery, "Playback") < 0) {
+                fprintf(stderr, "Error mapping playback buffer: %s\n", snd_strerror(err));
+                return -1;
+            }
+            continue;
+        }
+
+        short *dst = (short *)((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8);
+        unsigned int stride = areas[0].step / 16;
+        for (snd_pcm_uframes_t i = 0; i < frames; i++) {
+            dst[i * stride] = 0;    // Left channel silent
+        }
+        tone_engine_render(&tone_engine, dst + 1, frames, stride); // Right channel with tone
+
+        // A failed commit drops the rendered frames, so the phase line starts over after them
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(playback_handle, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+            err = committed < 0 ? (int)committed : -EPIPE;
+            if (audio_stream_recover(playback_handle, err, &playback_recovery, "Playback") < 0) {
+                fprintf(stderr, "Error committing playback buffer: %s\n", snd_strerror(err));
+                return -1;
+            }
+            restart_phase_line();
+            continue;
+        }
+        remaining -= frames;
+        atomic_fetch_add(&frames_written, frames);
     }
 
     return 0;
 }
 
 int play_tone(float frequency) {
-    short buffer[BUFFER_LEN * channels];
+    static short buffer[BUFFER_LEN * 2];  // Left channel stays zero, only the tone is rewritten
     int err;
 
-    // Generate sine wave
-    double step = 2 * M_PI * frequency / sample_rate;
+    if (frequency != tone_engine.frequency) {
+        tone_engine_set_frequency(&tone_engine, frequency);
+        restart_phase_line();
+    }
 
-    for (int i = 0; i < BUFFER_LEN; i++) {
-        short value = (short)(32767 * sin(phase));
-        buffer[i * 2] = 0;         // Left channel silent
-        buffer[i * 2 + 1] = value; // Right channel with tone
-        phase += step;
-        if (phase >= 2 * M_PI) phase -= 2 * M_PI;
+    if (playback_info.use_mmap) {
+        return play_tone_mmap();
     }
 
-    // Write audio data
-    err = snd_pcm_writei(playback_handle, buffer, BUFFER_LEN);
-    if (err == -EPIPE) {
-        // Buffer underrun
-        fprintf(stderr, "Buffer underrun\n");
-        snd_pcm_prepare(playback_handle);
-    } else if (err < 0) {
-        fprintf(stderr, "Error writing to PCM device: %s\n", snd_strerror(err));
-        return -1;
+    // Generate sine wave into the right channel
+    tone_engine_render(&tone_engine, buffer + 1, write_frames, channels);
+
+    // Write audio data; retry after an underrun so no rendered frame is lost
+    snd_pcm_uframes_t done = 0;
+    while (done < write_frames) {
+        err = snd_pcm_writei(playback_handle, buffer + done * channels, write_frames - done);
+        if (err < 0) {
+            // Underrun or suspend: prepare again and keep writing, the stream restarts by itself
+            if (audio_stream_recover(playback_handle, err, &playback_recovery, "Playback") < 0) {
+                fprintf(stderr, "Error writing to PCM device: %s\n", snd_strerror(err));
+                return -1;
+            }
+        } else {
+            done += err;
+            atomic_fetch_add(&frames_written, err);
+        }
     }
 
     return 0;
 }
 
+/**
+ * @brief Phase of the tone at the next sample play_tone() will write.
+ *
+ * Used to align the detector reference with the emitted tone.
+ */
+double get_tone_phase(void) {
+    return tone_engine_phase(&tone_engine);
+}
+
+/**
+ * @brief Phase of the tone at a given playback frame in radians.
+ *
+ * Valid for any frame written since the last frequency change, which is
+ * what lets the capture side demodulate coherently with the emitted tone.
+ *
+ * @param frame Playback frame index counted from stream start.
+ */
+double get_tone_phase_at(uint64_t frame) {
+    uint32_t phase = (uint32_t)atomic_load(&tone_phase_origin) +
+                     (uint32_t)frame * (uint32_t)atomic_load(&tone_phase_inc);
+    return phase * (2.0 * M_PI / 4294967296.0);
+}
+
+/**
+ * @brief Number of frames handed to the playback device since it was opened.
+ */
+uint64_t get_playback_frames_written(void) {
+    return atomic_load(&frames_written);
+}
+
+/**
+ * @brief Handle of the playback stream, NULL when it is closed.
+ */
+snd_pcm_t *get_playback_handle(void) {
+    return playback_handle;
+}
+
+/**
+ * @brief Underruns and suspends the playback stream came back from.
+ */
+const AudioRecovery *get_playback_recovery(void) {
+    return &playback_recovery;
+}
+
+/**
+ * @brief Fade the probe tone to a new amplitude.
+ *
+ * The change is applied by the next play_tone() calls.
+ *
+ * @param amplitude Target amplitude, 0.0 to 1.0.
+ * @param ramp_ms Fade length in milliseconds.
+ */
+void set_tone_amplitude(float amplitude, unsigned int ramp_ms) {
+    tone_engine_set_amplitude(&tone_engine, amplitude, sample_rate * ramp_ms / 1000);
+}
+
 void cleanup_audio_playback() {
     if (playback_handle) {
+        // Fade out instead of cutting the tone mid-wave
+        set_tone_amplitude(0.0f, TONE_RAMP_MS);
+        play_tone(tone_engine.frequency);
         snd_pcm_drain(playback_handle);
         snd_pcm_close(playback_handle);
         playback_handle = NULL;
@@ -29,6 +29,9 @@ int init_touchpad_device(struct libevdev **dev, const char *device_path) {
         return 1;
     }
 
+    // Stamp events on the same clock as the audio blocks
+    libevdev_set_clock_id(*dev, CLOCK_MONOTONIC);
+
     printf("Touchpad device information:\n");
     printf("  Name: %s\n", libevdev_get_name(*dev));
     printf("  ID: bus %d, vendor 0x%x, product 0x%x, version 0x%x\n",
@@ -44,8 +47,8 @@ int init_touchpad_device(struct libevdev **dev, const char *device_path) {
  * @brief Processes touchpad events and prints coordinates.
  * 
  * This function reads events from the touchpad device and prints the X and Y coordinates
- * if the events are of type EV_ABS and have codes ABS_X or ABS_Y. The function continues
- * to read events until there are no more events to process.
+ * if the events are of type EV_ABS and have codes ABS_X or ABS_Y. When no event is
+ * pending the function sleeps in poll() instead of spinning, and it returns on a read error.
  * 
  * @param dev Pointer to the libevdev context representing the touchpad device.
  */
@@ -62,8 +65,130 @@ void process_touchpad_events(struct libevdev *dev) {
                     printf("Y: %d\n", ev.value);
                 }
             }
-        } else if (rc != -EAGAIN) {
+        } else if (rc == -EAGAIN) {
+            // Nothing pending: sleep until the device has data
+            struct pollfd pfd = { .fd = libevdev_get_fd(dev), .events = POLLIN };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                return;
+            }
+        } else {
             fprintf(stderr, "Error: %s\n", strerror(-rc));
         }
     } while (rc == 1 || rc == 0 || rc == -EAGAIN);
 }
+
+// Take position and contact state of the pen slot, if the tracker is in use
+static void frame_from_tracker(TouchFrame *frame, MtTracker *tracker) {
+    int previous = tracker->pen_slot;
+    int slot = mt_tracker_select_pen(tracker);
+
+    frame->contact = slot >= 0;
+    if (slot >= 0) {
+        MtContact *pen = &tracker->slots[slot];
+        if (pen->dirty || slot != previous) {
+            frame->x = pen->x;
+            frame->y = pen->y;
+            frame->changed |= TOUCH_FRAME_X | TOUCH_FRAME_Y;
+        }
+    }
+
+    for (int i = 0; i < tracker->num_slots; i++) {
+        tracker->slots[i].dirty = 0;
+    }
+}
+
+/**
+ * @brief Add one source event to the frame being assembled.
+ *
+ * @param frame Frame being assembled; keeps the last known position between frames.
+ * @param tracker Multi-touch tracker, or NULL to use the single-touch axes.
+ * @param ev Event from the touch device or a recording.
+ * @return int 1 if the event was the SYN_REPORT that completes the frame, 0 otherwise.
+ */
+int touch_frame_add_event(TouchFrame *frame, MtTracker *tracker, const struct input_event *ev) {
+    int use_mt = tracker && tracker->enabled;
+
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+        frame->time = ev->time;
+        if (use_mt) {
+            frame_from_tracker(frame, tracker);
+        }
+        return 1;
+    }
+
+    if (use_mt) {
+        mt_tracker_handle_event(tracker, ev);
+    } else if (ev->type == EV_ABS) {
+        if (ev->code == ABS_X) {
+            frame->x = ev->value;
+            frame->changed |= TOUCH_FRAME_X;
+        } else if (ev->code == ABS_Y) {
+            frame->y = ev->value;
+            frame->changed |= TOUCH_FRAME_Y;
+        }
+    } else if (ev->type == EV_KEY && ev->code == BTN_TOUCH) {
+        frame->contact = ev->value;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read events until one complete source frame has been assembled.
+ * 
+ * Events are accumulated in frame until the SYN_REPORT that closes it. If
+ * the kernel dropped events (SYN_DROPPED) the partial frame is discarded,
+ * libevdev replays the device state, and a frame holding the current
+ * position is returned with resynced set. The caller clears frame->changed
+ * after consuming a frame; a frame interrupted by -EAGAIN is completed by a
+ * later call.
+ * 
+ * On multi-touch devices the tracker follows every slot and the frame
+ * carries only the contact it picked as the pen; otherwise ABS_X/ABS_Y and
+ * BTN_TOUCH are used.
+ * 
+ * @param dev Pointer to the libevdev context, opened non-blocking.
+ * @param frame Frame being assembled; keeps the last known position between frames.
+ * @param tracker Multi-touch tracker, or NULL to use the single-touch axes.
+ * 
+ * @return 1 when a frame is complete, 0 when no more events are pending, negative errno on error.
+ */
+int read_touch_frame(struct libevdev *dev, TouchFrame *frame, MtTracker *tracker) {
+    struct input_event ev;
+    int rc;
+    int use_mt = tracker && tracker->enabled;
+
+    for (;;) {
+        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+
+        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+            // Let libevdev bring its state up to date; the deltas are not needed one by one
+            while ((rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev)) == LIBEVDEV_READ_STATUS_SYNC) {
+                frame->time = ev.time;
+            }
+            if (rc != -EAGAIN) {
+                return rc;
+            }
+
+            frame->resynced = 1;
+            if (use_mt) {
+                mt_tracker_resync(tracker, dev, monotonic_time_ns());
+                frame_from_tracker(frame, tracker);
+            } else {
+                frame->x = libevdev_get_event_value(dev, EV_ABS, ABS_X);
+                frame->y = libevdev_get_event_value(dev, EV_ABS, ABS_Y);
+                frame->contact = libevdev_get_event_value(dev, EV_KEY, BTN_TOUCH);
+                frame->changed = TOUCH_FRAME_X | TOUCH_FRAME_Y;
+            }
+            return 1;
+        }
+
+        if (rc < 0) {
+            return rc == -EAGAIN ? 0 : rc;
+        }
+
+        if (touch_frame_add_event(frame, tracker, &ev)) {
+            return 1;
+        }
+    }
+}
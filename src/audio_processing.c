@@ -1,3 +1,4 @@
+#include "sonarpen.h"
 #include <math.h> // For sqrt
 #include <stdint.h> // For int16_t
 
@@ -7,21 +8,318 @@ float calculate_rms(int16_t *samples, int num_samples) {
         return 0.0f; // Return 0 for invalid sample count
     }
 
-    float sum_of_squares = 0.0f;
+    // Sum of squares of samples, exact in integers
+    uint64_t sum_of_squares = dsp_sum_squares_s16(samples, (size_t)num_samples);
+
+    // Calculate RMS
+    return (float)sqrt((double)sum_of_squares / num_samples); // RMS value
+}
+
+// Chapter 2: Narrowband Tone Detection
+
+/**
+ * @brief Initialize a detector for the probe tone.
+ *
+ * @param detector Detector to initialize.
+ * @param type Detection method.
+ * @param frequency Probe tone frequency in Hz, the same value passed to play_tone().
+ * @param sample_rate Capture sample rate in Hz.
+ * @param bandwidth_hz Lock-in low-pass bandwidth in Hz (ignored by other types).
+ * @return int 0 on success, -1 if the frequency is not below Nyquist.
+ */
+int tone_detector_init(ToneDetector *detector, DetectorType type, float frequency,
+                       unsigned int sample_rate, float bandwidth_hz) {
+    if (sample_rate == 0 || frequency <= 0.0f || frequency >= sample_rate / 2.0f) {
+        fprintf(stderr, "Tone detector: %.1f Hz is not usable at %u Hz\n", frequency, sample_rate);
+        return -1;
+    }
+
+    memset(detector, 0, sizeof(*detector));
+    detector->type = type;
+    detector->frequency = frequency;
+    detector->sample_rate = sample_rate;
+
+    double w = 2.0 * M_PI * frequency / sample_rate;
+    detector->rot_cos = cos(w);
+    detector->rot_sin = sin(w);
+    detector->goertzel_coeff = 2.0 * cos(w);
+    detector->lp_alpha = 1.0 - exp(-2.0 * M_PI * bandwidth_hz / sample_rate);
+
+    // Integer reference and stage shift for the fixed-point lock-in
+    int table_size = 1 << DETECTOR_TABLE_BITS;
+    for (int i = 0; i <= table_size; i++) {
+        detector->fx_table[i] = (int16_t)lrint(32767.0 * sin(2.0 * M_PI * i / table_size));
+    }
+    detector->fx_phase_inc = (uint32_t)llround((double)frequency / sample_rate * 4294967296.0);
+    detector->fx_shift = (int)lround(-log2(detector->lp_alpha));
+    if (detector->fx_shift < 1) detector->fx_shift = 1;
+    if (detector->fx_shift > 15) detector->fx_shift = 15;
+
+    tone_detector_set_phase(detector, 0.0);
+    return 0;
+}
+
+/**
+ * @brief Align the reference oscillator with the phase of the emitted tone.
+ *
+ * The magnitude does not depend on this phase; aligning it keeps the
+ * demodulated I/Q phase constant when playback and capture share a clock.
+ *
+ * @param detector Detector to adjust.
+ * @param phase Tone phase in radians at the next captured sample.
+ */
+void tone_detector_set_phase(ToneDetector *detector, double phase) {
+    detector->ref_cos = cos(phase);
+    detector->ref_sin = sin(phase);
+
+    double turns = phase / (2.0 * M_PI);
+    detector->fx_phase = (uint32_t)(int64_t)llround((turns - floor(turns)) * 4294967296.0);
+}
+
+/**
+ * @brief Forget the filtered I/Q state, e.g. after a stream restart.
+ *
+ * @param detector Detector to reset.
+ */
+void tone_detector_reset(ToneDetector *detector) {
+    detector->i_stage = 0.0;
+    detector->q_stage = 0.0;
+    detector->i_lp = 0.0;
+    detector->q_lp = 0.0;
+    detector->fx_i_stage = 0;
+    detector->fx_q_stage = 0;
+    detector->fx_i_lp = 0;
+    detector->fx_q_lp = 0;
+    detector->level_q = 0;
+}
+
+/**
+ * @brief Tabulate the lock-in weights for blocks of a fixed length.
+ *
+ * With a cascade of two one-pole stages y = r*y + a*u, r = 1 - a, a block of
+ * N products u[n] leaves the stages at
+ *   y[N] = r^N y[0] + sum a r^(N-1-n) u[n]
+ *   z[N] = r^N z[0] + a N r^N y[0] + sum a^2 (N-n) r^(N-1-n) u[n]
+ * and u[n] = x[n] cos(phase + w n) splits into a cos and a sin term, so the
+ * tables hold both weights times cos(w n) and sin(w n).
+ *
+ * @param detector Initialized detector.
+ * @param frames Samples per block, at most DETECTOR_BLOCK_FRAMES; 0 drops the tables.
+ * @return int 0 on success, -1 if the block is too long.
+ */
+int tone_detector_set_block(ToneDetector *detector, unsigned int frames) {
+    if (frames > DETECTOR_BLOCK_FRAMES) {
+        return -1;
+    }
+
+    double w = 2.0 * M_PI * detector->frequency / detector->sample_rate;
+    double a = detector->lp_alpha;
+    double r = 1.0 - a;
+
+    for (unsigned int n = 0; n < frames; n++) {
+        double decay = pow(r, frames - 1 - n);
+        double w1 = a * decay;
+        double w2 = a * a * (frames - n) * decay;
+        detector->mix[0][n] = (float)(w1 * cos(w * n));
+        detector->mix[1][n] = (float)(w1 * sin(w * n));
+        detector->mix[2][n] = (float)(w2 * cos(w * n));
+        detector->mix[3][n] = (float)(w2 * sin(w * n));
+    }
+    detector->block_cos = cos(w * frames);
+    detector->block_sin = sin(w * frames);
+    detector->block_decay = pow(r, frames);
+    detector->mix_frames = frames;
+    return 0;
+}
+
+// Goertzel magnitude of one block, scaled to the RMS of an equivalent sine
+static float goertzel_block(const ToneDetector *detector, const int16_t *samples, int num_samples) {
+    double s1 = 0.0, s2 = 0.0;
+    double coeff = detector->goertzel_coeff;
 
-    // Sum of squares of samples
     for (int i = 0; i < num_samples; i++) {
-        sum_of_squares += samples[i] * samples[i];
+        double s0 = samples[i] + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s0;
     }
 
-    // Calculate RMS
-    return sqrt(sum_of_squares / num_samples); // RMS value
+    double power = s1 * s1 + s2 * s2 - coeff * s1 * s2;
+    if (power < 0.0) power = 0.0;
+    return (float)(M_SQRT2 * sqrt(power) / num_samples);
+}
+
+// Lock-in demodulation of a block of the tabulated length, from four weighted sums
+static void lockin_block_tabulated(ToneDetector *detector, const int16_t *samples) {
+    const float *const weights[4] = { detector->mix[0], detector->mix[1], detector->mix[2], detector->mix[3] };
+    double sums[4];
+    double c = detector->ref_cos, s = detector->ref_sin;
+    double decay = detector->block_decay;
+    unsigned int frames = detector->mix_frames;
+
+    dsp_dot4_s16(weights, samples, frames, sums);
+
+    // The second stage also sees the first stage's starting value decay through it
+    double i1 = detector->i_stage, q1 = detector->q_stage;
+    detector->i_lp = decay * (detector->i_lp + detector->lp_alpha * frames * i1) + c * sums[2] - s * sums[3];
+    detector->q_lp = decay * (detector->q_lp + detector->lp_alpha * frames * q1) + s * sums[2] + c * sums[3];
+    detector->i_stage = decay * i1 + c * sums[0] - s * sums[1];
+    detector->q_stage = decay * q1 + s * sums[0] + c * sums[1];
+
+    // Advance the reference by one block and renormalize
+    double next_c = c * detector->block_cos - s * detector->block_sin;
+    s = s * detector->block_cos + c * detector->block_sin;
+    c = next_c;
+    double norm = 1.0 / sqrt(c * c + s * s);
+    detector->ref_cos = c * norm;
+    detector->ref_sin = s * norm;
 }
 
-// Chapter 2: Additional Audio Processing Functions (if needed)
-// Placeholder for any future audio processing functions
-/*
-float another_audio_processing_function(...) {
-    // Implementation goes here
+// Lock-in demodulation of one block, scaled to the RMS of an equivalent sine
+static float lockin_block(ToneDetector *detector, const int16_t *samples, int num_samples) {
+    if (detector->mix_frames > 0 && (unsigned int)num_samples == detector->mix_frames) {
+        lockin_block_tabulated(detector, samples);
+        return (float)(M_SQRT2 * sqrt(detector->i_lp * detector->i_lp + detector->q_lp * detector->q_lp));
+    }
+
+    double c = detector->ref_cos, s = detector->ref_sin;
+    double rc = detector->rot_cos, rs = detector->rot_sin;
+    double a = detector->lp_alpha;
+    double i1 = detector->i_stage, q1 = detector->q_stage;
+    double i_lp = detector->i_lp, q_lp = detector->q_lp;
+
+    for (int n = 0; n < num_samples; n++) {
+        double x = samples[n];
+        i1 += a * (x * c - i1);
+        q1 += a * (x * s - q1);
+        i_lp += a * (i1 - i_lp);
+        q_lp += a * (q1 - q_lp);
+
+        // Advance the reference by one sample without calling sin/cos
+        double next_c = c * rc - s * rs;
+        s = s * rc + c * rs;
+        c = next_c;
+    }
+
+    // Renormalize once per block so rounding errors cannot grow
+    double norm = 1.0 / sqrt(c * c + s * s);
+    detector->ref_cos = c * norm;
+    detector->ref_sin = s * norm;
+    detector->i_stage = i1;
+    detector->q_stage = q1;
+    detector->i_lp = i_lp;
+    detector->q_lp = q_lp;
+
+    // Amplitude is 2*|IQ|; report amplitude/sqrt(2) to stay on the RMS scale
+    return (float)(M_SQRT2 * sqrt(i_lp * i_lp + q_lp * q_lp));
+}
+
+// Integer square root, rounded down
+static uint32_t isqrt64(uint64_t x) {
+    uint64_t root = 0;
+    uint64_t bit = 1ull << 62;
+
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)root;
+}
+
+// Q15 sine of a 32-bit phase, interpolated between table entries
+static inline int32_t table_sine(const int16_t *table, uint32_t phase) {
+    uint32_t index = phase >> (32 - DETECTOR_TABLE_BITS);
+    int32_t frac = (int32_t)((phase >> (16 - DETECTOR_TABLE_BITS)) & 0xFFFF);
+    int32_t a = table[index];
+    return a + (((table[index + 1] - a) * frac) >> 16);
+}
+
+// Lock-in demodulation in integers; the level is left in detector->level_q
+static int32_t lockin_block_fixed(ToneDetector *detector, const int16_t *samples, int num_samples) {
+    const int16_t *table = detector->fx_table;
+    uint32_t phase = detector->fx_phase;
+    uint32_t inc = detector->fx_phase_inc;
+    int shift = detector->fx_shift;
+    int32_t i1 = detector->fx_i_stage, q1 = detector->fx_q_stage;
+    int32_t i_lp = detector->fx_i_lp, q_lp = detector->fx_q_lp;
+
+    // Products stay below 2^30 and every stage between them, so the differences fit in int32
+    for (int n = 0; n < num_samples; n++) {
+        int32_t x = samples[n];
+        i1 += (x * table_sine(table, phase + 0x40000000u) - i1) >> shift;
+        q1 += (x * table_sine(table, phase) - q1) >> shift;
+        i_lp += (i1 - i_lp) >> shift;
+        q_lp += (q1 - q_lp) >> shift;
+        phase += inc;
+    }
+
+    detector->fx_phase = phase;
+    detector->fx_i_stage = i1;
+    detector->fx_q_stage = q1;
+    detector->fx_i_lp = i_lp;
+    detector->fx_q_lp = q_lp;
+
+    // sqrt(2) |IQ| as in lockin_block(), from Q15 to LEVEL_FRAC_BITS
+    uint64_t power = (uint64_t)((int64_t)i_lp * i_lp) + (uint64_t)((int64_t)q_lp * q_lp);
+    detector->level_q = (int32_t)(isqrt64(2 * power) >> (15 - LEVEL_FRAC_BITS));
+    return detector->level_q;
+}
+
+/**
+ * @brief Measure the probe tone level in a block of samples.
+ *
+ * All detector types return a value on the same scale as calculate_rms()
+ * for a pure tone, so the pressure mapping does not depend on the detector.
+ * DETECTOR_LOCKIN_FIXED also leaves the level in detector->level_q.
+ *
+ * @param detector Initialized detector.
+ * @param samples Mono 16-bit samples.
+ * @param num_samples Number of samples in the block.
+ * @return float Tone level, 0 for an empty block.
+ */
+float tone_detector_process(ToneDetector *detector, const int16_t *samples, int num_samples) {
+    if (num_samples <= 0) {
+        return 0.0f;
+    }
+
+    switch (detector->type) {
+    case DETECTOR_GOERTZEL:
+        return goertzel_block(detector, samples, num_samples);
+    case DETECTOR_LOCKIN:
+        return lockin_block(detector, samples, num_samples);
+    case DETECTOR_LOCKIN_FIXED:
+        return (float)lockin_block_fixed(detector, samples, num_samples) / (1 << LEVEL_FRAC_BITS);
+    case DETECTOR_RMS:
+    default:
+        return calculate_rms((int16_t *)samples, num_samples);
+    }
+}
+
+/**
+ * @brief Look up a detector by its command line name.
+ *
+ * @param name "rms", "goertzel", "lockin" or "lockin-fixed".
+ * @param type Receives the detection method.
+ * @return int 0 on success, -1 for an unknown name.
+ */
+int tone_detector_parse(const char *name, DetectorType *type) {
+    if (strcmp(name, "rms") == 0) {
+        *type = DETECTOR_RMS;
+    } else if (strcmp(name, "goertzel") == 0) {
+        *type = DETECTOR_GOERTZEL;
+    } else if (strcmp(name, "lockin") == 0) {
+        *type = DETECTOR_LOCKIN;
+    } else if (strcmp(name, "lockin-fixed") == 0) {
+        *type = DETECTOR_LOCKIN_FIXED;
+    } else {
+        return -1;
+    }
+    return 0;
 }
-*/
@@ -4,33 +4,79 @@
 #include <alsa/asoundlib.h>
 #include "sonarpen.h"
 // Global variables
+int detected_card = -1;
 int playback_device = -1;
 int capture_device = -1;
 int sonarpen_detected = 0;  // 0 = not detected, 1 = detected
+int warm_start = 0;         // 1 = the cached pair was confirmed
+DeviceCache device_cache;
 
 // Function prototypes
+int confirm_cached_pair();
 void autodetect_sonarpen();
 void manual_device_selection();
 int test_playback_capture_pair(int card, int playback_device, int capture_device);
 void list_playback_devices();
 void list_capture_devices();
 int get_user_input_for_device(const char *prompt);
-int init_audio_capture_device(AudioCapture *audio_capture, const char *device_name);
-int init_audio_playback_device(const char *device_name);
-int play_test_tone_left_channel(float frequency);
-int capture_audio_compare_channels(AudioCapture *audio_capture, float *left_amp, float *right_amp);
 
 // Main function
 int main(int argc, char *argv[]) {
-    if (argc > 1 && strcmp(argv[1], "--manual") == 0) {
+    SonarpenConfig config;
+    sonarpen_config_default(&config);
+
+    // --manual belongs to SP_detect; everything else is a driver option
+    int manual = 0, count = 0;
+    char *driver_argv[argc + 1];
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && strcmp(argv[i], "--manual") == 0) {
+            manual = 1;
+            continue;
+        }
+        driver_argv[count++] = argv[i];
+    }
+    driver_argv[count] = NULL;
+
+    int rc = sonarpen_config_parse_args(&config, count, driver_argv);
+    if (rc > 0) {
+        printf("      --manual          Pick the playback and capture devices by hand\n");
+    }
+    if (rc != 0) {
+        return rc < 0 ? 1 : 0;
+    }
+
+    device_cache_load(&device_cache);
+
+    if (manual) {
         manual_device_selection();
-    } else {
+    } else if (!confirm_cached_pair()) {
         autodetect_sonarpen();
     }
 
     if (sonarpen_detected) {
-        // Proceed with initializing touchpad and virtual HID
-        SPmouse_HID();  // Call your existing function to continue the process
+        // Proceed with initializing touchpad and virtual HID on the detected jack
+        char playback_name[32], capture_name[32];
+        snprintf(playback_name, sizeof(playback_name), "plughw:%d,%d", detected_card, playback_device);
+        snprintf(capture_name, sizeof(capture_name), "plughw:%d,%d", detected_card, capture_device);
+
+        config.audio.device = playback_name;
+        config.audio.capture_device = capture_name;
+        config.cache = &device_cache;
+        device_cache.audio_in_use = 1;
+
+        // Ask for what the card granted last time instead of negotiating from scratch,
+        // unless the stream parameters were given on the command line
+        AudioConfig defaults;
+        audio_config_default(&defaults);
+        if (warm_start && device_cache.rate && config.audio.rate == defaults.rate &&
+            config.audio.period_frames == defaults.period_frames && config.audio.periods == defaults.periods &&
+            config.audio.use_mmap == defaults.use_mmap) {
+            config.audio.rate = device_cache.rate;
+            config.audio.period_frames = device_cache.period_frames;
+            config.audio.periods = device_cache.periods;
+            config.audio.use_mmap = device_cache.use_mmap;
+        }
+        return SPmouse_HID(&config);
     } else {
         printf("Failed to detect SonarPen. Exiting.\n");
         return 1;
@@ -39,24 +85,67 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+// Remember the pair the pen was found on
+static void accept_result(const AutodetectResult *result) {
+    printf("SonarPen detected on card %d, playback device %d, capture device %d (correlation %.2f)\n",
+           result->card, result->playback_device, result->capture_device, result->correlation);
+    detected_card = result->card;
+    playback_device = result->playback_device;
+    capture_device = result->capture_device;
+    sonarpen_detected = 1;
+
+    device_cache_set_card(&device_cache, result->card);
+    device_cache.playback_device = result->playback_device;
+    device_cache.capture_device = result->capture_device;
+    device_cache.round_trip_frames = result->round_trip_frames;
+}
+
+// Warm start: check the cached pair with one short probe instead of scanning every card
+int confirm_cached_pair() {
+    AutodetectStream streams[2];
+    AutodetectResult result;
+
+    int card = device_cache_find_card(&device_cache);
+    if (card < 0) {
+        return 0;
+    }
+    printf("Confirming cached SonarPen on card %d (%s)...\n", card, device_cache.card_id);
+
+    // Listen only as long as the burst needs to come back
+    int round_trip = device_cache.round_trip_frames > 0 ? device_cache.round_trip_frames : 0;
+    unsigned int window_ms = AUTODETECT_LEAD_MS + DEVICE_CACHE_PROBE_MARGIN_MS +
+                             (unsigned int)round_trip * 1000 / DUPLEX_SAMPLE_RATE;
+    if (window_ms > AUTODETECT_WINDOW_MS) {
+        window_ms = AUTODETECT_WINDOW_MS;
+    }
+
+    int count = autodetect_add_stream(streams, 0, card, device_cache.playback_device, SND_PCM_STREAM_PLAYBACK);
+    count = autodetect_add_stream(streams, count, card, device_cache.capture_device, SND_PCM_STREAM_CAPTURE);
+    if (autodetect_run(streams, count, window_ms, &result) > 0) {
+        accept_result(&result);
+        warm_start = 1;
+    }
+    autodetect_cleanup(streams, count);
+
+    return warm_start;
+}
+
 // Autodetect SonarPen
 void autodetect_sonarpen() {
-    // Scan available sound cards and devices
+    AutodetectStream streams[AUTODETECT_MAX_STREAMS];
+    AutodetectResult result;
+
     printf("Autodetecting SonarPen...\n");
 
-    // Iterate over sound cards and devices, testing each
-    int card = -1;
-    while (snd_card_next(&card) >= 0 && card >= 0) {
-        int playback_device = -1;
-        int capture_device = -1;
-
-        printf("Testing sound card: %d\n", card);
-        if (test_playback_capture_pair(card, playback_device, capture_device)) {
-            // SonarPen detected
-            sonarpen_detected = 1;
-            break;
-        }
+    // Stream parameters of a cached card no longer apply
+    device_cache.rate = 0;
+
+    // Probe every playback/capture pair of every card at once with a quiet burst
+    int count = autodetect_enumerate(streams, AUTODETECT_MAX_STREAMS);
+    if (count > 0 && autodetect_run(streams, count, 0, &result) > 0) {
+        accept_result(&result);
     }
+    autodetect_cleanup(streams, count);
 
     // If no SonarPen detected, fallback to manual mode
     if (!sonarpen_detected) {
@@ -87,62 +176,30 @@ void manual_device_selection() {
     int capture_card = capture_input >> 16;
     int capture_device = capture_input & 0xFFFF;
 
+    // The pen sits in one jack, so both directions belong to one card
+    if (playback_card != capture_card) {
+        fprintf(stderr, "Playback and capture must be on the same card\n");
+        return;
+    }
+
     // Use the selected devices for playback and capture
     test_playback_capture_pair(playback_card, playback_device, capture_device);
 }
 
 // Test playback and capture device pair
 int test_playback_capture_pair(int card, int playback_device, int capture_device) {
-    // Initialize playback device
-    char playback_device_name[32];
-    snprintf(playback_device_name, sizeof(playback_device_name), "hw:%d,%d", card, playback_device);
+    AutodetectStream streams[2];
+    AutodetectResult result;
 
-    // Initialize capture device
-    char capture_device_name[32];
-    snprintf(capture_device_name, sizeof(capture_device_name), "hw:%d,%d", card, capture_device);
-
-    // Initialize playback
-    if (init_audio_playback_device(playback_device_name) < 0) {
-        fprintf(stderr, "Failed to initialize playback device %s\n", playback_device_name);
-        return 0;
-    }
+    int count = autodetect_add_stream(streams, 0, card, playback_device, SND_PCM_STREAM_PLAYBACK);
+    count = autodetect_add_stream(streams, count, card, capture_device, SND_PCM_STREAM_CAPTURE);
 
-    // Initialize capture
-    AudioCapture audio_capture = {0};
-    if (init_audio_capture_device(&audio_capture, capture_device_name) < 0) {
-        fprintf(stderr, "Failed to initialize capture device %s\n", capture_device_name);
-        cleanup_audio_playback();
-        return 0;
-    }
-
-    // Generate and play test tone on left channel
-    if (play_test_tone_left_channel(2000.0) < 0) {
-        fprintf(stderr, "Failed to play test tone on playback device %s\n", playback_device_name);
-        cleanup_audio_capture(&audio_capture);
-        cleanup_audio_playback();
-        return 0;
-    }
-
-    // Capture audio and compare amplitudes
-    float left_amp = 0.0f, right_amp = 0.0f;
-    if (capture_audio_compare_channels(&audio_capture, &left_amp, &right_amp) < 0) {
-        fprintf(stderr, "Failed to capture audio on capture device %s\n", capture_device_name);
-        cleanup_audio_capture(&audio_capture);
-        cleanup_audio_playback();
-        return 0;
-    }
-
-    // Analyze amplitudes
-    if (right_amp > left_amp * 2) {
-        printf("SonarPen detected on card %d, playback device %d, capture device %d\n", card, playback_device, capture_device);
-        sonarpen_detected = 1;
+    if (autodetect_run(streams, count, 0, &result) > 0) {
+        accept_result(&result);
     } else {
         printf("SonarPen not detected on card %d, playback device %d, capture device %d\n", card, playback_device, capture_device);
     }
-
-    // Cleanup
-    cleanup_audio_capture(&audio_capture);
-    cleanup_audio_playback();
+    autodetect_cleanup(streams, count);
 
     return sonarpen_detected;
 }
@@ -223,54 +280,3 @@ int get_user_input_for_device(const char *prompt) {
     scanf("%d", &device);
     return (card << 16) | device;  // Combine card and device into a single integer
 }
-
-// Initialize audio capture device
-int init_audio_capture_device(AudioCapture *audio_capture, const char *device_name) {
-    int err = snd_pcm_open(&audio_capture->handle, device_name, SND_PCM_STREAM_CAPTURE, 0);
-    if (err < 0) {
-        fprintf(stderr, "Error opening capture device: %s\n", snd_strerror(err));
-        return -1;
-    }
-    // Other initialization...
-    return 0;
-}
-
-// Initialize audio playback device
-int init_audio_playback_device(const char *device_name) {
-    int err = snd_pcm_open(&playback_handle, device_name, SND_PCM_STREAM_PLAYBACK, 0);
-    if (err < 0) {
-        fprintf(stderr, "Error opening playback device: %s\n", snd_strerror(err));
-        return -1;
-    }
-    // Other initialization...
-    return 0;
-}
-
-// Play test tone on left channel only
-int play_test_tone_left_channel(float frequency) {
-    // Implement test tone playback on left channel...
-    return 0;
-}
-
-// Capture and compare audio from left and right channels
-int capture_audio_compare_channels(AudioCapture *audio_capture, float *left_amp, float *right_amp) {
-    int err = snd_pcm_readi(audio_capture->handle, audio_capture->buffer, BUFFER_SIZE / 4);  // Divide by 4 for stereo
-    if (err < 0) {
-        fprintf(stderr, "Error capturing audio: %s\n", snd_strerror(err));
-        return -1;
-    }
-
-    int16_t *samples = (int16_t *)audio_capture->buffer;
-    int num_samples = err * 2;  // Stereo samples
-
-    float left_sum = 0.0f, right_sum = 0.0f;
-    for (int i = 0; i < num_samples; i += 2) {
-        left_sum += fabs(samples[i]);      // Left channel
-        right_sum += fabs(samples[i + 1]); // Right channel
-    }
-
-    *left_amp = left_sum / (num_samples / 2);
-    *right_amp = right_sum / (num_samples / 2);
-
-    return 0;
-}
@@ -0,0 +1,581 @@
+#include "sonarpen.h"
+#include <dirent.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* This page contains SP_bench, which measures how long touches and pressure steps take to reach the virtual tablet */
+
+#define BENCH_TABLET_NAME "Virtual Pen Tablet"
+#define BENCH_SOURCE_NAME "SonarPen Bench Touch"
+#define BENCH_SOURCE_MAX 4095           // Range of the synthetic touch source
+#define BENCH_MAX_TRIALS 1000
+#define BENCH_MAX_CONFIGS 16
+#define BENCH_MAX_ARGS 32
+#define BENCH_TONE_AMPLITUDE 16000      // Injected tone, about half of full scale
+#define BENCH_INJECT_PERIOD 128         // Frames written per injector period
+#define BENCH_STARTUP_MS 5000           // Time the driver gets to come up
+#define BENCH_RESPONSE_MS 1000          // Time one trial may take before it counts as lost
+#define BENCH_QUIET_MS 300              // Burst readback ends after this long without events
+
+// Driver configurations measured when none are given: buffer size x detector x threading
+static const char *default_configs[] = {
+    "", "-s", "-l", "-l -s",
+    "-D rms", "-D rms -s", "-l -D rms", "-l -D rms -s",
+    "-D lockin-fixed", "-l -D lockin-fixed",
+};
+
+typedef struct {
+    const char *driver;          // SP_test or a compatible executable
+    const char *device;          // ALSA device the driver uses
+    const char *inject;          // ALSA device the pressure steps are played into, NULL for none
+    int trials;                  // Trials per latency measurement
+    int burst;                   // Frames in the throughput burst
+    int verbose;                 // Show the driver's output
+    const char *configs[BENCH_MAX_CONFIGS];
+    int num_configs;
+} BenchOptions;
+
+// Latencies of one measurement, in ms
+typedef struct {
+    double ms[BENCH_MAX_TRIALS];
+    int count;
+    int lost;
+} LatencySet;
+
+typedef struct {
+    LatencySet touch;
+    LatencySet press;
+    LatencySet lift;
+    int burst_sent;
+    int burst_received;
+    double burst_fps;
+    int failed;
+} BenchResult;
+
+// Plays the probe tone into the loopback and records when each on/off step becomes audible
+typedef struct {
+    snd_pcm_t *pcm;
+    pthread_t thread;
+    atomic_int running;
+    atomic_int tone_on;          // Requested state
+    atomic_uint steps;           // Steps applied so far
+    _Atomic uint64_t step_ns;    // When the last step reaches the loopback
+} ToneInjector;
+
+// Injector thread: keeps the playback buffer filled with tone or silence
+static void *injector_main(void *arg) {
+    ToneInjector *inj = (ToneInjector *)arg;
+    int16_t period[BENCH_INJECT_PERIOD];
+    double phase = 0.0;
+    double step = 2.0 * M_PI * PROBE_TONE_FREQUENCY / DUPLEX_SAMPLE_RATE;
+    int playing = 0;
+
+    while (atomic_load(&inj->running)) {
+        int want = atomic_load(&inj->tone_on);
+        if (want != playing) {
+            // The first frame of this period plays after everything already queued
+            snd_pcm_sframes_t delay = 0;
+            if (snd_pcm_delay(inj->pcm, &delay) < 0 || delay < 0) {
+                delay = 0;
+            }
+            atomic_store(&inj->step_ns, monotonic_time_ns() + (uint64_t)delay * 1000000000ull / DUPLEX_SAMPLE_RATE);
+            atomic_fetch_add(&inj->steps, 1);
+            playing = want;
+        }
+
+        for (int i = 0; i < BENCH_INJECT_PERIOD; i++) {
+            period[i] = playing ? (int16_t)(BENCH_TONE_AMPLITUDE * sin(phase)) : 0;
+            phase += step;
+        }
+        phase = fmod(phase, 2.0 * M_PI);
+
+        snd_pcm_sframes_t n = snd_pcm_writei(inj->pcm, period, BENCH_INJECT_PERIOD);
+        if (n < 0 && snd_pcm_recover(inj->pcm, (int)n, 1) < 0) {
+            fprintf(stderr, "Injector: %s\n", snd_strerror((int)n));
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int injector_start(ToneInjector *inj, const char *device) {
+    int err;
+
+    memset(inj, 0, sizeof(*inj));
+    if ((err = snd_pcm_open(&inj->pcm, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        fprintf(stderr, "Cannot open %s for pressure steps: %s\n", device, snd_strerror(err));
+        return -1;
+    }
+    // Mono at the duplex rate, so the driver's capture end of the loopback can match it
+    if ((err = snd_pcm_set_params(inj->pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1,
+                                  DUPLEX_SAMPLE_RATE, 0, 10000)) < 0) {
+        fprintf(stderr, "Cannot configure %s: %s\n", device, snd_strerror(err));
+        snd_pcm_close(inj->pcm);
+        return -1;
+    }
+
+    atomic_init(&inj->running, 1);
+    if ((err = pthread_create(&inj->thread, NULL, injector_main, inj)) != 0) {
+        fprintf(stderr, "Cannot start injector: %s\n", strerror(err));
+        snd_pcm_close(inj->pcm);
+        return -1;
+    }
+    return 0;
+}
+
+static void injector_stop(ToneInjector *inj) {
+    atomic_store(&inj->running, 0);
+    pthread_join(inj->thread, NULL);
+    snd_pcm_close(inj->pcm);
+}
+
+// Switch the tone and return the time the step becomes audible
+static uint64_t injector_step(ToneInjector *inj, int on) {
+    unsigned int before = atomic_load(&inj->steps);
+
+    atomic_store(&inj->tone_on, on);
+    while (atomic_load(&inj->steps) == before) {
+        usleep(200);
+    }
+    return atomic_load(&inj->step_ns);
+}
+
+// Create the synthetic multi-touch screen the driver reads from
+static int create_source_device(char *path, size_t len) {
+    struct uinput_setup setup;
+    struct uinput_abs_setup abs;
+    static const int axes[] = { ABS_X, ABS_Y, ABS_MT_POSITION_X, ABS_MT_POSITION_Y };
+    char sysname[64];
+
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror("Opening uinput device");
+        return -1;
+    }
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH);
+    ioctl(fd, UI_SET_EVBIT, EV_ABS);
+    ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+
+    for (size_t i = 0; i < sizeof(axes) / sizeof(axes[0]); i++) {
+        memset(&abs, 0, sizeof(abs));
+        abs.code = axes[i];
+        abs.absinfo.maximum = BENCH_SOURCE_MAX;
+        abs.absinfo.resolution = 16;
+        ioctl(fd, UI_SET_ABSBIT, axes[i]);
+        ioctl(fd, UI_ABS_SETUP, &abs);
+    }
+    memset(&abs, 0, sizeof(abs));
+    abs.code = ABS_MT_SLOT;
+    abs.absinfo.maximum = 1;
+    ioctl(fd, UI_SET_ABSBIT, ABS_MT_SLOT);
+    ioctl(fd, UI_ABS_SETUP, &abs);
+    abs.code = ABS_MT_TRACKING_ID;
+    abs.absinfo.maximum = 65535;
+    ioctl(fd, UI_SET_ABSBIT, ABS_MT_TRACKING_ID);
+    ioctl(fd, UI_ABS_SETUP, &abs);
+
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    snprintf(setup.name, sizeof(setup.name), "%s", BENCH_SOURCE_NAME);
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0 ||
+        ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+        perror("Creating the touch source");
+        close(fd);
+        return -1;
+    }
+
+    // The event node sits next to the input device in sysfs
+    char dir_path[128];
+    snprintf(dir_path, sizeof(dir_path), "/sys/devices/virtual/input/%s", sysname);
+    for (int attempt = 0; attempt < 100; attempt++) {
+        DIR *dir = opendir(dir_path);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "event", 5) == 0) {
+                snprintf(path, len, "/dev/input/%s", entry->d_name);
+                closedir(dir);
+                if (access(path, R_OK) == 0) {
+                    return fd;
+                }
+                dir = NULL;
+            }
+        }
+        if (dir) closedir(dir);
+        usleep(10000);
+    }
+
+    fprintf(stderr, "The touch source has no event node\n");
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+    return -1;
+}
+
+// Send one source frame; returns the time it was written
+static uint64_t write_touch(int fd, int down, int x, int y) {
+    struct input_event ev[8];
+    int n = 0;
+
+    memset(ev, 0, sizeof(ev));
+    ev[n].type = EV_ABS; ev[n].code = ABS_MT_SLOT; ev[n++].value = 0;
+    ev[n].type = EV_ABS; ev[n].code = ABS_MT_TRACKING_ID; ev[n++].value = down ? 1 : -1;
+    if (down) {
+        ev[n].type = EV_ABS; ev[n].code = ABS_MT_POSITION_X; ev[n++].value = x;
+        ev[n].type = EV_ABS; ev[n].code = ABS_MT_POSITION_Y; ev[n++].value = y;
+        ev[n].type = EV_ABS; ev[n].code = ABS_X; ev[n++].value = x;
+        ev[n].type = EV_ABS; ev[n].code = ABS_Y; ev[n++].value = y;
+    }
+    ev[n].type = EV_KEY; ev[n].code = BTN_TOUCH; ev[n++].value = down;
+    ev[n].type = EV_SYN; ev[n].code = SYN_REPORT; ev[n++].value = 0;
+
+    uint64_t now = monotonic_time_ns();
+    if (write(fd, ev, n * sizeof(ev[0])) < 0) {
+        perror("write_touch");
+    }
+    return now;
+}
+
+// Open the tablet the driver created, waiting for it to appear
+static int open_tablet(int timeout_ms) {
+    for (int waited = 0; waited < timeout_ms; waited += 50) {
+        DIR *dir = opendir("/dev/input");
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            char path[300], name[256] = "";
+            if (strncmp(entry->d_name, "event", 5) != 0) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+            int fd = open(path, O_RDONLY | O_NONBLOCK);
+            if (fd < 0) {
+                continue;
+            }
+            if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0 && strcmp(name, BENCH_TABLET_NAME) == 0) {
+                closedir(dir);
+                return fd;
+            }
+            close(fd);
+        }
+        if (dir) closedir(dir);
+        usleep(50000);
+    }
+    return -1;
+}
+
+// Discard tablet events that are already queued
+static void drain_tablet(int fd) {
+    struct input_event ev[64];
+    while (read(fd, ev, sizeof(ev)) > 0) {
+    }
+}
+
+// Wait for a tablet event with the given type and code (and value, unless negative); returns its arrival time
+static uint64_t wait_tablet(int fd, int type, int code, int value, int timeout_ms) {
+    uint64_t deadline = monotonic_time_ns() + (uint64_t)timeout_ms * 1000000ull;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct input_event ev[64];
+
+    for (;;) {
+        uint64_t now = monotonic_time_ns();
+        if (now >= deadline) {
+            return 0;
+        }
+        if (poll(&pfd, 1, (int)((deadline - now) / 1000000ull) + 1) <= 0) {
+            continue;
+        }
+        uint64_t arrival = monotonic_time_ns();
+        ssize_t n = read(fd, ev, sizeof(ev));
+        for (ssize_t i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+            if (ev[i].type == type && ev[i].code == code && (value < 0 || ev[i].value == value)) {
+                return arrival;
+            }
+        }
+    }
+}
+
+static void latency_add(LatencySet *set, uint64_t start_ns, uint64_t end_ns) {
+    if (end_ns == 0) {
+        set->lost++;
+    } else if (set->count < BENCH_MAX_TRIALS) {
+        set->ms[set->count++] = end_ns > start_ns ? (end_ns - start_ns) / 1e6 : 0.0;
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted set
+static double percentile(const LatencySet *set, double p) {
+    int rank = (int)ceil(p * set->count);
+    return set->ms[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_latency(LatencySet *set) {
+    if (set->count == 0) {
+        printf(" %20s |", "-");
+        return;
+    }
+    qsort(set->ms, (size_t)set->count, sizeof(double), compare_double);
+    printf(" %6.2f %6.2f %6.2f", percentile(set, 0.5), percentile(set, 0.99), set->ms[set->count - 1]);
+    printf(set->lost ? "*|" : " |");
+}
+
+// Start the driver on the source device with one configuration
+static pid_t launch_driver(const BenchOptions *opt, const char *source, const char *config, const char *cache_dir) {
+    char args[256];
+    char *argv[BENCH_MAX_ARGS];
+    int argc = 0;
+
+    snprintf(args, sizeof(args), "%s", config);
+    argv[argc++] = (char *)opt->driver;
+    argv[argc++] = "-d";
+    argv[argc++] = (char *)opt->device;
+    argv[argc++] = "-i";
+    argv[argc++] = (char *)source;
+    for (char *tok = strtok(args, " "); tok && argc < BENCH_MAX_ARGS - 1; tok = strtok(NULL, " ")) {
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Keep the user's device cache out of it
+        setenv("XDG_CACHE_HOME", cache_dir, 1);
+        if (!opt->verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(opt->driver, argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop_driver(pid_t pid) {
+    int status;
+
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 300; i++) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+}
+
+// Touch to tablet: with the pen hovering, how long a new position takes to come out
+static void measure_touch(int source, int tablet, int trials, LatencySet *set) {
+    for (int i = 0; i < trials; i++) {
+        drain_tablet(tablet);
+        uint64_t sent = write_touch(source, 1, 1000 + i % 1000, 2000);
+        latency_add(set, sent, wait_tablet(tablet, EV_ABS, ABS_X, -1, BENCH_RESPONSE_MS));
+        usleep(2000 + rand() % 3000);
+    }
+}
+
+// Pressure step to tablet: tone on until BTN_TOUCH goes down, tone off until it comes up
+static void measure_pressure(ToneInjector *inj, int tablet, int trials, LatencySet *press, LatencySet *lift) {
+    for (int i = 0; i < trials; i++) {
+        drain_tablet(tablet);
+        uint64_t step = injector_step(inj, 1);
+        latency_add(press, step, wait_tablet(tablet, EV_KEY, BTN_TOUCH, 1, BENCH_RESPONSE_MS));
+
+        step = injector_step(inj, 0);
+        latency_add(lift, step, wait_tablet(tablet, EV_KEY, BTN_TOUCH, 0, BENCH_RESPONSE_MS));
+
+        // Random spacing, so steps land at every phase of the capture blocks
+        usleep(20000 + rand() % 30000);
+    }
+}
+
+// Throughput: write a burst of frames back to back and count the positions that come out
+static void measure_burst(int source, int tablet, int burst, BenchResult *res) {
+    struct input_event ev[64];
+    struct pollfd pfd = { .fd = tablet, .events = POLLIN };
+    uint64_t last = 0;
+    int received = 0;
+
+    drain_tablet(tablet);
+    uint64_t start = monotonic_time_ns();
+    for (int i = 0; i < burst; i++) {
+        write_touch(source, 1, 500 + (i & 1) * 8, 2000);
+    }
+
+    while (poll(&pfd, 1, BENCH_QUIET_MS) > 0) {
+        ssize_t n = read(tablet, ev, sizeof(ev));
+        for (ssize_t i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+            if (ev[i].type == EV_ABS && ev[i].code == ABS_X) {
+                received++;
+                last = monotonic_time_ns();
+            }
+        }
+    }
+
+    res->burst_sent = burst;
+    res->burst_received = received;
+    res->burst_fps = last > start ? received / ((last - start) / 1e9) : 0.0;
+}
+
+// Run every measurement against one driver configuration
+static void run_config(const BenchOptions *opt, ToneInjector *inj, const char *config, const char *cache_dir,
+                       BenchResult *res) {
+    char source_path[64];
+    memset(res, 0, sizeof(*res));
+    res->failed = 1;
+
+    int source = create_source_device(source_path, sizeof(source_path));
+    if (source < 0) {
+        return;
+    }
+
+    pid_t driver = launch_driver(opt, source_path, config, cache_dir);
+    int tablet = driver > 0 ? open_tablet(BENCH_STARTUP_MS) : -1;
+    if (tablet < 0) {
+        fprintf(stderr, "[%s] the driver did not create its tablet\n", config);
+    } else {
+        // Ready once a held touch comes out as a hovering pen
+        uint64_t ready = 0;
+        for (int waited = 0; waited < BENCH_STARTUP_MS && !ready; waited += 100) {
+            write_touch(source, 1, 100 + waited % 2, 2000);
+            ready = wait_tablet(tablet, EV_ABS, ABS_X, -1, 100);
+        }
+
+        if (!ready) {
+            fprintf(stderr, "[%s] the driver does not forward touches\n", config);
+        } else {
+            measure_touch(source, tablet, opt->trials, &res->touch);
+            if (inj) {
+                measure_pressure(inj, tablet, opt->trials, &res->press, &res->lift);
+            }
+            measure_burst(source, tablet, opt->burst, res);
+            res->failed = 0;
+        }
+        write_touch(source, 0, 0, 0);
+        close(tablet);
+    }
+
+    if (driver > 0) {
+        stop_driver(driver);
+    }
+    ioctl(source, UI_DEV_DESTROY);
+    close(source);
+}
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -x, --driver PATH      Driver to measure (default ./SP_test)\n");
+    printf("  -d, --device NAME      ALSA device of the driver (default hw:Loopback,0,0)\n");
+    printf("  -j, --inject NAME      ALSA device pressure steps are played into (default hw:Loopback,1,0),\n");
+    printf("                         \"none\" to measure touches only\n");
+    printf("  -n, --trials N         Trials per latency measurement (default 100, at most %d)\n", BENCH_MAX_TRIALS);
+    printf("  -b, --burst N          Frames in the throughput burst (default 2000)\n");
+    printf("  -c, --config \"ARGS\"    Driver options to measure; repeat for several (default: a matrix of\n");
+    printf("                         buffer size, detector and threading mode)\n");
+    printf("  -v, --verbose          Show the driver's output\n");
+    printf("  -h, --help             Show this help\n");
+    printf("\nThe pressure path needs the ALSA loopback: modprobe snd-aloop. Without it, use e.g.\n");
+    printf("-d null -j none to measure touch forwarding only.\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "driver",  required_argument, NULL, 'x' },
+        { "device",  required_argument, NULL, 'd' },
+        { "inject",  required_argument, NULL, 'j' },
+        { "trials",  required_argument, NULL, 'n' },
+        { "burst",   required_argument, NULL, 'b' },
+        { "config",  required_argument, NULL, 'c' },
+        { "verbose", no_argument,       NULL, 'v' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    BenchOptions opt = {
+        .driver = "./SP_test",
+        .device = "hw:Loopback,0,0",
+        .inject = "hw:Loopback,1,0",
+        .trials = 100,
+        .burst = 2000,
+    };
+    ToneInjector injector;
+    int have_injector = 0;
+    int opt_char;
+
+    while ((opt_char = getopt_long(argc, argv, "x:d:j:n:b:c:vh", long_options, NULL)) != -1) {
+        switch (opt_char) {
+        case 'x': opt.driver = optarg; break;
+        case 'd': opt.device = optarg; break;
+        case 'j': opt.inject = strcmp(optarg, "none") == 0 ? NULL : optarg; break;
+        case 'n': opt.trials = atoi(optarg); break;
+        case 'b': opt.burst = atoi(optarg); break;
+        case 'c':
+            if (opt.num_configs < BENCH_MAX_CONFIGS) {
+                opt.configs[opt.num_configs++] = optarg;
+            }
+            break;
+        case 'v': opt.verbose = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (opt.trials < 1 || opt.trials > BENCH_MAX_TRIALS || opt.burst < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.num_configs == 0) {
+        for (size_t i = 0; i < sizeof(default_configs) / sizeof(default_configs[0]); i++) {
+            opt.configs[opt.num_configs++] = default_configs[i];
+        }
+    }
+
+    // The injector holds the loopback open, so the driver's capture end takes its rate and channels
+    if (opt.inject) {
+        have_injector = injector_start(&injector, opt.inject) == 0;
+        if (!have_injector) {
+            fprintf(stderr, "Measuring touch forwarding only\n");
+        }
+    }
+
+    char cache_dir[] = "/tmp/sonarpen-bench.XXXXXX";
+    if (mkdtemp(cache_dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    srand((unsigned int)monotonic_time_ns());
+
+    printf("%-22s | %-20s | %-20s | %-20s | %s\n", "Driver options",
+           "touch p50/p99/max", "press p50/p99/max", "lift p50/p99/max", "burst frames/s");
+    for (int i = 0; i < opt.num_configs; i++) {
+        BenchResult res;
+        run_config(&opt, have_injector ? &injector : NULL, opt.configs[i], cache_dir, &res);
+
+        printf("%-22s |", opt.configs[i][0] ? opt.configs[i] : "(defaults)");
+        if (res.failed) {
+            printf(" failed\n");
+            continue;
+        }
+        print_latency(&res.touch);
+        print_latency(&res.press);
+        print_latency(&res.lift);
+        printf(" %8.0f (%d/%d)\n", res.burst_fps, res.burst_received, res.burst_sent);
+        fflush(stdout);
+    }
+    printf("Latencies in ms; * marks measurements with trials lost after %d ms.\n", BENCH_RESPONSE_MS);
+
+    if (have_injector) {
+        injector_stop(&injector);
+    }
+    char cache_file[128];
+    snprintf(cache_file, sizeof(cache_file), "%s/sonarpen/devices", cache_dir);
+    unlink(cache_file);
+    snprintf(cache_file, sizeof(cache_file), "%s/sonarpen", cache_dir);
+    rmdir(cache_file);
+    rmdir(cache_dir);
+    return 0;
+}
@@ -14,6 +14,7 @@
 
 // Function declarations
 int init_audio_capture(AudioCapture *audio_capture);
+int init_audio_capture_config(AudioCapture *audio_capture, const AudioConfig *config);
 float capture_audio(AudioCapture *audio_capture);
 void cleanup_audio_capture(AudioCapture *audio_capture);
 
@@ -27,8 +28,29 @@ void cleanup_audio_capture(AudioCapture *audio_capture);
  * @return int 0 on success, -1 on failure.
  */
 int init_audio_capture(AudioCapture *audio_capture) {
+    return init_audio_capture_config(audio_capture, NULL);
+}
+
+/**
+ * @brief Initialize audio capture with explicit stream parameters.
+ * 
+ * Same as init_audio_capture(), but negotiates the rate, period, buffer and
+ * access type from the given configuration. The negotiated values are stored
+ * in audio_capture->info and one capture block is sized to one period.
+ * 
+ * @param audio_capture Pointer to the AudioCapture structure.
+ * @param config Requested parameters, or NULL for the device defaults.
+ * @return int 0 on success, -1 on failure.
+ */
+int init_audio_capture_config(AudioCapture *audio_capture, const AudioConfig *config) {
+    AudioConfig defaults;
     int err;
 
+    if (config == NULL) {
+        audio_config_default(&defaults);
+        config = &defaults;
+    }
+
     // Allocate memory for the audio buffer
     audio_capture->buffer = (char *)malloc(BUFFER_SIZE);
     if (audio_capture->buffer == NULL) {
@@ -37,50 +59,148 @@ int init_audio_capture(AudioCapture *audio_capture) {
     }
 
     // Open the PCM device for recording (input)
-    if ((err = snd_pcm_open(&audio_capture->handle, PCM_DEVICE, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+    const char *device = config->capture_device ? config->capture_device : config->device;
+    if ((err = snd_pcm_open(&audio_capture->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
         fprintf(stderr, "Unable to open PCM device: %s\n", snd_strerror(err));
         free(audio_capture->buffer);
         return -1;
     }
 
-    // Allocate hardware parameters
-    snd_pcm_hw_params_alloca(&audio_capture->params);
-    snd_pcm_hw_params_any(audio_capture->handle, audio_capture->params);
-
-    // Set the desired hardware parameters
-    snd_pcm_hw_params_set_access(audio_capture->handle, audio_capture->params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(audio_capture->handle, audio_capture->params, SND_PCM_FORMAT_S16_LE);
-    unsigned int rate = 44100;
-    snd_pcm_hw_params_set_rate_near(audio_capture->handle, audio_capture->params, &rate, 0);
-    snd_pcm_hw_params_set_channels(audio_capture->handle, audio_capture->params, 1);
-
-    // Apply the hardware parameters to the PCM device
-    if ((err = snd_pcm_hw_params(audio_capture->handle, audio_capture->params)) < 0) {
-        fprintf(stderr, "Unable to set HW parameters: %s\n", snd_strerror(err));
+    // Apply the hardware and software parameters to the PCM device
+    if (configure_pcm_stream(audio_capture->handle, config, 1, 44100, &audio_capture->info) < 0) {
         snd_pcm_close(audio_capture->handle);
         free(audio_capture->buffer);
         return -1;
     }
 
+    // One block per period when the period was chosen explicitly, as many frames as the buffer holds
+    unsigned int max_frames = BUFFER_SIZE / (2 * audio_capture->info.channels);
+    audio_capture->frames_read = 0;
+    audio_capture->block_frames = max_frames;
+    if (config->period_frames > 0 && audio_capture->info.period_frames < max_frames) {
+        audio_capture->block_frames = audio_capture->info.period_frames;
+    }
+
     return 0;
 }
 
+// Level of one run of samples, using the detector when one is attached
+static float measure_samples(AudioCapture *audio_capture, int16_t *samples, int num_samples) {
+    // Devices without a mono mode deliver interleaved frames; the mic is on the first channel
+    if (audio_capture->info.channels > 1) {
+        int16_t *mono = (int16_t *)audio_capture->buffer;
+        dsp_deinterleave_s16(samples, audio_capture->info.channels, 0, mono, (size_t)num_samples);
+        samples = mono;
+    }
+
+    if (audio_capture->detector) {
+        uint64_t start = monotonic_time_ns();
+        float level = tone_detector_process(audio_capture->detector, samples, num_samples);
+        metrics_record(METRIC_DETECTOR_TIME, monotonic_time_ns() - start);
+        return level;
+    }
+
+    // Calculate RMS using the existing function
+    return calculate_rms(samples, num_samples); // Return the RMS value as the volume
+}
+
+// Restart the stream after an xrun or suspend; the detector state belongs to the lost samples
+static float recover_capture(AudioCapture *audio_capture, int err) {
+    if (audio_stream_recover(audio_capture->handle, err, &audio_capture->recovery, "Capture") < 0) {
+        fprintf(stderr, "Error capturing audio: %s\n", snd_strerror(err));
+        return -1.0f;
+    }
+    if (audio_capture->detector) {
+        tone_detector_reset(audio_capture->detector);
+    }
+    return CAPTURE_RECOVERED;
+}
+
+/**
+ * @brief Capture one block directly from the mmap ring buffer.
+ * 
+ * Samples are measured in place, without copying them into
+ * audio_capture->buffer. A block that wraps around the end of the ring is
+ * measured in two runs. After an xrun the block is abandoned.
+ */
+static float capture_audio_mmap(AudioCapture *audio_capture) {
+    snd_pcm_t *handle = audio_capture->handle;
+    snd_pcm_uframes_t remaining = audio_capture->block_frames;
+    double power_sum = 0.0;
+    float level = 0.0f;
+    int err;
+
+    if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED && !audio_capture->start_with_playback) {
+        if ((err = snd_pcm_start(handle)) < 0) {
+            fprintf(stderr, "Error starting capture: %s\n", snd_strerror(err));
+            return -1.0f;
+        }
+    }
+
+    while (remaining > 0) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+        if (avail < 0) {
+            return recover_capture(audio_capture, (int)avail);
+        }
+        if ((snd_pcm_uframes_t)avail < remaining) {
+            if ((err = snd_pcm_wait(handle, 1000)) < 0) {
+                return recover_capture(audio_capture, err);
+            }
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset, frames = remaining;
+        if ((err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames)) < 0) {
+            return recover_capture(audio_capture, err);
+        }
+
+        int16_t *samples = (int16_t *)((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8);
+        level = measure_samples(audio_capture, samples, (int)frames);
+        power_sum += (double)level * level * frames;
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(handle, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+            return recover_capture(audio_capture, committed < 0 ? (int)committed : -EPIPE);
+        }
+        remaining -= frames;
+        audio_capture->frames_read += frames;
+    }
+
+    // The lock-in output already spans both runs; block detectors are power-averaged
+    if (audio_capture->detector && (audio_capture->detector->type == DETECTOR_LOCKIN ||
+                                    audio_capture->detector->type == DETECTOR_LOCKIN_FIXED)) {
+        return level;
+    }
+    return (float)sqrt(power_sum / audio_capture->block_frames);
+}
+
 /**
  * @brief Capture audio from the PCM device.
  * 
  * This function reads audio data from the PCM device into the buffer,
- * processes the samples, and calculates the RMS value of the captured audio.
+ * processes the samples, and measures the level of the captured audio. When a
+ * ToneDetector is attached only the probe tone is measured, otherwise the
+ * broadband RMS is used. Streams opened with mmap access are processed in place.
+ * 
+ * Overruns and suspends do not end the capture: the stream is recovered,
+ * the detector is reset and CAPTURE_RECOVERED is returned instead of a level.
  * 
  * @param audio_capture Pointer to the AudioCapture structure.
- * @return float RMS value of the captured audio, or -1.0 on error.
+ * @return float Level of the captured audio, CAPTURE_RECOVERED after a restart, or -1.0 on error.
  */
 float capture_audio(AudioCapture *audio_capture) {
-    int err = snd_pcm_readi(audio_capture->handle, audio_capture->buffer, BUFFER_SIZE / 2);
+    if (audio_capture->info.use_mmap) {
+        return capture_audio_mmap(audio_capture);
+    }
+
+    int err = snd_pcm_readi(audio_capture->handle, audio_capture->buffer, audio_capture->block_frames);
     if (err < 0) {
-        fprintf(stderr, "Error capturing audio: %s\n", snd_strerror(err));
-        return -1.0f; // Return -1.0 on error
+        return recover_capture(audio_capture, err);
     }
 
+    audio_capture->frames_read += err;
+
     // Cast buffer to int16_t pointer
     int16_t *samples = (int16_t *)audio_capture->buffer;
 
@@ -92,8 +212,7 @@ float capture_audio(AudioCapture *audio_capture) {
     printf("\n");
     fflush(stdout); // Flush output to ensure it appears immediately
 */
-    // Calculate RMS using the existing function
-    return calculate_rms(samples, err); // Return the RMS value as the volume
+    return measure_samples(audio_capture, samples, err);
 }
 
 /**
@@ -0,0 +1,128 @@
+#include "sonarpen.h"
+#include <getopt.h>
+
+/* This page contains the command line of SP_replay, which runs recorded sessions through the driver offline */
+
+static void usage(const char *program) {
+    printf("Usage: %s -e EVENTS -o OUTPUT [options]\n", program);
+    printf("       %s -D OUTPUT\n", program);
+    printf("  -e, --events FILE        Touch device recording made with evemu-record\n");
+    printf("  -w, --wav FILE           Mic recording, 16-bit PCM (default: no pressure)\n");
+    printf("  -o, --output FILE        Write the virtual tablet events here\n");
+    printf("  -d, --delay MS           Start of the WAV after the first touch event (default 0)\n");
+    printf("  -c, --levels N,H,L,F     Pressure calibration: noise floor, hover, light and full levels\n");
+    printf("  -f, --filter NAME        Pressure smoothing: none, euro or kalman (default euro)\n");
+    printf("  -x, --detector NAME      Tone level measurement: rms, goertzel, lockin or lockin-fixed (default lockin)\n");
+    printf("  -b, --block FRAMES       Frames per detector block, as the capture period of the recorded run\n");
+    printf("                           (default and maximum %d)\n", DETECTOR_BLOCK_FRAMES);
+    printf("  -r, --rotate DEG         Rotate positions clockwise by 0, 90, 180 or 270 degrees\n");
+    printf("  -R, --region X,Y,W,H     Use only this part of the touch surface\n");
+    printf("  -a, --area X,Y,W,H       Map onto this part of the tablet\n");
+    printf("  -D, --dump FILE          Print an output file as evemu events and exit\n");
+    printf("  -h, --help               Show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "events",  required_argument, NULL, 'e' },
+        { "wav",     required_argument, NULL, 'w' },
+        { "output",  required_argument, NULL, 'o' },
+        { "delay",   required_argument, NULL, 'd' },
+        { "levels",  required_argument, NULL, 'c' },
+        { "filter",  required_argument, NULL, 'f' },
+        { "detector", required_argument, NULL, 'x' },
+        { "block",   required_argument, NULL, 'b' },
+        { "rotate",  required_argument, NULL, 'r' },
+        { "region",  required_argument, NULL, 'R' },
+        { "area",    required_argument, NULL, 'a' },
+        { "dump",    required_argument, NULL, 'D' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    ReplayConfig config;
+    ReplayStats stats;
+    int opt;
+
+    replay_config_default(&config);
+
+    while ((opt = getopt_long(argc, argv, "e:w:o:d:c:f:x:b:r:R:a:D:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'e':
+            config.events_path = optarg;
+            break;
+        case 'w':
+            config.wav_path = optarg;
+            break;
+        case 'o':
+            config.output_path = optarg;
+            break;
+        case 'd':
+            config.audio_offset_ms = strtod(optarg, NULL);
+            break;
+        case 'c': {
+            PressureCalibration *cal = &config.calibration;
+            if (sscanf(optarg, "%f,%f,%f,%f", &cal->noise_floor, &cal->hover, &cal->light, &cal->full) != 4) {
+                fprintf(stderr, "Invalid levels: %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+            if (pressure_filter_parse(optarg, &config.pressure_filter) < 0) {
+                fprintf(stderr, "Unknown filter: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'x':
+            if (tone_detector_parse(optarg, &config.detector) < 0) {
+                fprintf(stderr, "Unknown detector: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            config.block_frames = (unsigned int)strtoul(optarg, NULL, 10);
+            if (config.block_frames == 0 || config.block_frames > DETECTOR_BLOCK_FRAMES) {
+                fprintf(stderr, "Block length must be 1..%d frames: %s\n", DETECTOR_BLOCK_FRAMES, optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            config.mapping.rotation = atoi(optarg);
+            if (config.mapping.rotation % 90 != 0 || config.mapping.rotation < 0 || config.mapping.rotation > 270) {
+                fprintf(stderr, "Rotation must be 0, 90, 180 or 270: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+        case 'a':
+            if (coord_mapping_parse_rect(optarg, opt == 'R' ? config.mapping.region : config.mapping.area) < 0) {
+                fprintf(stderr, "Invalid rectangle: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            return replay_dump(optarg, stdout) < 0 ? 1 : 0;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.events_path == NULL || config.output_path == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (replay_run(&config, &stats) < 0) {
+        return 1;
+    }
+
+    printf("Replayed %.1f ms: %lu audio blocks, %lu touch events -> %lu tablet events\n",
+           stats.recording_ms, stats.audio_blocks, stats.touch_events, stats.output_events);
+    printf("Processing took %.1f ms (%.0fx real time)\n", stats.processing_ms,
+           stats.processing_ms > 0 ? stats.recording_ms / stats.processing_ms : 0.0);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "sonarpen.h"
+#include <getopt.h>
+#include <time.h>
+
+/* This page contains sonarpen-stat, which prints the metrics a running driver publishes */
+
+// Plain copy of the page, so intervals can be computed from two readings
+typedef struct {
+    uint64_t taken_ns;
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    int64_t gauges[METRIC_GAUGE_COUNT];
+    uint64_t count[METRIC_HISTOGRAM_COUNT];
+    uint64_t sum_ns[METRIC_HISTOGRAM_COUNT];
+    uint64_t max_ns[METRIC_HISTOGRAM_COUNT];
+    uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+} MetricsSnapshot;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void take_snapshot(const SonarpenMetrics *page, MetricsSnapshot *snap) {
+    snap->taken_ns = now_ns();
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        snap->counters[i] = atomic_load_explicit(&page->counters[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        snap->gauges[i] = atomic_load_explicit(&page->gauges[i], memory_order_relaxed);
+    }
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        const MetricsHistogram *hist = &page->histograms[h];
+        snap->count[h] = atomic_load_explicit(&hist->count, memory_order_relaxed);
+        snap->sum_ns[h] = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+        snap->max_ns[h] = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+            snap->buckets[h][b] = atomic_load_explicit(&hist->buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+// Upper bound in us of the bucket holding the given share of the samples
+static double bucket_percentile(const uint64_t *buckets, uint64_t total, double p) {
+    uint64_t wanted = (uint64_t)ceil(p * total);
+    uint64_t seen = 0;
+
+    for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= wanted) {
+            return (double)(1ull << b);
+        }
+    }
+    return (double)(1ull << (METRICS_HISTOGRAM_BUCKETS - 1));
+}
+
+// Print the totals, or with a previous reading, what happened since
+static void print_snapshot(const SonarpenMetrics *page, const MetricsSnapshot *cur, const MetricsSnapshot *prev) {
+    double seconds = prev ? (cur->taken_ns - prev->taken_ns) / 1e9 : (cur->taken_ns - page->started_ns) / 1e9;
+
+    printf("SonarPen driver %lld, up %.1f s%s\n", (long long)page->pid, (cur->taken_ns - page->started_ns) / 1e9,
+           prev ? "" : " (totals since start)");
+
+    printf("  %-22s %12s %10s\n", "counter", "total", "per s");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        uint64_t delta = cur->counters[i] - (prev ? prev->counters[i] : 0);
+        printf("  %-22s %12llu %10.1f\n", metrics_counter_name((MetricCounter)i),
+               (unsigned long long)cur->counters[i], seconds > 0 ? delta / seconds : 0.0);
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        printf("  %-22s %12lld\n", metrics_gauge_name((MetricGauge)i), (long long)cur->gauges[i]);
+    }
+
+    printf("  %-22s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean", "p50 <=", "p99 <=", "max");
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+        uint64_t count = cur->count[h] - (prev ? prev->count[h] : 0);
+        uint64_t sum = cur->sum_ns[h] - (prev ? prev->sum_ns[h] : 0);
+
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+            buckets[b] = cur->buckets[h][b] - (prev ? prev->buckets[h][b] : 0);
+        }
+        printf("  %-22s %10llu", metrics_histogram_name((MetricHistogram)h), (unsigned long long)count);
+        if (count == 0) {
+            printf(" %10s %10s %10s %10.0f\n", "-", "-", "-", cur->max_ns[h] / 1e3);
+            continue;
+        }
+        // The maximum is since start; intervals only narrow down the rest
+        printf(" %10.0f %10.0f %10.0f %10.0f\n", sum / 1e3 / count, bucket_percentile(buckets, count, 0.5),
+               bucket_percentile(buckets, count, 0.99), cur->max_ns[h] / 1e3);
+    }
+}
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -w, --watch SECONDS   Print what changed every SECONDS instead of the totals once\n");
+    printf("  -h, --help            Show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "watch", required_argument, NULL, 'w' },
+        { "help",  no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    double interval = 0.0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "w:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            interval = strtod(optarg, NULL);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const SonarpenMetrics *page = metrics_map();
+    if (page == NULL) {
+        return 1;
+    }
+
+    MetricsSnapshot prev, cur;
+    take_snapshot(page, &cur);
+    print_snapshot(page, &cur, NULL);
+
+    while (interval > 0) {
+        prev = cur;
+        usleep((useconds_t)(interval * 1e6));
+        // The driver clears the magic when it exits
+        if (page->magic != METRICS_MAGIC) {
+            printf("Driver stopped\n");
+            break;
+        }
+        take_snapshot(page, &cur);
+        printf("\n");
+        print_snapshot(page, &cur, &prev);
+        fflush(stdout);
+    }
+
+    metrics_unmap(page);
+    return 0;
+}
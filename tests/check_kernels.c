@@ -0,0 +1,254 @@
+#include "sonarpen.h"
+#include <stdarg.h>
+
+/* This page contains the checks of the fast kernels against their plain versions, run by make check */
+
+static int failures;
+
+// Report a failed check; keeps going so one run shows every mismatch
+static void fail(const char *what, const char *fmt, ...) {
+    va_list args;
+    printf("FAIL %s: ", what);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    failures++;
+}
+
+// Same samples on every run and every machine
+static uint32_t random_state = 12345;
+
+static int16_t random_sample(void) {
+    random_state = random_state * 1103515245u + 12345u;
+    return (int16_t)(random_state >> 16);
+}
+
+static void fill_samples(int16_t *samples, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = random_sample();
+    }
+    // Both extremes, so overflow in a vector lane shows up
+    if (count > 1) {
+        samples[0] = INT16_MIN;
+        samples[count - 1] = INT16_MAX;
+    }
+}
+
+static void fill_weights(float *weights, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        weights[i] = random_sample() / 32768.0f;
+    }
+}
+
+// Lengths around every vector width and the block length the detector uses
+static const size_t lengths[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 255, 256 };
+#define NUM_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+// Vector sums are accumulated in float lanes, so allow rounding relative to the magnitudes summed
+static int dot_matches(double got, double want, double magnitude) {
+    return fabs(got - want) <= 1e-5 * magnitude + 1e-6;
+}
+
+/**
+ * @brief dsp_sum_squares_s16() and dsp_deinterleave_s16() must match exactly.
+ */
+static void check_integer_kernels(void) {
+    int16_t samples[2 * DETECTOR_BLOCK_FRAMES * 3];
+    int16_t out[DETECTOR_BLOCK_FRAMES * 3];
+
+    for (size_t l = 0; l < NUM_LENGTHS; l++) {
+        size_t count = lengths[l];
+        fill_samples(samples, count);
+
+        uint64_t want = 0;
+        for (size_t i = 0; i < count; i++) {
+            want += (uint64_t)((int32_t)samples[i] * samples[i]);
+        }
+        uint64_t got = dsp_sum_squares_s16(samples, count);
+        if (got != want) {
+            fail("dsp_sum_squares_s16", "%zu samples: %llu, expected %llu", count,
+                 (unsigned long long)got, (unsigned long long)want);
+        }
+
+        for (unsigned int channels = 1; channels <= 3; channels++) {
+            fill_samples(samples, count * channels);
+            for (unsigned int channel = 0; channel < channels; channel++) {
+                dsp_deinterleave_s16(samples, channels, channel, out, count);
+                for (size_t i = 0; i < count; i++) {
+                    if (out[i] != samples[i * channels + channel]) {
+                        fail("dsp_deinterleave_s16", "%zu frames, channel %u of %u: frame %zu is %d, expected %d",
+                             count, channel, channels, i, out[i], samples[i * channels + channel]);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // In place, as the WAV reader uses it
+        fill_samples(samples, count * 2);
+        memcpy(out, samples, count * 2 * sizeof(int16_t));
+        dsp_deinterleave_s16(out, 2, 1, out, count);
+        for (size_t i = 0; i < count; i++) {
+            if (out[i] != samples[i * 2 + 1]) {
+                fail("dsp_deinterleave_s16", "%zu frames in place: frame %zu is %d, expected %d",
+                     count, i, out[i], samples[i * 2 + 1]);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief dsp_dot_s16() and dsp_dot4_s16() must match a double sum up to float rounding.
+ */
+static void check_dot_kernels(void) {
+    int16_t samples[DETECTOR_BLOCK_FRAMES];
+    float tables[4][DETECTOR_BLOCK_FRAMES];
+    const float *const weights[4] = { tables[0], tables[1], tables[2], tables[3] };
+
+    for (size_t l = 0; l < NUM_LENGTHS; l++) {
+        size_t count = lengths[l];
+        fill_samples(samples, count);
+        for (int k = 0; k < 4; k++) {
+            fill_weights(tables[k], count);
+        }
+
+        double want[4] = { 0 }, magnitude[4] = { 0 };
+        for (int k = 0; k < 4; k++) {
+            for (size_t i = 0; i < count; i++) {
+                want[k] += (double)tables[k][i] * samples[i];
+                magnitude[k] += fabs((double)tables[k][i] * samples[i]);
+            }
+        }
+
+        double got = dsp_dot_s16(tables[0], samples, count);
+        if (!dot_matches(got, want[0], magnitude[0])) {
+            fail("dsp_dot_s16", "%zu samples: %.6f, expected %.6f", count, got, want[0]);
+        }
+
+        double sums[4];
+        dsp_dot4_s16(weights, samples, count, sums);
+        for (int k = 0; k < 4; k++) {
+            if (!dot_matches(sums[k], want[k], magnitude[k])) {
+                fail("dsp_dot4_s16", "%zu samples, table %d: %.6f, expected %.6f", count, k, sums[k], want[k]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief pressure_curve_map_fixed() must follow pressure_curve_map() to within one step.
+ */
+static void check_pressure_curves(void) {
+    PressureCalibration calibrations[2];
+    pressure_calibration_default(&calibrations[0]);
+    calibrations[1].noise_floor = 20.0f;
+    calibrations[1].hover = 45.0f;
+    calibrations[1].light = 300.0f;
+    calibrations[1].full = 2500.0f;
+
+    for (int c = 0; c < 2; c++) {
+        PressureCurve curve;
+        if (pressure_curve_build(&curve, &calibrations[c]) < 0) {
+            fail("pressure_curve_build", "calibration %d rejected", c);
+            continue;
+        }
+
+        // Every fixed-point level from below zero to past full pressure
+        int32_t last = (int32_t)(calibrations[c].full * 1.1f) << LEVEL_FRAC_BITS;
+        for (int32_t level_q = -(1 << LEVEL_FRAC_BITS); level_q <= last; level_q++) {
+            int fixed = pressure_curve_map_fixed(&curve, level_q);
+            int reference = pressure_curve_map(&curve, (float)level_q / (1 << LEVEL_FRAC_BITS));
+            if (abs(fixed - reference) > 1 || fixed < 0 || fixed > PRESSURE_MAX) {
+                fail("pressure_curve_map_fixed", "calibration %d, level %.4f: %d, expected %d", c,
+                     (double)level_q / (1 << LEVEL_FRAC_BITS), fixed, reference);
+                break;
+            }
+        }
+    }
+}
+
+// Map one source point and compare with where it must land
+static void expect_point(const CoordTransform *transform, const char *setup, int x, int y, int want_x, int want_y) {
+    int got_x, got_y;
+    coord_transform_apply(transform, x, y, &got_x, &got_y);
+    if (abs(got_x - want_x) > 1 || abs(got_y - want_y) > 1) {
+        fail("coord_transform_apply", "%s: (%d, %d) -> (%d, %d), expected (%d, %d)", setup, x, y,
+             got_x, got_y, want_x, want_y);
+    }
+}
+
+/**
+ * @brief coord_transform_apply() must turn the corners of the surface the way each rotation says.
+ */
+static void check_coord_transforms(void) {
+    const struct input_absinfo axis_x = { .minimum = 0, .maximum = 1000 };
+    const struct input_absinfo axis_y = { .minimum = 0, .maximum = 500 };
+    const int M = COORD_OUTPUT_MAX;
+    // Where the top-left, top-right, bottom-left and bottom-right source corners land, clockwise rotations
+    static const struct {
+        int degrees;
+        int corners[4][2];
+    } rotations[] = {
+        {   0, { { 0, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 } } },
+        {  90, { { 1, 0 }, { 1, 1 }, { 0, 0 }, { 0, 1 } } },
+        { 180, { { 1, 1 }, { 0, 1 }, { 1, 0 }, { 0, 0 } } },
+        { 270, { { 0, 1 }, { 0, 0 }, { 1, 1 }, { 1, 0 } } },
+    };
+    const int source[4][2] = { { 0, 0 }, { 1000, 0 }, { 0, 500 }, { 1000, 500 } };
+
+    for (size_t r = 0; r < sizeof(rotations) / sizeof(rotations[0]); r++) {
+        CoordMapping mapping;
+        CoordTransform transform;
+        char setup[64];
+
+        coord_mapping_default(&mapping);
+        mapping.rotation = rotations[r].degrees;
+        snprintf(setup, sizeof(setup), "%d degrees", mapping.rotation);
+        if (coord_transform_build(&transform, &axis_x, &axis_y, &mapping) < 0) {
+            fail("coord_transform_build", "%s rejected", setup);
+            continue;
+        }
+        for (int i = 0; i < 4; i++) {
+            expect_point(&transform, setup, source[i][0], source[i][1],
+                         rotations[r].corners[i][0] * M, rotations[r].corners[i][1] * M);
+        }
+        expect_point(&transform, setup, 500, 250, M / 2, M / 2);
+
+        // The right half of the surface onto the top half of the tablet, edges clamped
+        mapping.region[0] = 0.5f;
+        mapping.region[2] = 0.5f;
+        mapping.area[3] = 0.5f;
+        snprintf(setup, sizeof(setup), "%d degrees, region and area", mapping.rotation);
+        if (coord_transform_build(&transform, &axis_x, &axis_y, &mapping) < 0) {
+            fail("coord_transform_build", "%s rejected", setup);
+            continue;
+        }
+        for (int i = 0; i < 4; i++) {
+            int x = source[i][0] == 0 ? 500 : 1000;
+            expect_point(&transform, setup, x, source[i][1],
+                         rotations[r].corners[i][0] * M, rotations[r].corners[i][1] * M / 2);
+            expect_point(&transform, setup, source[i][0] == 0 ? 0 : 1000, source[i][1],
+                         rotations[r].corners[i][0] * M, rotations[r].corners[i][1] * M / 2);
+        }
+    }
+
+    CoordMapping mapping;
+    CoordTransform transform;
+    coord_mapping_default(&mapping);
+    mapping.rotation = 45;
+    if (coord_transform_build(&transform, &axis_x, &axis_y, &mapping) == 0) {
+        fail("coord_transform_build", "45 degrees accepted");
+    }
+}
+
+int main(void) {
+    check_integer_kernels();
+    check_dot_kernels();
+    check_pressure_curves();
+    check_coord_transforms();
+
+    printf("Kernel checks with %s kernels: %s\n", dsp_kernel_name(), failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}